@@ -3,6 +3,8 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 #include "omfs.h"
 #include "dirscan.h"
 #include "check.h"
@@ -10,13 +12,13 @@
 #include "fix.h"
 #include "bits.h"
 #include "io.h"
+#include "checkpoint.h"
 
 /*
  * TODO: 
  *
  * - check hash table index
  * - clear extents from free bitmap and make sure free bitmap is null
- * - sanity check block size, sys block size, mirrors, etc
  * - check that extent count is valid
  * - check that terminator matches
  * - make sure file sizes match up
@@ -51,6 +53,117 @@ int check_header(u8 *blk)
 	return (xor == oi->i_head.h_check_xor);
 }
 
+/*
+ *  Level 0: the super block, the root block and its mirrors, the root
+ *  directory and the reserved area of the bitmap.  That's at most
+ *  mirrors + 2 block reads, whatever the size of the filesystem.
+ */
+int check_super(check_context_t *ctx)
+{
+	omfs_info_t *info = ctx->omfs_info;
+	omfs_super_t *super = info->super;
+	omfs_root_t *root = info->root;
+	u64 num_blocks = swap_be64(super->s_num_blocks);
+	u64 root_blk = swap_be64(super->s_root_block);
+	u64 root_dir = swap_be64(root->r_root_dir);
+	u64 bitmap_blk = swap_be64(root->r_bitmap);
+	int blocksize = swap_be32(super->s_blocksize);
+	int sys_blocksize = swap_be32(super->s_sys_blocksize);
+	int mirrors = swap_be32(super->s_mirrors);
+	int clustersize = swap_be32(root->r_clustersize);
+	u64 bsize, first_blk;
+	omfs_inode_t *inode;
+	u8 *buf;
+	int i, is_ok = 1;
+
+	if (blocksize < 2048 || blocksize > OMFS_MAX_BLOCK_SIZE ||
+	    !is_power_of_two(blocksize))
+	{
+		fix_problem(E_BLOCKSIZE, ctx);
+		return 0;
+	}
+	if (sys_blocksize <= OMFS_EXTENT_START || sys_blocksize > blocksize ||
+	    !is_power_of_two(sys_blocksize))
+	{
+		fix_problem(E_SYS_BLOCKSIZE, ctx);
+		return 0;
+	}
+	if (mirrors < 1 || mirrors > 8)
+	{
+		fix_problem(E_MIRRORS, ctx);
+		return 0;
+	}
+
+	if (info->dev->ops->size(info->dev) / blocksize < num_blocks)
+	{
+		fix_problem(E_DEVICE_SIZE, ctx);
+		is_ok = 0;
+	}
+
+	if (root_blk + mirrors > num_blocks ||
+	    swap_be64(root->r_head.h_self) != root_blk ||
+	    swap_be64(root->r_num_blocks) != num_blocks ||
+	    swap_be32(root->r_blocksize) != blocksize ||
+	    clustersize < 1 || clustersize > num_blocks ||
+	    root_dir >= num_blocks ||
+	    (bitmap_blk != ~0 && bitmap_blk >= num_blocks))
+	{
+		fix_problem(E_ROOT_BLOCK, ctx);
+		return 0;
+	}
+
+	// older mkomfs left these unset
+	if ((!check_header((u8 *) root) || !check_crc((u8 *) root)) &&
+	    !fix_problem(E_ROOT_CHECKSUM, ctx))
+		is_ok = 0;
+
+	// the rewrite covers the mirrors too
+	for (i=1; i < mirrors && !ctx->fix_root; i++)
+	{
+		buf = omfs_get_block(info, root_blk + i);
+		if (!buf || memcmp(buf, root, sizeof(*root)))
+		{
+			fix_problem(E_ROOT_MIRROR, ctx);
+			is_ok = 0;
+			free(buf);
+			break;
+		}
+		free(buf);
+	}
+
+	inode = omfs_get_inode(info, root_dir);
+	if (!inode || inode->i_head.h_magic != OMFS_IMAGIC ||
+	    swap_be64(inode->i_head.h_self) != root_dir ||
+	    inode->i_type != OMFS_DIR)
+	{
+		fix_problem(E_ROOT_DIR, ctx);
+		is_ok = 0;
+	}
+	omfs_release_inode(inode);
+
+	if (bitmap_blk == ~0)
+		return is_ok;
+
+	// everything up to the end of the bitmap must be in use
+	bsize = (num_blocks + 7) / 8;
+	first_blk = bitmap_blk + (bsize + blocksize - 1) / blocksize;
+	if (first_blk > blocksize * 8)
+		first_blk = blocksize * 8;
+
+	buf = omfs_get_block(info, bitmap_blk);
+	for (i=0; buf && i < first_blk; i++)
+		if (!test_bit(buf, i))
+			break;
+	if (!buf || i < first_blk)
+	{
+		fix_problem(E_BITMAP_RESERVED, ctx);
+		is_ok = 0;
+	}
+	free(buf);
+
+	return is_ok;
+}
+
 int check_sanity(check_context_t *ctx)
 {
 	omfs_inode_t *inode = ctx->current_inode;
@@ -95,35 +208,23 @@ int check_bitmap(check_context_t *ctx)
 	}
 	if (!is_ok) 
 	{
-		fix_problem(E_BITMAP, ctx);
+		is_ok = fix_problem(E_BITMAP, ctx);
 	}
 	return is_ok;
 }
 
 void visit_extents(check_context_t *ctx)
 {
-	struct omfs_extent *oe;
+	struct omfs_extent_iter it;
 	struct omfs_extent_entry *entry;
-	u64 last, next;
 	int extent_count, i;
-	u8 *buf;
-
-	next = ctx->block;
-	buf = omfs_get_block(ctx->omfs_info, next);
-	if (!buf)
-		return;
-
-	oe = (struct omfs_extent *) &buf[OMFS_EXTENT_START];
 
-	for(;;) 
+	omfs_extent_begin(ctx->omfs_info, ctx->block, ctx->current_inode,
+		&it);
+	while (omfs_extent_next(&it) > 0)
 	{
-		extent_count = swap_be32(oe->e_extent_count);
-		last = next;
-		next = swap_be64(oe->e_next);
-		entry = &oe->e_entry;
-
-		// ignore last entry as it is the terminator
-		for (; extent_count > 1; extent_count--)
+		entry = &it.table->e_entry;
+		for (extent_count = it.count; extent_count; extent_count--)
 		{
 			u64 start = swap_be64(entry->e_cluster);
 
@@ -133,23 +234,27 @@ void visit_extents(check_context_t *ctx)
 			entry++;
 		}
 
-		set_bit(ctx->visited, last);
-		set_bit(ctx->visited, last+1);
-
-		if (next == ~0)
-			break;
-
-		free(buf);
-		buf = omfs_get_block(ctx->omfs_info, next);
-		if (!buf)
-			goto err;
-		oe = (struct omfs_extent *) &buf[OMFS_EXTENT_CONT];
+		set_bit(ctx->visited, it.block);
+		set_bit(ctx->visited, it.block+1);
 	}
-	free(buf);
-err:
-	return;
+	omfs_extent_end(&it);
 }
 	
+/*
+ *  Drop an inode we've decided to delete: its blocks shouldn't count
+ *  as in use, and its children won't be linked any more.  Its
+ *  siblings stay in the chain unless the inode is too broken to
+ *  trust its sibling pointer.
+ */
+static void forget_inode(check_context_t *ctx, int keep_siblings)
+{
+	int i;
+
+	for (i=0; i < swap_be32(ctx->omfs_info->super->s_mirrors); i++)
+		clear_bit(ctx->visited, ctx->block + i);
+	ctx->prune = keep_siblings ? DIRSCAN_SKIP_CHILDREN : DIRSCAN_PRUNE;
+}
+
 int check_inode(check_context_t *ctx)
 {
 	int i;
@@ -159,6 +264,8 @@ int check_inode(check_context_t *ctx)
 	if (test_bit(ctx->visited, ctx->block))
 	{
 		fix_problem(E_LOOP, ctx);
+		/* never follow a loop, whether or not it gets cut */
+		ctx->prune = DIRSCAN_PRUNE;
 		return 0;
 	}
 	for (i=0; i < swap_be32(ctx->omfs_info->super->s_mirrors); i++)
@@ -166,100 +273,417 @@ int check_inode(check_context_t *ctx)
 
 	if (!check_sanity(ctx))
 	{
-		fix_problem(E_INSANE, ctx);
+		if (fix_problem(E_INSANE, ctx))
+			forget_inode(ctx, 0);
 		return 0;
 	}
-	if (!check_header((u8 *)inode)) 
+	if (swap_be64(inode->i_head.h_self) != ctx->block)
 	{
-		fix_problem(E_HEADER_XOR, ctx);
+		if (fix_problem(E_SELF_PTR, ctx))
+		{
+			forget_inode(ctx, 1);
+			return 0;
+		}
 		ret = 0;
 	}
-	if (!check_crc((u8 *)inode)) 
+	if (swap_be64(inode->i_parent) != ctx->parent)
 	{
-		fix_problem(E_HEADER_CRC, ctx);
+		if (fix_problem(E_PARENT_PTR, ctx))
+		{
+			forget_inode(ctx, 1);
+			return 0;
+		}
 		ret = 0;
 	}
-	if (swap_be64(inode->i_head.h_self) != ctx->block)
+	if (omfs_compute_hash(ctx->omfs_info, inode->i_name) != ctx->hash)
 	{
-		fix_problem(E_SELF_PTR, ctx);
+		fix_problem(E_HASH_WRONG, ctx);
 		ret = 0;
 	}
-	if (swap_be64(inode->i_parent) != ctx->parent)
+
+	/*
+	 * Unchanged since it was verified here, so skip the checksums and
+	 * the extent walk.  Where it was found from may have changed,
+	 * hence the pointer and hash checks above.  Directories are still
+	 * descended: a change deep in the tree doesn't show up in the
+	 * blocks of its ancestors.
+	 */
+	if (ret && ctx->incremental && fp_unchanged(ctx->db, ctx->block, inode))
+	{
+		ctx->skipped++;
+		return 1;
+	}
+
+	if (!check_header((u8 *)inode)) 
 	{
-		fix_problem(E_PARENT_PTR, ctx);
+		fix_problem(E_HEADER_XOR, ctx);
 		ret = 0;
 	}
-	if (omfs_compute_hash(ctx->omfs_info, inode->i_name) != ctx->hash)
+	if (!check_crc((u8 *)inode)) 
 	{
-		fix_problem(E_HASH_WRONG, ctx);
+		fix_problem(E_HEADER_CRC, ctx);
 		ret = 0;
 	}
-	if (inode->i_type == OMFS_FILE)
+	if (inode->i_type == OMFS_FILE && ctx->config->level >= CHECK_FULL)
 	{
+		phase_begin(&ctx->stats, PHASE_EXTENTS);
 		visit_extents(ctx);
+		phase_end(&ctx->stats, PHASE_EXTENTS);
 	}
 
+	if (ret && ctx->db)
+		fp_update(ctx->db, ctx->block, inode);
 	return ret;
 }
 
 static int on_node(dirscan_t *d, dirscan_entry_t *entry, void *user)
 {
 	check_context_t *ctx = (check_context_t *) user;
+	int res;
 
 	ctx->current_inode = entry->inode;
 	ctx->block = entry->block;
 	ctx->parent = entry->parent;
+	ctx->link = entry->link;
+	ctx->hash = entry->hindex;
+	ctx->prune = 0;
+	ctx->stats.inodes++;
+	res = check_inode(ctx);
+	entry->prune = ctx->prune;
+	progress_update(ctx, PHASE_TRAVERSAL, 0);
+
+	if (ctx->deadline && time(NULL) >= ctx->deadline)
+		d->stop = 1;
+	if (ctx->config->io_budget)
+	{
+		struct omfs_stats st;
+
+		omfs_get_stats(ctx->omfs_info, &st);
+		if (omfs_stats_bytes(&st, 0) >= ctx->config->io_budget)
+			d->stop = 1;
+	}
+	return res;
+}
+
+/*
+ *  An inode we couldn't read.  Whatever points at it is a dangling
+ *  pointer; until that's cut, the blocks it owns are unknown.
+ */
+static void on_read_error(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	check_context_t *ctx = (check_context_t *) user;
+
+	ctx->current_inode = NULL;
+	ctx->block = entry->block;
+	ctx->parent = entry->parent;
+	ctx->link = entry->link;
 	ctx->hash = entry->hindex;
-	return check_inode(ctx);
+	/* a block seen already was checked then; only the way back is bad */
+	if (entry->repeat)
+		fix_problem(E_LOOP, ctx);
+	else if (!fix_problem(E_UNREADABLE, ctx))
+		ctx->unreadable++;
 }
 
-int check_fs(FILE *fp, check_fs_config_t *config)
+/*
+ *  Pick up where a budgeted check left off, reporting again what it
+ *  found.  Returns 1 if there was a checkpoint to resume.
+ */
+static int resume(check_context_t *ctx)
 {
+	char *path = ctx->config->checkpoint_file;
+	int i, res;
+
+	res = checkpoint_load(ctx, path);
+	if (res < 0)
+	{
+		fprintf(stderr, "omfsck: %s: %s\n", path, strerror(-res));
+		return res;
+	}
+	if (!res)
+		return 0;
+
+	if (!ctx->config->is_quiet)
+		printf("Resuming check from %s\n", path);
+
+	/* none of these were repaired; budgeted checks are read-only */
+	for (i=0; i < ctx->num_findings; i++)
+	{
+		struct finding *f = &ctx->findings[i];
+
+		ctx->block = f->block;
+		ctx->parent = f->parent;
+		ctx->hash = f->hash;
+		if (!ctx->config->is_quiet)
+			fix_report(f->error, ctx);
+		if (f->error == E_UNREADABLE)
+			ctx->unreadable++;
+		ctx->unfixed++;
+	}
+	return 1;
+}
+
+/*
+ *  Out of budget: save what we have for the next run.
+ */
+static int pause_check(check_context_t *ctx)
+{
+	char *path = ctx->config->checkpoint_file;
 	int res;
+
+	if ((res = checkpoint_save(ctx, path)))
+	{
+		fprintf(stderr, "omfsck: %s: %s\n", path, strerror(-res));
+		return 0;
+	}
+	ctx->config->stopped = 1;
+	if (!ctx->config->is_quiet)
+		printf("Check stopped at budget; run again with the same "
+			"checkpoint to continue\n");
+	return !ctx->unfixed;
+}
+
+/*
+ *  Blocks in use, for the progress ETA.  Below level 2 the bitmap is
+ *  only loaded for this, so let it go again.
+ */
+static void estimate_in_use(check_context_t *ctx)
+{
+	omfs_info_t *info = ctx->omfs_info;
+
+	ctx->stats.in_use = swap_be64(info->super->s_num_blocks) - 
+		omfs_count_free(info);
+
+	if (ctx->config->level >= CHECK_FULL)
+	{
+		ctx->bitmap = info->bitmap->bmap;
+		return;
+	}
+	free(info->bitmap->bmap);
+	free(info->bitmap->dirty);
+	free(info->bitmap);
+	info->bitmap = NULL;
+}
+
+static int run_check(check_context_t *ctx)
+{
+	check_fs_config_t *config = ctx->config;
+	omfs_info_t *info = ctx->omfs_info;
+	int res, scan_failed;
+	int bsize, count;
+	fp_db_t db;
+
+	ctx->stats.timed = config->report != REPORT_NONE;
+	phase_begin(&ctx->stats, PHASE_SUPER);
+	if ((res = omfs_read_super(info)))
+	{
+		fix_problem(res == -EMEDIUMTYPE ? E_MAGIC : E_READ_SUPER, ctx);
+		return 0;
+	}
+	if (omfs_read_root_block(info))
+	{
+		fix_problem(E_READ_ROOT, ctx);
+		return 0;
+	}
+
+	res = check_super(ctx);
+	phase_end(&ctx->stats, PHASE_SUPER);
+	if (!res)
+		return 0;
+
+	if (config->undo_file && 
+	    (res = omfs_undo_open(info, config->undo_file)))
+	{
+		fprintf(stderr, "omfsck: %s: %s\n", config->undo_file, 
+			strerror(-res));
+		return 0;
+	}
+
+	/* check_super's repair, before anything else reads the root */
+	if (ctx->fix_root && (count = fix_apply(ctx)))
+		printf("Made %d repair%s\n", count, count == 1 ? "" : "s");
+
+	if (config->level == CHECK_SUPER)
+	{
+		res = !ctx->unfixed;
+		goto out;
+	}
+	if (config->sample)
+	{
+		phase_begin(&ctx->stats, PHASE_TRAVERSAL);
+		res = sample_fs(ctx, config->sample) && !ctx->unfixed;
+		phase_end(&ctx->stats, PHASE_TRAVERSAL);
+		goto out;
+	}
+
+	if (config->index_file)
+	{
+		if ((res = fp_load(&db, config->index_file, info)))
+			fprintf(stderr, "omfsck: %s: %s\n", config->index_file,
+				strerror(-res));
+
+		ctx->db = &db;
+		ctx->incremental = !config->force && db.count && 
+			db.runs < FP_FULL_INTERVAL;
+		if (!ctx->incremental)
+			fp_reset(&db);
+	}
+
+	if (config->level >= CHECK_FULL || config->progress_fd >= 0)
+	{
+		progress_update(ctx, PHASE_BITMAP_LOAD, 1);
+		phase_begin(&ctx->stats, PHASE_BITMAP_LOAD);
+		if (!omfs_load_bitmap(info))
+			estimate_in_use(ctx);
+		phase_end(&ctx->stats, PHASE_BITMAP_LOAD);
+	}
+	bsize = (swap_be64(info->super->s_num_blocks) + 7) / 8;
+	ctx->visited = calloc(1, bsize);
+
+	phase_begin(&ctx->stats, PHASE_TRAVERSAL);
+	progress_update(ctx, PHASE_TRAVERSAL, 1);
+	ctx->scan = dirscan_init(info, on_node, ctx);
+	res = ctx->scan ? 0 : -ENOMEM;
+	if (!res)
+		ctx->scan->read_error = on_read_error;
+	if (!res && config->checkpoint_file)
+		res = resume(ctx);
+	if (!res)
+		res = dirscan_push(ctx->scan, swap_be64(info->root->r_root_dir), 
+			0, 0, ~0, ~0);
+	if (res >= 0)
+	{
+		if (config->time_budget)
+			ctx->deadline = time(NULL) + config->time_budget;
+		res = dirscan_run(ctx->scan);
+		ctx->current_inode = NULL;
+	}
+	phase_end(&ctx->stats, PHASE_TRAVERSAL);
+	scan_failed = res < 0;
+
+	if (!scan_failed && ctx->scan->stop && 
+	    !stack_empty(ctx->scan->pending))
+	{
+		res = pause_check(ctx);
+		goto out;
+	}
+	if (config->checkpoint_file && !scan_failed)
+		unlink(config->checkpoint_file);
+
+	/* make all the repairs at once, then rebuild the bitmap once */
+	phase_begin(&ctx->stats, PHASE_REPAIR);
+	progress_update(ctx, PHASE_REPAIR, 1);
+	count = fix_apply(ctx);
+	phase_end(&ctx->stats, PHASE_REPAIR);
+	if (count)
+		printf("Made %d repair%s\n", count, count == 1 ? "" : "s");
+
+	/*
+	 * The repairs found so far stand, but with part of the tree
+	 * unscanned the bitmap can't be judged.  FIXME error codes are
+	 * all over the place.
+	 */
+	if (scan_failed || ctx->unreadable)
+	{
+		fix_problem(E_SCAN, ctx);
+		res = 0;
+		goto out;
+	}
+
+	/* files we skipped haven't had their extents counted */
+	if (ctx->incremental || config->level < CHECK_FULL)
+	{
+		res = !ctx->unfixed;
+		if (ctx->incremental && !config->is_quiet)
+			printf("Incremental check; %" PRIu64 " unchanged "
+				"inodes skipped\n", ctx->skipped);
+	}
+	else
+	{
+		phase_begin(&ctx->stats, PHASE_BITMAP_COMPARE);
+		progress_update(ctx, PHASE_BITMAP_COMPARE, 1);
+		res = check_bitmap(ctx) && !ctx->unfixed;
+		phase_end(&ctx->stats, PHASE_BITMAP_COMPARE);
+	}
+
+	if (ctx->db)
+	{
+		if (ctx->incremental || config->level < CHECK_FULL)
+			db.runs++;
+		else
+			db.runs = 0;
+		fp_prune(&db);
+		if ((count = fp_save(&db, config->index_file)))
+			fprintf(stderr, "omfsck: %s: %s\n", 
+				config->index_file, strerror(-count));
+		fp_reset(&db);
+	}
+	
+out:
+	if (ctx->scan)
+		dirscan_end(ctx->scan);
+	if (ctx->db)
+		fp_reset(&db);
+	if (ctx->bitmap) 
+		free(ctx->bitmap);
+	free(ctx->visited);
+
+	if (info->undo && (count = omfs_undo_close(info)))
+	{
+		fprintf(stderr, "omfsck: %s: %s\n", config->undo_file, 
+			strerror(-count));
+		res = 0;
+	}
+	return res;
+}
+
+int check_fs(omfs_dev_t *dev, check_fs_config_t *config)
+{
+	int res, err;
 	check_context_t ctx;
-	int bsize;
 	omfs_super_t super;
 	omfs_root_t root;
 	omfs_info_t info = { 
-		.dev = fp, 
+		.dev = dev, 
 		.super = &super,
 		.root = &root
 	};
 
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&super, 0, sizeof(super));
 	ctx.config = config;
+	ctx.omfs_info = &info;
 
-	if (omfs_read_super(&info))
-	{
-		fix_problem(E_READ_SUPER, &ctx);
-		return 0;
-	}
-	if (omfs_read_root_block(&info))
+	if (config->trace_file && (err = omfs_trace_open(&info, 
+	    config->trace_file)))
 	{
-		fix_problem(E_READ_ROOT, &ctx);
+		fprintf(stderr, "omfsck: %s: %s\n", config->trace_file, 
+			strerror(-err));
 		return 0;
 	}
 
-	ctx.omfs_info = &info;
-	omfs_load_bitmap(&info);
-	ctx.bitmap = info.bitmap->bmap;
-	bsize = (swap_be64(info.super->s_num_blocks) + 7) / 8;
-	ctx.visited = calloc(1, bsize);
+	clock_gettime(CLOCK_MONOTONIC, &ctx.stats.start);
+	res = run_check(&ctx);
+	progress_done(&ctx);
 
-	/* FIXME error codes are all over the place. */
-	res = dirscan_begin(&info, on_node, &ctx);
+	if ((err = omfs_trace_close(&info)))
+	{
+		fprintf(stderr, "omfsck: %s: %s\n", config->trace_file, 
+			strerror(-err));
+		res = 0;
+	}
 
-	if (res < 0)
+	if (config->verbose)
 	{
-		fix_problem(E_SCAN, &ctx);
-		return 0;
+		struct omfs_stats stats;
+
+		omfs_get_stats(&info, &stats);
+		omfs_print_stats(stdout, &stats);
 	}
-	if (res != 0)
-		return 0;
 
-	res = check_bitmap(&ctx);
-	
-	if (ctx.bitmap) 
-		free(ctx.bitmap);
-	free(ctx.visited);
+	if (config->report && (err = report_write(&ctx, res)))
+		fprintf(stderr, "omfsck: %s: %s\n", config->report_file, 
+			strerror(-err));
+	free(ctx.findings);
 	return res;
 }
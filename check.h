@@ -1,12 +1,62 @@
 #ifndef _CHECK_H
 #define _CHECK_H
 
+#include <time.h>
 #include "config.h"
 #include "omfs.h"
+#include "fingerprint.h"
+#include "report.h"
+
+struct repair;
+struct dirscan;
+
+/* a problem found, for the record */
+struct finding
+{
+	u64 block;
+	u64 parent;
+	u32 error;		/* check_error_t */
+	s32 hash;
+};
+
+typedef enum
+{
+	FIX_ASK,		/* prompt for every repair */
+	FIX_YES,		/* -y: make every repair */
+	FIX_NO,			/* -n: make no repairs, open read-only */
+	FIX_PREEN		/* -p: make only the safe repairs */
+} fix_mode_t;
+
+/*
+ *  How thorough to be.  Each level does everything the one below does.
+ */
+typedef enum
+{
+	CHECK_SUPER,		/* super and root block, a few reads */
+	CHECK_STRUCTURE,	/* + every inode, one read each */
+	CHECK_FULL		/* + extent chains and the free bitmap */
+} check_level_t;
 
 typedef struct _check_fs_config
 {
 	int is_quiet;
+	fix_mode_t fix_mode;
+	check_level_t level;
+	char *undo_file;	/* save overwritten blocks here */
+	char *index_file;	/* fingerprints for incremental checks */
+	int force;		/* full check even if incremental is ok */
+	int sample;		/* only check this many random blocks */
+	char *checkpoint_file;	/* resume from / stop to here */
+	int time_budget;	/* seconds before stopping, or 0 */
+	u64 io_budget;		/* bytes read before stopping, or 0 */
+	int stopped;		/* out: stopped early, checkpoint written */
+	int changed;		/* out: repairs were written */
+	report_format_t report;	/* summary to write at the end */
+	char *report_file;	/* where, or stdout */
+	char *device;		/* for the report */
+	int progress_fd;	/* -C: write progress here, or -1 */
+	int verbose;		/* print I/O stats at the end */
+	char *trace_file;	/* record every block access here */
 } check_fs_config_t;
 
 typedef enum 
@@ -31,7 +81,14 @@ typedef enum
 	E_READ_ROOT,
 	E_INSANE,
 	E_SCAN,
-	E_LOOP
+	E_LOOP,
+	E_DEVICE_SIZE,
+	E_ROOT_BLOCK,
+	E_ROOT_CHECKSUM,
+	E_ROOT_MIRROR,
+	E_ROOT_DIR,
+	E_BITMAP_RESERVED,
+	E_UNREADABLE
 } check_error_t;
 
 typedef struct check_context
@@ -43,10 +100,29 @@ typedef struct check_context
 	omfs_info_t *omfs_info;
 	u64 parent;                /* parent inode number */
 	u64 block;
+	u64 link;                  /* parent or previous sibling */
 	int hash;
+	int prune;                 /* don't descend from current inode */
+	int unfixed;               /* problems left unrepaired */
+	struct repair *repairs;    /* queued repairs, in scan order */
+	struct repair *last_repair;
+	int fix_root;              /* rewrite the root block's checksums */
+	fp_db_t *db;               /* verified inodes, if keeping an index */
+	int incremental;           /* skip inodes the index vouches for */
+	u64 skipped;
+	struct dirscan *scan;
+	u64 unreadable;            /* inodes unread and still linked */
+	time_t deadline;           /* stop the scan after this, or 0 */
+	struct finding *findings;
+	int num_findings;
+	int findings_size;
+	check_stats_t stats;
 } check_context_t;
 
-int check_fs(FILE *fp, check_fs_config_t *config);
+int check_fs(omfs_dev_t *dev, check_fs_config_t *config);
+int check_header(u8 *blk);
+int check_crc(u8 *blk);
+int sample_fs(check_context_t *ctx, int count);
 int check_fix(check_context_t *fix, check_error_t error_code);
 
 #endif
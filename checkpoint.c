@@ -0,0 +1,237 @@
+/*
+ *  checkpoint.c - save and restore a partial check.
+ *
+ *  A check that runs out of time or I/O budget writes out everything
+ *  it would need to carry on: the entries dirscan has yet to visit,
+ *  the problems found so far and the map of blocks already visited.
+ *  The next run with the same checkpoint file picks up from there.
+ *
+ *  The file is a header, the pending entries top of stack first, the
+ *  findings, then the visited map run-length encoded as (count, byte)
+ *  pairs, which keeps it small on a mostly unvisited or mostly visited
+ *  disk.  Everything is stored big-endian, like the filesystem.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "checkpoint.h"
+
+#define CKPT_MAGIC "OMFSCKPT"
+
+struct ckpt_header
+{
+	char magic[8];
+	u32 version;
+	u32 level;
+	u64 num_blocks;
+	u64 root_dir;
+	u64 pending;		/* entries */
+	u64 findings;
+	u64 runs;		/* run-length pairs in the visited map */
+};
+
+struct ckpt_entry
+{
+	u64 block;
+	u64 parent;
+	u64 link;
+	s32 level;
+	s32 hindex;
+};
+
+struct ckpt_run
+{
+	u32 count;
+	u8 value;
+	u8 pad[3];
+};
+
+static void swap_finding(struct finding *f)
+{
+	f->block = swap_be64(f->block);
+	f->parent = swap_be64(f->parent);
+	f->error = swap_be32(f->error);
+	f->hash = swap_be32(f->hash);
+}
+
+static int write_visited(FILE *fp, u8 *map, u64 size, u64 *runs)
+{
+	struct ckpt_run run;
+	u64 i, j;
+
+	*runs = 0;
+	for (i=0; i < size; i = j)
+	{
+		for (j=i; j < size && map[j] == map[i] && j - i < ~0U; j++)
+			;
+		memset(&run, 0, sizeof(run));
+		run.count = swap_be32(j - i);
+		run.value = map[i];
+		if (fwrite(&run, sizeof(run), 1, fp) != 1)
+			return -EIO;
+		(*runs)++;
+	}
+	return 0;
+}
+
+static int read_visited(FILE *fp, u8 *map, u64 size, u64 runs)
+{
+	struct ckpt_run run;
+	u64 pos = 0, count;
+
+	while (runs--)
+	{
+		if (fread(&run, sizeof(run), 1, fp) != 1)
+			return -EIO;
+		count = swap_be32(run.count);
+		if (pos + count > size)
+			return -EINVAL;
+		memset(map + pos, run.value, count);
+		pos += count;
+	}
+	return (pos == size) ? 0 : -EINVAL;
+}
+
+int checkpoint_save(check_context_t *ctx, char *path)
+{
+	struct ckpt_header hdr;
+	stack_t *node;
+	omfs_info_t *info = ctx->omfs_info;
+	u64 num_blocks = swap_be64(info->super->s_num_blocks);
+	u64 count = 0, runs;
+	FILE *fp;
+	int i, ret = 0;
+
+	for (node = ctx->scan->pending->next; node; node = node->next)
+		count++;
+
+	/* header goes in last, once we know the run count */
+	memset(&hdr, 0, sizeof(hdr));
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		ret = -EIO;
+
+	for (node = ctx->scan->pending->next; node && !ret; node = node->next)
+	{
+		dirscan_entry_t *entry = node->data;
+		struct ckpt_entry e = {
+			.block = swap_be64(entry->block),
+			.parent = swap_be64(entry->parent),
+			.link = swap_be64(entry->link),
+			.level = swap_be32(entry->level),
+			.hindex = swap_be32(entry->hindex)
+		};
+		if (fwrite(&e, sizeof(e), 1, fp) != 1)
+			ret = -EIO;
+	}
+	for (i=0; i < ctx->num_findings && !ret; i++)
+	{
+		struct finding f = ctx->findings[i];
+		swap_finding(&f);
+		if (fwrite(&f, sizeof(f), 1, fp) != 1)
+			ret = -EIO;
+	}
+	if (!ret)
+		ret = write_visited(fp, ctx->visited, (num_blocks + 7) / 8, 
+			&runs);
+
+	if (!ret)
+	{
+		memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+		hdr.version = swap_be32(1);
+		hdr.level = swap_be32(ctx->config->level);
+		hdr.num_blocks = swap_be64(num_blocks);
+		hdr.root_dir = info->root->r_root_dir;
+		hdr.pending = swap_be64(count);
+		hdr.findings = swap_be64(ctx->num_findings);
+		hdr.runs = swap_be64(runs);
+		if (fseek(fp, 0, SEEK_SET) || 
+		    fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+			ret = -EIO;
+	}
+	if (fclose(fp))
+		ret = -EIO;
+	return ret;
+}
+
+/*
+ *  Restore a checkpoint into ctx and its dirscan.  Returns 1 if one
+ *  was loaded, 0 if there is none to resume (no file, or one taken
+ *  of a different filesystem or at a different level), or -errno.
+ */
+int checkpoint_load(check_context_t *ctx, char *path)
+{
+	struct ckpt_header hdr;
+	struct ckpt_entry *entries = NULL;
+	omfs_info_t *info = ctx->omfs_info;
+	u64 num_blocks = swap_be64(info->super->s_num_blocks);
+	u64 i, count, nfind;
+	FILE *fp;
+	int ret = 1;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) ||
+	    swap_be32(hdr.level) != ctx->config->level ||
+	    swap_be64(hdr.num_blocks) != num_blocks ||
+	    hdr.root_dir != info->root->r_root_dir)
+	{
+		ret = 0;
+		goto out;
+	}
+
+	count = swap_be64(hdr.pending);
+	nfind = swap_be64(hdr.findings);
+
+	entries = malloc(count * sizeof(*entries) + 1);
+	ctx->findings = malloc(nfind * sizeof(struct finding) + 1);
+	if (!entries || !ctx->findings)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (fread(entries, sizeof(*entries), count, fp) != count ||
+	    fread(ctx->findings, sizeof(struct finding), nfind, fp) != nfind)
+	{
+		ret = -EIO;
+		goto out;
+	}
+	ctx->num_findings = ctx->findings_size = nfind;
+	for (i=0; i < nfind; i++)
+		swap_finding(&ctx->findings[i]);
+
+	if ((ret = read_visited(fp, ctx->visited, (num_blocks + 7) / 8, 
+	    swap_be64(hdr.runs))))
+		goto out;
+
+	/* saved top first, so push bottom first */
+	for (i=count; i-- > 0; )
+	{
+		struct ckpt_entry *e = &entries[i];
+		if (dirscan_push(ctx->scan, swap_be64(e->block), 
+		    swap_be32(e->level), swap_be32(e->hindex), 
+		    swap_be64(e->parent), swap_be64(e->link)))
+		{
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	ret = 1;
+out:
+	if (ret <= 0)
+	{
+		free(ctx->findings);
+		ctx->findings = NULL;
+		ctx->num_findings = ctx->findings_size = 0;
+	}
+	free(entries);
+	fclose(fp);
+	return ret;
+}
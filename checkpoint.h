@@ -0,0 +1,10 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include "check.h"
+#include "dirscan.h"
+
+int checkpoint_save(check_context_t *ctx, char *path);
+int checkpoint_load(check_context_t *ctx, char *path);
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 
 #include "omfs.h"
 #include "create_fs.h"
@@ -21,7 +22,7 @@ void safe_strncpy(char *dest, char *src, int dest_size)
 	dest[dest_size-1] = 0;
 }
 
-void clear_dev(FILE *fp, u64 sectors)
+void clear_dev(omfs_dev_t *dev, u64 sectors)
 {
 	int i; 
 	char blk[SECTOR_SIZE];
@@ -31,23 +32,24 @@ void clear_dev(FILE *fp, u64 sectors)
 	memset(blk, 0, sizeof(blk));
 	for (i=0; i<sectors; i++)
 	{
-		fwrite(blk, 1, sizeof(blk), fp);
+		dev->ops->write_blocks(dev, (u64) i * SECTOR_SIZE, blk, 
+			sizeof(blk));
 	}
-	rewind(fp);
 }
 
-int create_fs(FILE *fp, u64 sectors, fs_config_t *config)
+int create_fs(omfs_dev_t *dev, u64 sectors, fs_config_t *config)
 {
 	int i;
 	int block_size = config->block_size;
 	char *label = "omfs";
-	omfs_info_t info;
+	omfs_info_t info = { .dev = dev };
+	int ret, ok = 0;
 
 	int blocks_per_sector = block_size / SECTOR_SIZE;
 	int blocks = sectors / blocks_per_sector;
 
 	if (config->clear_dev)
-		clear_dev(fp, sectors);
+		clear_dev(dev, sectors);
 
 	omfs_super_t super = 
 	{
@@ -79,12 +81,19 @@ int create_fs(FILE *fp, u64 sectors, fs_config_t *config)
 	safe_strncpy(super.s_name, label, OMFS_SUPER_NAMELEN);
 	safe_strncpy(root.r_name, label, OMFS_NAMELEN);
 
-	info.dev = fp;
 	info.super = &super;
 	info.root = &root;
 	info.bitmap = &bitmap;
 	info.swap = 0;
 
+	if (config->undo_file && 
+	    (ret = omfs_undo_open(&info, config->undo_file)))
+	{
+		fprintf(stderr, "mkomfs: %s: %s\n", config->undo_file, 
+			strerror(-ret));
+		return 0;
+	}
+
 	// super block
 	omfs_write_super(&info);
 	omfs_write_root_block(&info);
@@ -108,7 +117,7 @@ int create_fs(FILE *fp, u64 sectors, fs_config_t *config)
 
 	u8 *data = calloc(1, swap_be32(super.s_sys_blocksize));
 	if (!data) 
-		return 0;
+		goto out;
 
 	memcpy(data, &root_ino, sizeof (omfs_inode_t));
 	memset(data + OMFS_DIR_START, 0xff, 
@@ -126,7 +135,9 @@ int create_fs(FILE *fp, u64 sectors, fs_config_t *config)
 	int first_blk = BITMAP_BLK + (bitmap_size + 
 		swap_be32(super.s_blocksize)-1) / swap_be32(super.s_blocksize);
 
-	bitmap.bmap = calloc(1, bitmap_size);
+	// flushes write whole blocks
+	bitmap.bmap = calloc(1, (first_blk - BITMAP_BLK) * 
+		swap_be32(super.s_blocksize));
 
 	for (i=0; i<first_blk; i++)
 	{
@@ -136,6 +147,21 @@ int create_fs(FILE *fp, u64 sectors, fs_config_t *config)
 	bitmap.dirty = malloc(dirty_size);
 	memset(bitmap.dirty, 0xff, dirty_size);
 	omfs_flush_bitmap(&info);
+	ok = 1;
 
-	return 1;
+out:
+	if (config->verbose)
+	{
+		struct omfs_stats stats;
+
+		omfs_get_stats(&info, &stats);
+		omfs_print_stats(stdout, &stats);
+	}
+	if (info.undo && (ret = omfs_undo_close(&info)))
+	{
+		fprintf(stderr, "mkomfs: %s: %s\n", config->undo_file, 
+			strerror(-ret));
+		return 0;
+	}
+	return ok;
 }
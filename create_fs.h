@@ -2,14 +2,17 @@
 #define CREATE_FS_H
 
 #include "config.h"
+#include "omfs.h"
 
 typedef struct _fs_config
 {
 	int block_size;
 	int cluster_size;
 	int clear_dev;
+	char *undo_file;	/* save overwritten blocks here */
+	int verbose;		/* print I/O stats at the end */
 } fs_config_t;
 
-int create_fs(FILE *fp, u64 dev_blks, fs_config_t *config);
+int create_fs(omfs_dev_t *dev, u64 dev_blks, fs_config_t *config);
 
 #endif
@@ -0,0 +1,622 @@
+/*
+ *  Defragment file data.
+ *
+ *  A file written a cluster at a time ends up as many short extents
+ *  spread over continuation blocks, and reading it back seeks between
+ *  each.  For every file with enough extents, a contiguous run is
+ *  allocated, the data copied over with large reads and writes, and
+ *  the extent table rewritten to a single entry, freeing the old data
+ *  and continuation blocks.
+ *
+ *  Each file is moved in steps, each flushed before the next one
+ *  depends on it: the new run is marked in use, the data copied into
+ *  it, the inode pointed at it, and only then are the old blocks
+ *  freed.  A crash part way leaves every file either as it was or
+ *  moved, with at worst some blocks marked in use that nothing
+ *  points at, for omfsck to free.
+ *
+ *  Compaction (-c) leaves the data alone.  Extents that are already
+ *  physically adjacent are merged, and the table repacked into the
+ *  inode and as few of its continuation blocks as will hold it; the
+ *  rest are freed, and every extent walk reads that many fewer
+ *  blocks.  The tables are rewritten in place, so a crash while they
+ *  are written needs the undo file (-u); the blocks left over are only
+ *  freed once the tables are down.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "dirscan.h"
+#include "defrag.h"
+
+/* bytes per read and write when copying */
+#define COPY_SIZE (1 << 20)
+
+struct extent
+{
+	u64 start;
+	u64 len;
+};
+
+struct frag_file
+{
+	u64 block;
+	u32 extents;
+};
+
+struct defrag_ctx
+{
+	omfs_info_t *info;
+	defrag_config_t *config;
+	int mirrors;
+	int blocksize;
+
+	struct extent *ext;	/* of the file at hand */
+	u64 num_ext;
+	u64 ext_size;
+	u64 *conts;
+	u64 num_conts;
+	u64 conts_size;
+
+	struct frag_file *files;	/* candidates */
+	u64 num_files;
+	u64 files_size;
+
+	u64 data_files;		/* files with any data */
+	u64 data_blocks;
+	u64 total_extents;
+	u64 total_conts;
+	u64 fragmented;
+	u64 mergeable;		/* extents compaction would remove */
+	u64 spare_conts;	/* continuation blocks it would free */
+
+	u64 done;
+	u64 extents_removed;
+	u64 conts_freed;
+	u64 no_room;
+	u64 bytes_copied;
+	u64 compacted;
+	int stopped;
+	u8 *buf;
+};
+
+static int add_extent(struct defrag_ctx *ctx, u64 start, u64 len)
+{
+	struct extent *ext;
+
+	if (ctx->num_ext == ctx->ext_size)
+	{
+		ctx->ext_size = ctx->ext_size ? ctx->ext_size * 2 : 64;
+		ext = realloc(ctx->ext, ctx->ext_size * sizeof(*ext));
+		if (!ext)
+			return -ENOMEM;
+		ctx->ext = ext;
+	}
+	ctx->ext[ctx->num_ext].start = start;
+	ctx->ext[ctx->num_ext].len = len;
+	ctx->num_ext++;
+	return 0;
+}
+
+static int add_cont(struct defrag_ctx *ctx, u64 block)
+{
+	u64 *conts;
+
+	if (ctx->num_conts == ctx->conts_size)
+	{
+		ctx->conts_size = ctx->conts_size ? ctx->conts_size * 2 : 16;
+		conts = realloc(ctx->conts, ctx->conts_size * sizeof(u64));
+		if (!conts)
+			return -ENOMEM;
+		ctx->conts = conts;
+	}
+	ctx->conts[ctx->num_conts++] = block;
+	return 0;
+}
+
+/* extent entries a table at offset has room for, less the terminator */
+static u64 table_room(struct defrag_ctx *ctx, int offset)
+{
+	return (swap_be32(ctx->info->super->s_sys_blocksize) - offset) /
+		sizeof(struct omfs_extent_entry) - 2;
+}
+
+/*
+ *  Read the extents and continuation blocks of the file at block into
+ *  ctx->ext and ctx->conts.
+ */
+static int read_extents(struct defrag_ctx *ctx, u64 block,
+	omfs_inode_t *inode)
+{
+	u64 num_blocks = swap_be64(ctx->info->super->s_num_blocks);
+	struct omfs_extent_iter it;
+	struct omfs_extent_entry *entry;
+	u64 start, len;
+	int count, ret;
+
+	ctx->num_ext = 0;
+	ctx->num_conts = 0;
+	omfs_extent_begin(ctx->info, block, inode, &it);
+	while ((ret = omfs_extent_next(&it)) > 0)
+	{
+		if (it.conts && (ret = add_cont(ctx, it.block)))
+			break;
+		entry = &it.table->e_entry;
+		for (count = it.count; count; count--, entry++)
+		{
+			start = swap_be64(entry->e_cluster);
+			len = swap_be64(entry->e_blocks);
+			if (!len || start >= num_blocks || len > num_blocks -
+			    start)
+			{
+				ret = -EUCLEAN;
+				goto out;
+			}
+			if ((ret = add_extent(ctx, start, len)))
+				goto out;
+		}
+	}
+out:
+	omfs_extent_end(&it);
+	return ret;
+}
+
+/* continuation blocks needed to hold ctx->num_ext extents */
+static u64 conts_needed(struct defrag_ctx *ctx)
+{
+	u64 first = table_room(ctx, OMFS_EXTENT_START);
+	u64 rest = table_room(ctx, OMFS_EXTENT_CONT);
+
+	if (ctx->num_ext <= first)
+		return 0;
+	return (ctx->num_ext - first + rest - 1) / rest;
+}
+
+/* merge physically adjacent extents in ctx->ext; returns how many went */
+static u64 merge_extents(struct defrag_ctx *ctx)
+{
+	u64 i, n = 0;
+
+	for (i = 0; i < ctx->num_ext; i++)
+	{
+		if (n && ctx->ext[n - 1].start + ctx->ext[n - 1].len ==
+		    ctx->ext[i].start)
+			ctx->ext[n - 1].len += ctx->ext[i].len;
+		else
+			ctx->ext[n++] = ctx->ext[i];
+	}
+	i = ctx->num_ext - n;
+	ctx->num_ext = n;
+	return i;
+}
+
+static int collect(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct defrag_ctx *ctx = user;
+	struct frag_file *files;
+	u64 i, blocks = 0, merged, spare;
+
+	if (entry->inode->i_type != OMFS_FILE)
+		return 0;
+	if (read_extents(ctx, entry->block, entry->inode))
+		return 0;
+	if (!ctx->num_ext)
+		return 0;
+
+	for (i = 0; i < ctx->num_ext; i++)
+		blocks += ctx->ext[i].len;
+	ctx->data_files++;
+	ctx->data_blocks += blocks;
+	ctx->total_extents += ctx->num_ext;
+	ctx->total_conts += ctx->num_conts;
+	if (ctx->num_ext > 1)
+		ctx->fragmented++;
+
+	merged = merge_extents(ctx);
+	spare = conts_needed(ctx);
+	spare = spare < ctx->num_conts ? ctx->num_conts - spare : 0;
+	ctx->mergeable += merged;
+	ctx->spare_conts += spare;
+	if (ctx->config->compact ? !merged && !spare :
+	    ctx->num_ext + merged < ctx->config->min_extents)
+		return 0;
+
+	if (ctx->num_files == ctx->files_size)
+	{
+		ctx->files_size = ctx->files_size ? ctx->files_size * 2 : 256;
+		files = realloc(ctx->files, ctx->files_size * sizeof(*files));
+		if (!files)
+		{
+			d->stop = 1;
+			return -1;
+		}
+		ctx->files = files;
+	}
+	ctx->files[ctx->num_files].block = entry->block;
+	ctx->files[ctx->num_files].extents = ctx->num_ext + merged;
+	ctx->num_files++;
+	return 0;
+}
+
+/* worst first, so a budget goes where it does the most good */
+static int by_extents(const void *a, const void *b)
+{
+	u32 x = ((struct frag_file *) a)->extents;
+	u32 y = ((struct frag_file *) b)->extents;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int copy_data(struct defrag_ctx *ctx, u64 dest)
+{
+	u64 i, off, n, chunk = COPY_SIZE / ctx->blocksize;
+	int ret;
+
+	for (i = 0; i < ctx->num_ext; i++)
+	{
+		for (off = 0; off < ctx->ext[i].len; off += n)
+		{
+			n = ctx->ext[i].len - off;
+			if (n > chunk)
+				n = chunk;
+			if ((ret = omfs_read_data(ctx->info,
+			    ctx->ext[i].start + off, n, ctx->buf)) ||
+			    (ret = omfs_write_data(ctx->info, dest, n,
+			    ctx->buf)))
+				return ret;
+			dest += n;
+			ctx->bytes_copied += 2 * n * ctx->blocksize;
+		}
+	}
+	return 0;
+}
+
+static void single_extent(omfs_inode_t *inode, u64 start, u64 len)
+{
+	struct omfs_extent *oe;
+
+	oe = (struct omfs_extent *) ((u8 *) inode + OMFS_EXTENT_START);
+	oe->e_next = ~0ULL;
+	oe->e_extent_count = swap_be32(2);
+	(&oe->e_entry)[0].e_cluster = swap_be64(start);
+	(&oe->e_entry)[0].e_blocks = swap_be64(len);
+	(&oe->e_entry)[1].e_cluster = ~0ULL;
+	(&oe->e_entry)[1].e_blocks = swap_be64(~len);
+}
+
+/*
+ *  Returns 0 when the file was done or skipped, 1 when the budget
+ *  ran out, or a negative errno.
+ */
+static int defrag_file(struct defrag_ctx *ctx, u64 block)
+{
+	omfs_info_t *info = ctx->info;
+	omfs_inode_t *inode;
+	u64 i, total = 0, dest;
+	int ret = 0;
+
+	inode = omfs_get_inode(info, block);
+	if (!inode)
+		return -EIO;
+	/* anything odd is left for omfsck */
+	if (read_extents(ctx, block, inode) || ctx->num_ext < 2)
+		goto out;
+
+	for (i = 0; i < ctx->num_ext; i++)
+		total += ctx->ext[i].len;
+	if (ctx->config->io_budget && ctx->bytes_copied +
+	    2 * total * ctx->blocksize > ctx->config->io_budget)
+	{
+		ret = 1;
+		goto out;
+	}
+
+	/* each commit flushes, so every step is down before the next */
+	if ((ret = omfs_trans_begin(info)))
+		goto out;
+	if (omfs_allocate_run(info, ctx->ext[0].start, total, &dest))
+	{
+		omfs_trans_abort(info);
+		ctx->no_room++;
+		goto out;
+	}
+	if ((ret = omfs_trans_commit(info)))
+		goto out;
+
+	/* the data must be down before the table points at it */
+	if ((ret = copy_data(ctx, dest)))
+		goto unalloc;
+	omfs_sync(info);
+
+	single_extent(inode, dest, total);
+	if ((ret = omfs_trans_begin(info)))
+		goto unalloc;
+	if ((ret = omfs_write_inode(info, inode)))
+	{
+		omfs_trans_abort(info);
+		goto unalloc;
+	}
+	/* a failed write may have left the inode pointing at either run */
+	if ((ret = omfs_trans_commit(info)))
+		goto out;
+
+	/* and the old blocks are only freed once nothing points at them */
+	if ((ret = omfs_trans_begin(info)))
+		goto out;
+	for (i = 0; i < ctx->num_ext; i++)
+		omfs_clear_range(info, ctx->ext[i].start, ctx->ext[i].len);
+	for (i = 0; i < ctx->num_conts; i++)
+		omfs_clear_range(info, ctx->conts[i], ctx->mirrors);
+	if ((ret = omfs_trans_commit(info)))
+		goto out;
+
+	ctx->done++;
+	ctx->extents_removed += ctx->num_ext - 1;
+	ctx->conts_freed += ctx->num_conts;
+	goto out;
+
+unalloc:
+	omfs_clear_range(info, dest, total);
+out:
+	omfs_release_inode(inode);
+	return ret;
+}
+
+/*
+ *  Write ctx->ext, already merged, to the inode's table and the first
+ *  num_conts of its continuation blocks, ending each table with a
+ *  terminator for the blocks it holds.  Stale entries are zeroed.
+ */
+static int write_tables(struct defrag_ctx *ctx, omfs_inode_t *inode,
+	u64 num_conts)
+{
+	omfs_info_t *info = ctx->info;
+	int sys_blocksize = swap_be32(info->super->s_sys_blocksize);
+	omfs_inode_t *table = inode;
+	struct omfs_extent *oe;
+	struct omfs_extent_entry *entry;
+	u64 i = 0, j, room, total;
+	int offset = OMFS_EXTENT_START, ret = 0;
+
+	for (j = 0; j <= num_conts && !ret; j++)
+	{
+		if (j)
+		{
+			table = omfs_get_inode(info, ctx->conts[j - 1]);
+			if (!table)
+				return -EIO;
+			offset = OMFS_EXTENT_CONT;
+		}
+		oe = (struct omfs_extent *) ((u8 *) table + offset);
+		entry = &oe->e_entry;
+		room = table_room(ctx, offset);
+
+		for (total = 0; room && i < ctx->num_ext; room--, i++)
+		{
+			entry->e_cluster = swap_be64(ctx->ext[i].start);
+			entry->e_blocks = swap_be64(ctx->ext[i].len);
+			total += ctx->ext[i].len;
+			entry++;
+		}
+		entry->e_cluster = ~0ULL;
+		entry->e_blocks = swap_be64(~total);
+		entry++;
+		memset(entry, 0, (u8 *) table + sys_blocksize - (u8 *) entry);
+
+		oe->e_extent_count = swap_be32(entry - &oe->e_entry);
+		oe->e_next = j < num_conts ? swap_be64(ctx->conts[j]) : ~0ULL;
+		if (j)
+		{
+			ret = omfs_write_inode(info, table);
+			omfs_release_inode(table);
+		}
+	}
+	return ret ? ret : omfs_write_inode(info, inode);
+}
+
+/*
+ *  Merge a file's adjacent extents and repack its tables, freeing the
+ *  continuation blocks left over.  The data doesn't move.
+ */
+static int compact_file(struct defrag_ctx *ctx, u64 block)
+{
+	omfs_info_t *info = ctx->info;
+	omfs_inode_t *inode;
+	u64 i, merged, num_conts;
+	int ret = 0;
+
+	inode = omfs_get_inode(info, block);
+	if (!inode)
+		return -EIO;
+	if (read_extents(ctx, block, inode) || !ctx->num_ext)
+		goto out;
+
+	merged = merge_extents(ctx);
+	num_conts = conts_needed(ctx);
+	/* overfull tables are omfsck's business */
+	if (num_conts > ctx->num_conts ||
+	    (!merged && num_conts == ctx->num_conts))
+		goto out;
+
+	if ((ret = omfs_trans_begin(info)))
+		goto out;
+	if ((ret = write_tables(ctx, inode, num_conts)))
+	{
+		omfs_trans_abort(info);
+		goto out;
+	}
+	if ((ret = omfs_trans_commit(info)))
+		goto out;
+
+	/* the old chain pointed at these until the commit above */
+	if ((ret = omfs_trans_begin(info)))
+		goto out;
+	for (i = num_conts; i < ctx->num_conts; i++)
+		omfs_clear_range(info, ctx->conts[i], ctx->mirrors);
+	if (!(ret = omfs_trans_commit(info)))
+	{
+		ctx->compacted++;
+		ctx->extents_removed += merged;
+		ctx->conts_freed += ctx->num_conts - num_conts;
+	}
+out:
+	omfs_release_inode(inode);
+	return ret;
+}
+
+static void print_score(struct defrag_ctx *ctx)
+{
+	u64 extra = ctx->total_extents - ctx->data_files;
+	u64 worst = ctx->data_blocks - ctx->data_files;
+
+	printf("Files with data: %" PRIu64 ", %" PRIu64 " fragmented "
+		"(%.1f%%)\n", ctx->data_files, ctx->fragmented,
+		ctx->data_files ? 100.0 * ctx->fragmented / ctx->data_files : 0);
+	printf("Extents: %" PRIu64 ", continuation blocks: %" PRIu64 "\n",
+		ctx->total_extents, ctx->total_conts);
+	/* 0 when every file is one extent, 100 when every block is one */
+	printf("Fragmentation score: %.1f\n", worst ? 100.0 * extra / worst : 0);
+	printf("Adjacent extents to merge: %" PRIu64 ", continuation blocks "
+		"to free: %" PRIu64 "\n", ctx->mergeable, ctx->spare_conts);
+	printf("Files to %s: %" PRIu64 "\n", ctx->config->compact ?
+		"compact" : "defragment", ctx->num_files);
+}
+
+static int run_compact(struct defrag_ctx *ctx)
+{
+	u64 i;
+	int ret = 0;
+
+	for (i = 0; i < ctx->num_files && !ret; i++)
+		ret = compact_file(ctx, ctx->files[i].block);
+	if (ret)
+		fprintf(stderr, "omfsdefrag: %s\n", strerror(-ret));
+
+	printf("\nCompacted %" PRIu64 " files: %" PRIu64 " extents and "
+		"%" PRIu64 " continuation blocks fewer\n", ctx->compacted,
+		ctx->extents_removed, ctx->conts_freed);
+	return ret;
+}
+
+static int run_defrag(struct defrag_ctx *ctx)
+{
+	omfs_info_t *info = ctx->info;
+	defrag_config_t *config = ctx->config;
+	u64 i;
+	int ret = 0, err;
+
+	if (omfs_read_super(info) || omfs_read_root_block(info))
+	{
+		fprintf(stderr, "omfsdefrag: not an OMFS filesystem\n");
+		return 0;
+	}
+	ctx->mirrors = swap_be32(info->super->s_mirrors);
+	ctx->blocksize = swap_be32(info->super->s_blocksize);
+
+	if (dirscan_begin(info, collect, ctx) != 1)
+	{
+		fprintf(stderr, "omfsdefrag: directory scan failed; "
+			"run omfsck first\n");
+		return 0;
+	}
+	print_score(ctx);
+	if (config->dry_run || !ctx->num_files)
+		return 1;
+
+	if ((ret = omfs_load_bitmap(info)))
+	{
+		fprintf(stderr, "omfsdefrag: could not load bitmap: %s\n",
+			strerror(-ret));
+		return 0;
+	}
+	if (config->undo_file &&
+	    (ret = omfs_undo_open(info, config->undo_file)))
+	{
+		fprintf(stderr, "omfsdefrag: %s: %s\n", config->undo_file,
+			strerror(-ret));
+		return 0;
+	}
+	if (config->compact)
+	{
+		ret = run_compact(ctx);
+		goto out;
+	}
+	ctx->buf = malloc(COPY_SIZE);
+	if (!ctx->buf)
+		return 0;
+
+	qsort(ctx->files, ctx->num_files, sizeof(*ctx->files), by_extents);
+	for (i = 0; i < ctx->num_files && ret >= 0; i++)
+	{
+		ret = defrag_file(ctx, ctx->files[i].block);
+		if (ret == 1)
+		{
+			ctx->stopped = 1;
+			break;
+		}
+	}
+	if (ret < 0)
+		fprintf(stderr, "omfsdefrag: %s\n", strerror(-ret));
+
+	printf("\nDefragmented %" PRIu64 " files: %" PRIu64 " extents and "
+		"%" PRIu64 " continuation blocks fewer\n", ctx->done,
+		ctx->extents_removed, ctx->conts_freed);
+	printf("Data copied: %" PRIu64 " bytes read and written\n",
+		ctx->bytes_copied / 2);
+	if (ctx->no_room)
+		printf("No contiguous room for %" PRIu64 " files\n",
+			ctx->no_room);
+	if (ctx->stopped)
+		printf("I/O budget used up; %" PRIu64 " files left\n",
+			ctx->num_files - i);
+out:
+	if (info->undo && (err = omfs_undo_close(info)))
+	{
+		fprintf(stderr, "omfsdefrag: %s: %s\n", config->undo_file,
+			strerror(-err));
+		ret = err;
+	}
+	return ret >= 0;
+}
+
+int defrag_fs(omfs_dev_t *dev, defrag_config_t *config)
+{
+	int res;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct defrag_ctx ctx;
+	omfs_info_t info = {
+		.dev = dev,
+		.super = &super,
+		.root = &root
+	};
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.info = &info;
+	ctx.config = config;
+
+	res = run_defrag(&ctx);
+
+	if (config->verbose)
+	{
+		struct omfs_stats stats;
+
+		omfs_get_stats(&info, &stats);
+		putchar('\n');
+		omfs_print_stats(stdout, &stats);
+	}
+
+	if (info.bitmap)
+	{
+		free(info.bitmap->bmap);
+		free(info.bitmap->dirty);
+		free(info.bitmap);
+	}
+	free(ctx.ext);
+	free(ctx.conts);
+	free(ctx.files);
+	free(ctx.buf);
+	return res;
+}
@@ -0,0 +1,18 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "omfs.h"
+
+typedef struct _defrag_config
+{
+	int dry_run;		/* just report the fragmentation */
+	int compact;		/* merge extent tables, don't move data */
+	int min_extents;	/* leave files with fewer extents alone */
+	u64 io_budget;		/* stop after this many bytes of data I/O */
+	char *undo_file;	/* save overwritten blocks here */
+	int verbose;		/* print I/O stats at the end */
+} defrag_config_t;
+
+int defrag_fs(omfs_dev_t *dev, defrag_config_t *config);
+
+#endif
@@ -2,23 +2,37 @@
  * dirscan.c - iterator for traversing the directory tree.  
  *
  * We never have to hold more than a few inodes in memory.  Let 
- * the OS cache em.
+ * the OS cache em.  Entries waiting to be visited are kept on a 
+ * stack as block numbers only, and read when they are popped; the 
+ * stack is the whole traversal state, so a scan can be stopped and
+ * picked up again later.
  *
- * TODO: add cycle detection
+ * A bitmap of the blocks queued so far catches loops and cross
+ * links: a pointer to a block already seen is reported like an
+ * unreadable inode rather than followed, so every scan ends.
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
 #include "dirscan.h"
+#include "bits.h"
 
 static dirscan_entry_t *_create_entry(omfs_inode_t *inode, 
-		int level, int hindex, u64 parent, u64 block)
+		int level, int hindex, u64 parent, u64 block, u64 link)
 {
 	dirscan_entry_t *entry = malloc(sizeof(dirscan_entry_t));
+	if (!entry)
+		return NULL;
+
 	entry->inode = inode;
 	entry->level = level;
 	entry->hindex = hindex;
 	entry->parent = parent;
 	entry->block = block;
+	entry->link = link;
+	entry->prune = 0;
+	entry->repeat = 0;
 
 	return entry;
 }
@@ -29,91 +43,206 @@ static void dirscan_release_entry(dirscan_entry_t *entry)
 	free(entry);
 }
 
+static void read_error(dirscan_t *d, dirscan_entry_t *entry)
+{
+	d->read_errors++;
+	if (d->read_error)
+		d->read_error(d, entry, d->user_data);
+	free(entry);
+}
 
-int traverse (dirscan_t *d, dirscan_entry_t *entry)
+/*
+ * Queue an inode to be visited.  One out of range or already queued
+ * is passed to read_error instead.
+ */
+int dirscan_push(dirscan_t *d, u64 block, int level, int hindex, 
+		u64 parent, u64 link)
 {
-	omfs_inode_t *ino, *tmp;
-	dirscan_entry_t *enew;
-	int res;
+	dirscan_entry_t *entry;
 
-	d->visit_error = d->visit(d, entry, d->user_data);
+	entry = _create_entry(NULL, level, hindex, parent, block, link);
+	if (!entry)
+		return -1;
+	if (block >= d->num_blocks || test_bit(d->seen, block))
+	{
+		entry->repeat = block < d->num_blocks;
+		read_error(d, entry);
+		return 0;
+	}
+	if (!stack_push(d->pending, entry))
+	{
+		free(entry);
+		return -1;
+	}
+	set_bit(d->seen, block);
+	return 0;
+}
+
+static int filter_match(struct dirscan_filter *f, omfs_inode_t *ino)
+{
+	char name[OMFS_NAMELEN + 1];
+
+	if (f->type && ino->i_type != f->type)
+		return 0;
+	if (!f->glob)
+		return 1;
+	memcpy(name, ino->i_name, OMFS_NAMELEN);
+	name[OMFS_NAMELEN] = 0;
+	return !fnmatch(f->glob, name, 0);
+}
+
+/*
+ * Visit one entry and queue what it points to.  The next sibling
+ * goes on top, so that (like the recursive version this replaced)
+ * a whole hash chain is visited before the children of any of it.
+ *
+ * With a filter, entries that don't match aren't visited but are
+ * still gone through, and below max_depth nothing is even read.  A
+ * scan from below the root leaves the rest of top's hash chain be.
+ */
+static int traverse(dirscan_t *d, dirscan_entry_t *entry)
+{
+	omfs_inode_t *ino;
+	int res = 0;
 
 	ino = entry->inode;
-	
-	/* push next sibling all then all children */
-	if (ino->i_sibling != ~0)
-	{
-		tmp = omfs_get_inode(d->omfs_info, swap_be64(ino->i_sibling));
-		if (!tmp) 
-		{
-			res = -1;
-			goto out;
-		}
+	if (!d->filter || filter_match(d->filter, ino))
+		d->visit_error = d->visit(d, entry, d->user_data);
 
-		enew = _create_entry(tmp, entry->level, entry->hindex,
-				entry->parent, swap_be64(ino->i_sibling));
-		traverse(d, enew);
-	}
-	if (ino->i_type == OMFS_DIR)
+	if (entry->block == d->top)
+		entry->prune |= DIRSCAN_SKIP_SIBLINGS;
+	if (d->filter && d->filter->max_depth >= 0 &&
+	    entry->level >= d->filter->max_depth)
+		entry->prune |= DIRSCAN_SKIP_CHILDREN;
+
+	if (ino->i_type == OMFS_DIR && !(entry->prune & DIRSCAN_SKIP_CHILDREN))
 	{
 		int i;
-		u64 *ptr = (u64*) ((u8*) ino + OMFS_DIR_START);
-
 		int num_entries = (swap_be32(ino->i_head.h_body_size) + 
 			sizeof(omfs_header_t) - OMFS_DIR_START) / 8;
+		u64 *ptr = (u64*) ((u8*) ino + OMFS_DIR_START) + num_entries;
 
-		for (i=0; i<num_entries; i++, ptr++)
+		for (i=num_entries-1; i >= 0; i--)
 		{
-			u64 inum = swap_be64(*ptr);
+			u64 inum = swap_be64(*--ptr);
 			if (inum != ~0)
-			{
-				tmp = omfs_get_inode(d->omfs_info, inum);
-				if (!tmp) {
-					res = -1;
-					goto out;
-				}
-				enew = _create_entry(tmp, entry->level+1, i,
-					entry->block, inum);
-				traverse(d, enew);
-			}
+				res |= dirscan_push(d, inum, entry->level+1, i,
+					entry->block, entry->block);
 		}
 	}
-out:
-	dirscan_release_entry(entry);
+	if (ino->i_sibling != ~0 && !(entry->prune & DIRSCAN_SKIP_SIBLINGS))
+	{
+		res |= dirscan_push(d, swap_be64(ino->i_sibling), entry->level,
+			entry->hindex, entry->parent, entry->block);
+	}
 	return res;
 }
 
-static void dirscan_end(dirscan_t *d)
+/*
+ * Visit queued entries until there are none left or the visitor
+ * sets d->stop.  Returns -1 if we ran out of memory; inodes that
+ * can't be read, like pointers to blocks already queued, are counted
+ * in d->read_errors, passed to d->read_error if there is one, and
+ * skipped.
+ */
+int dirscan_run(dirscan_t *d)
 {
-	free(d);
+	dirscan_entry_t *entry;
+	int res = 0;
+
+	while (!d->stop && (entry = stack_pop(d->pending)))
+	{
+		entry->inode = omfs_get_inode(d->omfs_info, entry->block);
+		if (!entry->inode)
+		{
+			read_error(d, entry);
+			continue;
+		}
+		res |= traverse(d, entry);
+		dirscan_release_entry(entry);
+	}
+	return res;
 }
 
-int dirscan_begin(omfs_info_t *info, int (*visit)(dirscan_t *, 
+dirscan_t *dirscan_init(omfs_info_t *info, int (*visit)(dirscan_t *, 
 			dirscan_entry_t*, void*), void *user_data) 
 {
-	omfs_inode_t *root_ino;
-	int res;
-
 	dirscan_t *d = calloc(sizeof(dirscan_t), 1);
 	if (!d)
-		goto error;
+		return NULL;
 
+	d->num_blocks = swap_be64(info->super->s_num_blocks);
+	d->seen = calloc((d->num_blocks + 7) / 8, 1);
+	d->pending = stack_init();
+	if (!d->seen || !d->pending)
+	{
+		free(d->seen);
+		if (d->pending)
+			stack_destroy(d->pending);
+		free(d);
+		return NULL;
+	}
 	d->omfs_info = info;
 	d->visit = visit;
 	d->user_data = user_data;
+	return d;
+}
 
-	root_ino = omfs_get_inode(info, swap_be64(info->root->r_root_dir));
-	if (!root_ino)
-		goto error;
-	res = traverse(d, _create_entry(root_ino, 0, 0, ~0, 
-			swap_be64(info->root->r_root_dir)));
+void dirscan_end(dirscan_t *d)
+{
+	while (!stack_empty(d->pending))
+		free(stack_pop(d->pending));
+	stack_destroy(d->pending);
+	free(d->seen);
+	free(d);
+}
 
-	dirscan_end(d);
+int dirscan_begin(omfs_info_t *info, int (*visit)(dirscan_t *, 
+			dirscan_entry_t*, void*), void *user_data) 
+{
+	return dirscan_begin_at(info, swap_be64(info->root->r_root_dir), NULL,
+		visit, user_data);
+}
 
-	return !d->visit_error;
+/*
+ * Scan the tree under top, a directory or file, with an optional
+ * filter.  Levels count from top.
+ */
+int dirscan_begin_at(omfs_info_t *info, u64 top, 
+		struct dirscan_filter *filter, int (*visit)(dirscan_t *, 
+			dirscan_entry_t*, void*), void *user_data)
+{
+	int res, hindex = 0;
+	u64 parent = ~0;
+	omfs_inode_t *ino;
 
-error:
-	if (d) free(d);
-	return -1;
-}
+	dirscan_t *d = dirscan_init(info, visit, user_data);
+	if (!d)
+		return -1;
+	d->filter = filter;
+
+	if (top != swap_be64(info->root->r_root_dir))
+	{
+		ino = omfs_get_inode(info, top);
+		if (!ino)
+		{
+			dirscan_end(d);
+			return -1;
+		}
+		d->top = top;
+		parent = swap_be64(ino->i_parent);
+		hindex = omfs_compute_hash(info, ino->i_name);
+		omfs_release_inode(ino);
+	}
+
+	if (dirscan_push(d, top, 0, hindex, parent, parent) || dirscan_run(d) ||
+	    d->read_errors)
+	{
+		dirscan_end(d);
+		return -1;
+	}
 
+	res = !d->visit_error;
+	dirscan_end(d);
+	return res;
+}
@@ -11,6 +11,21 @@ struct dirscan_entry
 	int hindex;                /* hash index */
 	u64 parent;                /* parent inode number */
 	u64 block;                 /* block from which inode was read */
+	u64 link;                  /* inode holding the pointer to block */
+	int prune;                 /* set by visit: DIRSCAN_SKIP_* */
+	int repeat;                /* for read_error: block seen already */
+};
+
+#define DIRSCAN_SKIP_SIBLINGS 1
+#define DIRSCAN_SKIP_CHILDREN 2
+#define DIRSCAN_PRUNE (DIRSCAN_SKIP_SIBLINGS | DIRSCAN_SKIP_CHILDREN)
+
+/* which entries get visited; see dirscan_begin_at */
+struct dirscan_filter
+{
+	int max_depth;             /* read nothing below this level, or -1 */
+	char type;                 /* visit only OMFS_DIR or OMFS_FILE, or 0 */
+	const char *glob;          /* visit only names matching, or NULL */
 };
 
 struct dirscan
@@ -19,6 +34,15 @@ struct dirscan
 	int (*visit) (struct dirscan *, struct dirscan_entry *, void*);
 	void *user_data;
 	int visit_error;
+	stack_t *pending;          /* entries yet to be visited */
+	int stop;                  /* set by visit to pause dirscan_run */
+	u64 read_errors;           /* inodes that couldn't be read, or
+	                              were pointed at more than once */
+	void (*read_error) (struct dirscan *, struct dirscan_entry *, void*);
+	u64 top;                   /* first block, if not the root */
+	u8 *seen;                  /* blocks queued so far */
+	u64 num_blocks;
+	struct dirscan_filter *filter;
 }; 
 
 typedef struct dirscan dirscan_t;
@@ -26,5 +50,14 @@ typedef struct dirscan_entry dirscan_entry_t;
 
 int dirscan_begin(omfs_info_t *info, int (*visit)(dirscan_t *, 
 			dirscan_entry_t*, void*), void *user_data);
+int dirscan_begin_at(omfs_info_t *info, u64 top, 
+		struct dirscan_filter *filter, int (*visit)(dirscan_t *, 
+			dirscan_entry_t*, void*), void *user_data);
+dirscan_t *dirscan_init(omfs_info_t *info, int (*visit)(dirscan_t *, 
+			dirscan_entry_t*, void*), void *user_data);
+int dirscan_push(dirscan_t *d, u64 block, int level, int hindex, 
+		u64 parent, u64 link);
+int dirscan_run(dirscan_t *d);
+void dirscan_end(dirscan_t *d);
 
 #endif
@@ -3,6 +3,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include "omfs.h"
 #include "dirscan.h"
 #include "check.h"
@@ -10,30 +11,58 @@
 #include "fix.h"
 #include "bits.h"
 #include "io.h"
+#include "dump.h"
 
-static int on_node(dirscan_t *d, dirscan_entry_t *entry, void *user)
+static void print_inode(omfs_inode_t *inode, int level, int hindex,
+	u64 parent, u64 block)
 {
-	char *name = escape(entry->inode->i_name);
+	char name[OMFS_NAMELEN + 1];
 
+	escape_to(name, inode->i_name, sizeof(name));
 	printf("inode: %*c%s%c s:%" PRIx64 " h:%d c:%d p:%" PRIx64
            " b:%" PRIx64 "\n",
-		entry->level*2, ' ', name,
-		(entry->inode->i_type == OMFS_DIR) ? '/' : ' ',
-		swap_be64(entry->inode->i_head.h_self), entry->hindex,
-		swap_be16(entry->inode->i_head.h_crc), 
-		entry->parent, entry->block); 
-	free(name);
+		level*2, ' ', name,
+		(inode->i_type == OMFS_DIR) ? '/' : ' ',
+		swap_be64(inode->i_head.h_self), hindex,
+		swap_be16(inode->i_head.h_crc), 
+		parent, block); 
+}
 
+static int on_node(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	print_inode(entry->inode, entry->level, entry->hindex, entry->parent,
+		entry->block);
 	return 0;
 }
 
-int dump_fs(FILE *fp)
+/*
+ *  Scan the part of the tree in scope: from its path, if it has one,
+ *  with its filter.  Returns what dirscan_begin does.
+ */
+int dump_scan(omfs_info_t *info, dump_scope_t *scope,
+	int (*visit)(dirscan_t *, dirscan_entry_t *, void *), void *user)
+{
+	u64 top = swap_be64(info->root->r_root_dir);
+	int ret;
+
+	if (!scope)
+		return dirscan_begin(info, visit, user);
+	if (scope->path && (ret = omfs_namei(info, scope->path, &top)))
+	{
+		fprintf(stderr, "%s: %s\n", scope->path, strerror(-ret));
+		return -1;
+	}
+	return dirscan_begin_at(info, top, &scope->filter, visit, user);
+}
+
+int dump_fs(omfs_dev_t *dev, dump_scope_t *scope, int verbose)
 {
-	int bsize;
+	int ok = 0;
 	omfs_super_t super;
 	omfs_root_t root;
+	struct omfs_stats stats;
 	omfs_info_t info = { 
-		.dev = fp, 
+		.dev = dev, 
 		.super = &super,
 		.root = &root
 	};
@@ -41,7 +70,7 @@ int dump_fs(FILE *fp)
 	if (omfs_read_super(&info))
 	{
 		printf ("Could not read super block\n");
-		return 0;
+		goto out;
 	}
 	printf("Filesystem volume name: %s\n", super.s_name);
 	printf("Filesystem magic number: 0x%x\n", swap_be32(super.s_magic));
@@ -55,18 +84,82 @@ int dump_fs(FILE *fp)
 	if (omfs_read_root_block(&info))
 	{
 		printf ("Could not read root block\n");
-		return 0;
+		goto out;
 	}
 	printf("Root block size: %d\n", swap_be32(info.root->r_blocksize));
 	printf("Cluster size: %d\n", swap_be32(info.root->r_clustersize));
 	printf("Root mirrors: %d\n", swap_be32(info.root->r_mirrors));
 
-	bsize = (swap_be64(info.super->s_num_blocks) + 7) / 8;
-
-	if (dirscan_begin(&info, on_node, NULL) != 0)
+	if (dump_scan(&info, scope, on_node, NULL) < 0)
 	{
 		printf("Dirscan failed\n");
-		return 0;
+		goto out;
+	}
+	ok = 1;
+out:
+	if (verbose)
+	{
+		omfs_get_stats(&info, &stats);
+		putchar('\n');
+		omfs_print_stats(stdout, &stats);
+	}
+	return ok;
+}
+
+/*
+ *  Print just the named paths, each resolved from the root.  Returns
+ *  the number that couldn't be found.
+ */
+int dump_paths(omfs_dev_t *dev, char **paths, int count, int verbose)
+{
+	int i, ret, missing = 0;
+	u64 block, hits, misses;
+	omfs_inode_t *inode;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct omfs_stats stats;
+	omfs_info_t info = { 
+		.dev = dev, 
+		.super = &super,
+		.root = &root
+	};
+
+	if (omfs_read_super(&info) || omfs_read_root_block(&info))
+	{
+		printf ("Could not read super or root block\n");
+		return count;
+	}
+	omfs_dcache_init(&info, 1024);
+
+	for (i = 0; i < count; i++)
+	{
+		ret = omfs_namei(&info, paths[i], &block);
+		if (ret)
+		{
+			printf("%s: %s\n", paths[i], strerror(-ret));
+			missing++;
+			continue;
+		}
+		inode = omfs_get_inode(&info, block);
+		if (!inode)
+		{
+			printf("%s: %s\n", paths[i], strerror(EIO));
+			missing++;
+			continue;
+		}
+		print_inode(inode, 0, omfs_compute_hash(&info, inode->i_name),
+			swap_be64(inode->i_parent), block);
+		omfs_release_inode(inode);
+	}
+
+	if (verbose)
+	{
+		omfs_dcache_stats(&info, &hits, &misses);
+		omfs_get_stats(&info, &stats);
+		printf("\nDentry cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			hits, misses);
+		omfs_print_stats(stdout, &stats);
 	}
-	return 1;
+	omfs_dcache_free(&info);
+	return missing;
 }
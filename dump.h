@@ -1,6 +1,31 @@
 #ifndef _DUMP_H
 #define _DUMP_H
 #include <stdio.h>
+#include "omfs.h"
+#include "dirscan.h"
 
-int dump_fs(FILE *fp);
+typedef enum
+{
+	DUMP_TEXT,		/* one line per inode, for people */
+	DUMP_NDJSON,		/* one JSON object per inode */
+	DUMP_MANIFEST		/* struct omfs_manifest_entry records */
+} dump_format_t;
+
+/* the part of the tree to dump */
+typedef struct _dump_scope
+{
+	char *path;		/* start here, or NULL for the root */
+	struct dirscan_filter filter;
+} dump_scope_t;
+
+int dump_scan(omfs_info_t *info, dump_scope_t *scope,
+	int (*visit)(dirscan_t *, dirscan_entry_t *, void *), void *user);
+int dump_fs(omfs_dev_t *dev, dump_scope_t *scope, int verbose);
+int dump_hash_stats(omfs_dev_t *dev, int verbose);
+int dump_frag(omfs_dev_t *dev, dump_scope_t *scope, int list, int summary,
+	int verbose);
+int dump_free_stats(omfs_dev_t *dev, int verbose);
+int dump_manifest(omfs_dev_t *dev, dump_scope_t *scope,
+	dump_format_t format, int verbose);
+int dump_paths(omfs_dev_t *dev, char **paths, int count, int verbose);
 #endif
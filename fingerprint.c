@@ -0,0 +1,224 @@
+/*
+ *  fingerprint.c - index of inodes verified by earlier runs, for
+ *  incremental checks.
+ *
+ *  The index file is a header followed by the records, sorted by
+ *  block.  Everything is stored big-endian, like the filesystem.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fingerprint.h"
+
+#define FP_MAGIC "OMFSFPDB"
+#define FP_VERSION 2
+
+struct fp_header
+{
+	char magic[8];
+	u32 version;
+	u32 runs;
+	u64 num_blocks;
+	u64 count;
+};
+
+static void swap_record(struct fp_record *r)
+{
+	r->block = swap_be64(r->block);
+	r->ctime = swap_be64(r->ctime);
+	r->parent = swap_be64(r->parent);
+	r->sibling = swap_be64(r->sibling);
+	r->crc = swap_be32(r->crc);
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+	u64 x = ((struct fp_record *) a)->block;
+	u64 y = ((struct fp_record *) b)->block;
+
+	return (x > y) - (x < y);
+}
+
+static struct fp_record *fp_lookup(fp_db_t *db, u64 block)
+{
+	struct fp_record key = { .block = block };
+
+	return bsearch(&key, db->recs, db->sorted, sizeof(key), cmp_record);
+}
+
+static void fp_mark_seen(fp_db_t *db, struct fp_record *r)
+{
+	if (r - db->recs < db->loaded)
+		db->seen[r - db->recs] = 1;
+}
+
+/*
+ *  Load the index for the filesystem in info.  A missing index, or one
+ *  for some other filesystem, loads as empty.
+ */
+int fp_load(fp_db_t *db, char *path, omfs_info_t *info)
+{
+	struct fp_header hdr;
+	FILE *fp;
+	u64 i;
+	int ret = 0;
+
+	memset(db, 0, sizeof(*db));
+	db->num_blocks = swap_be64(info->super->s_num_blocks);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, FP_MAGIC, sizeof(hdr.magic)) ||
+	    swap_be32(hdr.version) != FP_VERSION ||
+	    swap_be64(hdr.num_blocks) != db->num_blocks)
+		goto out;
+
+	db->count = db->size = db->sorted = swap_be64(hdr.count);
+	db->loaded = db->count;
+	db->runs = swap_be32(hdr.runs);
+
+	db->recs = malloc(db->size * sizeof(struct fp_record));
+	db->seen = calloc(db->loaded + 1, 1);
+	if (!db->recs || !db->seen ||
+	    fread(db->recs, sizeof(struct fp_record), db->count, fp) != 
+	    db->count)
+	{
+		ret = (db->recs && db->seen) ? -EIO : -ENOMEM;
+		fp_reset(db);
+		goto out;
+	}
+	for (i=0; i < db->count; i++)
+		swap_record(&db->recs[i]);
+out:
+	fclose(fp);
+	return ret;
+}
+
+int fp_save(fp_db_t *db, char *path)
+{
+	struct fp_header hdr;
+	FILE *fp;
+	u64 i;
+	int ret = 0;
+
+	qsort(db->recs, db->count, sizeof(struct fp_record), cmp_record);
+	db->sorted = db->count;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FP_MAGIC, sizeof(hdr.magic));
+	hdr.version = swap_be32(FP_VERSION);
+	hdr.runs = swap_be32(db->runs);
+	hdr.num_blocks = swap_be64(db->num_blocks);
+	hdr.count = swap_be64(db->count);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		ret = -EIO;
+
+	for (i=0; i < db->count && !ret; i++)
+	{
+		struct fp_record r = db->recs[i];
+		swap_record(&r);
+		if (fwrite(&r, sizeof(r), 1, fp) != 1)
+			ret = -EIO;
+	}
+	if (fclose(fp))
+		ret = -EIO;
+	return ret;
+}
+
+/* forget everything, e.g. before a full check */
+void fp_reset(fp_db_t *db)
+{
+	free(db->recs);
+	free(db->seen);
+	db->recs = NULL;
+	db->seen = NULL;
+	db->count = db->size = db->sorted = db->loaded = 0;
+	db->runs = 0;
+}
+
+/*
+ *  Drop the records loaded from the file that this run neither matched
+ *  nor updated: their inodes are gone, moved, or no longer check out.
+ *  Only call this once the whole tree has been scanned.
+ */
+void fp_prune(fp_db_t *db)
+{
+	u64 i, kept = 0, sorted = 0;
+
+	for (i=0; i < db->count; i++)
+	{
+		if (i < db->loaded && !db->seen[i])
+			continue;
+		if (i < db->sorted)
+			sorted++;
+		db->recs[kept++] = db->recs[i];
+	}
+	db->count = kept;
+	db->sorted = sorted;
+	db->loaded = 0;
+}
+
+static void fp_fill(struct fp_record *r, u64 block, omfs_inode_t *inode)
+{
+	r->block = block;
+	r->ctime = swap_be64(inode->i_ctime);
+	r->parent = swap_be64(inode->i_parent);
+	r->sibling = swap_be64(inode->i_sibling);
+	r->crc = swap_be16(inode->i_head.h_crc);
+	r->fill = 0;
+}
+
+/*
+ *  Returns 1 if the inode read from block looks just like it did when
+ *  last verified there.
+ */
+int fp_unchanged(fp_db_t *db, u64 block, omfs_inode_t *inode)
+{
+	struct fp_record now, *r;
+
+	fp_fill(&now, block, inode);
+	r = fp_lookup(db, block);
+	if (!r || r->ctime != now.ctime || r->parent != now.parent ||
+	    r->sibling != now.sibling || r->crc != now.crc)
+		return 0;
+
+	fp_mark_seen(db, r);
+	return 1;
+}
+
+/*
+ *  Remember a verified inode.
+ */
+int fp_update(fp_db_t *db, u64 block, omfs_inode_t *inode)
+{
+	struct fp_record *r;
+
+	r = fp_lookup(db, block);
+	if (r)
+		fp_mark_seen(db, r);
+	else
+	{
+		if (db->count == db->size)
+		{
+			u64 size = db->size ? db->size * 2 : 1024;
+			void *tmp = realloc(db->recs, 
+				size * sizeof(struct fp_record));
+			if (!tmp)
+				return -ENOMEM;
+			db->recs = tmp;
+			db->size = size;
+		}
+		r = &db->recs[db->count++];
+	}
+	fp_fill(r, block, inode);
+	return 0;
+}
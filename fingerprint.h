@@ -0,0 +1,43 @@
+#ifndef _FINGERPRINT_H
+#define _FINGERPRINT_H
+
+#include "config.h"
+#include "omfs.h"
+
+/* force a full check after this many incremental ones */
+#define FP_FULL_INTERVAL 10
+
+/*
+ *  What we remember about an inode that checked out fine.  If all of
+ *  it still matches, the inode hasn't been rewritten since.
+ */
+struct fp_record
+{
+	u64 block;		/* where the inode was found */
+	u64 ctime;		/* i_ctime */
+	u64 parent;		/* i_parent */
+	u64 sibling;		/* i_sibling */
+	u32 crc;		/* h_crc */
+	u32 fill;
+};
+
+typedef struct fp_db
+{
+	struct fp_record *recs;	/* sorted by block */
+	u64 count;
+	u64 size;
+	u64 sorted;		/* recs[0..sorted) are in order */
+	u64 loaded;		/* recs[0..loaded) came from the file */
+	u8 *seen;		/* of those, matched or updated this run */
+	u64 num_blocks;		/* of the fs it describes */
+	u32 runs;		/* incremental runs since the last full one */
+} fp_db_t;
+
+int fp_load(fp_db_t *db, char *path, omfs_info_t *info);
+int fp_save(fp_db_t *db, char *path);
+void fp_reset(fp_db_t *db);
+int fp_unchanged(fp_db_t *db, u64 block, omfs_inode_t *inode);
+int fp_update(fp_db_t *db, u64 block, omfs_inode_t *inode);
+void fp_prune(fp_db_t *db);
+
+#endif
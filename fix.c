@@ -3,6 +3,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "omfs.h"
 #include "check.h"
 #include "fix.h"
@@ -30,182 +31,486 @@ static char *output_strings[] =
 	"Could not read root block",
 	"Inode $I is totally busted",
 	"Directory scan failed",
-	"Loop detected for block $B"
+	"Loop detected for block $B",
+	"Filesystem is bigger than the device",
+	"Root block doesn't agree with the super block",
+	"Root block checksums are incorrect",
+	"Root block mirrors differ",
+	"Root directory is unreadable",
+	"System blocks are marked free in the bitmap",
+	"Inode $I can't be read"
 };
 
-static void hack_exit(check_context_t *ctx)
+enum
 {
-	printf("Made changes; re-run omfsck to continue scan\n");
-	fclose(ctx->omfs_info->dev);
-	exit(1);
-}
+	REPAIR_REWRITE,		/* rewrite inode, recomputing checksums */
+	REPAIR_MOVE,		/* relink inode into its proper hash chain */
+	REPAIR_CUT,		/* unlink inode along with the rest of its chain */
+	REPAIR_DELETE		/* unlink inode from its hash chain */
+};
+
+/*
+ *  A repair is queued when the problem is found and applied after
+ *  the scan.  It records where the inode was linked rather than a
+ *  copy of it: by the time it is applied, earlier repairs may have
+ *  changed the blocks involved, so everything is re-read.
+ */
+struct repair
+{
+	int action;
+	u64 block;		/* inode to fix */
+	u64 parent;		/* directory it was found in */
+	u64 link;		/* inode whose pointer led to it */
+	int hash;		/* chain it was found in */
+	struct repair *next;
+};
 
 // returns inode containing current file
-omfs_inode_t *find_node(check_context_t *ctx, int *is_parent)
+omfs_inode_t *find_node(omfs_info_t *info, struct repair *r, int *is_parent)
 {
-	omfs_inode_t *parent, *inode = 
-		omfs_get_inode(ctx->omfs_info, ctx->parent);
+	omfs_inode_t *inode = omfs_get_inode(info, r->parent);
+	struct omfs_cycle cycle;
 
-	u64 *chain_ptr  = (u64*) ((u8*) inode + OMFS_DIR_START);
+	__be64 *chain_ptr = (__be64 *) ((u8*) inode + OMFS_DIR_START);
 
-	parent = inode;
 	if (!inode)
 		return NULL;
 
-	chain_ptr += ctx->hash;
-	while (*chain_ptr != swap_be64(ctx->block) && *chain_ptr != ~0)
+	*is_parent = 1;
+
+	chain_ptr += r->hash;
+	omfs_cycle_init(&cycle);
+	while (*chain_ptr != swap_be64(r->block) && *chain_ptr != ~0)
 	{
+		if (omfs_cycle_step(&cycle, swap_be64(*chain_ptr)))
+			break;
 		omfs_release_inode(inode);
-		inode = omfs_get_inode(ctx->omfs_info, swap_be64(*chain_ptr));
+		inode = omfs_get_inode(info, swap_be64(*chain_ptr));
+		if (!inode)
+			return NULL;
 		chain_ptr = &inode->i_sibling;
+		*is_parent = 0;
 	}
 
-	if (*chain_ptr == ~0)
+	if (*chain_ptr != swap_be64(r->block))
 	{
 		omfs_release_inode(inode);
 		return NULL;
 	}
-	*is_parent = parent == inode;
 	return inode;
 }
 
-static u64 *get_entry(struct omfs_inode *inode, int hash, int is_parent)
+static __be64 *get_entry(struct omfs_inode *inode, int hash, int is_parent)
 {
-	u64 *entry;
+	__be64 *entry;
 	if (is_parent)
-		entry = (u64 *) ((u8 *) inode + OMFS_DIR_START) + hash;
+		entry = (__be64 *) ((u8 *) inode + OMFS_DIR_START) + hash;
 	else
 		entry = &inode->i_sibling;
 	return entry;
 }
 
-static void delete_file(check_context_t *ctx)
+/*
+ *  Returns the inode holding the pointer along which the file was
+ *  found, if it still points there; that's the link to cut when the
+ *  file is reachable more than once.  Otherwise search for it.
+ */
+static omfs_inode_t *find_link(omfs_info_t *info, struct repair *r, 
+	int *is_parent)
+{
+	omfs_inode_t *inode;
+
+	if (r->link == ~0)
+		return NULL;
+
+	inode = omfs_get_inode(info, r->link);
+	if (!inode)
+		return NULL;
+
+	*is_parent = r->link == r->parent;
+	if (*get_entry(inode, r->hash, *is_parent) == swap_be64(r->block))
+		return inode;
+
+	omfs_release_inode(inode);
+	return find_node(info, r, is_parent);
+}
+
+/*
+ *  Once an inode is out of its chain, it no longer leads to whatever
+ *  followed it.  Point the repairs still queued for those at the
+ *  inode that took over the pointer.
+ */
+static void relink_repairs(struct repair *r, omfs_inode_t *link, 
+	int is_parent)
+{
+	u64 from = r->block;
+	u64 to = is_parent ? r->parent : swap_be64(link->i_head.h_self);
+
+	for (r = r->next; r; r = r->next)
+		if (r->link == from)
+			r->link = to;
+}
+
+/*
+ *  Unlink a file, keeping the rest of its chain.  A cut drops the
+ *  rest of the chain too: for a loop, that's the way back around,
+ *  and a busted inode's sibling pointer can't be trusted.
+ */
+static int delete_file(omfs_info_t *info, struct repair *r, int cut)
 {
 	int res;
 	int is_parent;
-	u64 *entry;
-	omfs_inode_t *inode = find_node(ctx, &is_parent);
+	__be64 *entry;
+	omfs_inode_t *file = NULL, *inode = find_link(info, r, &is_parent);
 
 	if (!inode)
 	{
 		fprintf(stderr, "Oops, didn't find it.  Odd.\n");
-		return;
+		return -1;
 	}
-	entry = get_entry(inode, ctx->hash, is_parent);
+	entry = get_entry(inode, r->hash, is_parent);
 	*entry = ~0;
-	res = omfs_write_inode(ctx->omfs_info, inode);
+	if (!cut && (file = omfs_get_inode(info, r->block)) &&
+	    file->i_sibling != swap_be64(r->block))
+		*entry = file->i_sibling;
+	omfs_release_inode(file);
+
+	res = omfs_write_inode(info, inode);
 	if (res)
 		perror("omfsck");
+	else if (!cut)
+		relink_repairs(r, inode, is_parent);
 
 	omfs_release_inode(inode);
-	omfs_sync(ctx->omfs_info);
 
-	// force clear bit later when we consistency-check the bitmap.
-	hack_exit(ctx);
+	// its blocks are left out of the bitmap we rebuild after the scan.
+	return res;
 }
 
 // can be used to fix hash bugs or move around FS
-static void move_file(check_context_t *ctx, u64 dest_dir)
+static int move_file(omfs_info_t *info, struct repair *r, u64 dest_dir)
 {
 	omfs_inode_t *source;
 	omfs_inode_t *dest;
-	u64 *entry;
+	omfs_inode_t *file;
+	__be64 *entry;
 	int is_parent, res;
 	int hash;
 
-	source = find_node(ctx, &is_parent);
+	file = omfs_get_inode(info, r->block);
+	if (!file)
+		return -1;
+
+	source = find_node(info, r, &is_parent);
 	if (!source)
 	{
 		fprintf(stderr, "Oops, didn't find it.  Odd.\n");
-		return;
+		omfs_release_inode(file);
+		return -1;
 	}
-	entry = get_entry(source, ctx->hash, is_parent);
-	*entry = ctx->current_inode->i_sibling;
-	res = omfs_write_inode(ctx->omfs_info, source);
-	omfs_release_inode(source);
+	entry = get_entry(source, r->hash, is_parent);
+	*entry = file->i_sibling;
+	res = omfs_write_inode(info, source);
 	if (res)
 		perror("omfsck");
+	else
+		relink_repairs(r, source, is_parent);
+	omfs_release_inode(source);
 
-	dest = omfs_get_inode(ctx->omfs_info, dest_dir);
-	if (dest->i_type != OMFS_DIR)
+	dest = omfs_get_inode(info, dest_dir);
+	if (!dest || dest->i_type != OMFS_DIR)
 	{
 		printf("Huh, tried to move it to a non-dir.. oh well.\n");
-		return;
+		omfs_release_inode(dest);
+		omfs_release_inode(file);
+		return -1;
 	}
-	hash = omfs_compute_hash(ctx->omfs_info, ctx->current_inode->i_name);
+	hash = omfs_compute_hash(info, file->i_name);
 	entry = get_entry(dest, hash, 1);
-	ctx->current_inode->i_sibling = *entry;
-	*entry = swap_be64(ctx->block);
-	res = omfs_write_inode(ctx->omfs_info, dest);
+	file->i_sibling = *entry;
+	*entry = swap_be64(r->block);
+	res = omfs_write_inode(info, dest);
 	if (res)
 		perror("omfsck");
-	res = omfs_write_inode(ctx->omfs_info, ctx->current_inode);
+	res = omfs_write_inode(info, file);
 	if (res)
 		perror("omfsck");
 
-	omfs_release_inode(ctx->current_inode);
+	omfs_release_inode(file);
 	omfs_release_inode(dest);
-	omfs_sync(ctx->omfs_info);
+	return res;
+}
+
+static int rewrite_file(omfs_info_t *info, struct repair *r)
+{
+	int res;
+	omfs_inode_t *inode = omfs_get_inode(info, r->block);
+
+	if (!inode)
+		return -1;
 
-	// force clear bit later when we consistency-check the bitmap.
-	hack_exit(ctx);
+	// write recomputes checksums
+	res = omfs_write_inode(info, inode);
+	if (res)
+		perror("omfsck");
+	omfs_release_inode(inode);
+	return res;
 }
 
-void fix_problem(check_error_t error, check_context_t *ctx)
+/*
+ *  Queue a repair of the current inode.  Each inode gets at most one:
+ *  a delete supersedes a move, and a move rewrites the inode anyway.
+ */
+static void queue_repair(check_context_t *ctx, int action)
 {
-	if (ctx->config->is_quiet)
+	struct repair *r = ctx->last_repair;
+
+	if (r && r->block == ctx->block && r->link == ctx->link &&
+	    r->hash == ctx->hash)
+	{
+		if (action > r->action)
+			r->action = action;
 		return;
+	}
+
+	r = malloc(sizeof(struct repair));
+	if (!r)
+	{
+		perror("omfsck");
+		return;
+	}
+	r->action = action;
+	r->block = ctx->block;
+	r->parent = ctx->parent;
+	r->link = ctx->link;
+	r->hash = ctx->hash;
+	r->next = NULL;
+
+	if (ctx->last_repair)
+		ctx->last_repair->next = r;
+	else
+		ctx->repairs = r;
+	ctx->last_repair = r;
+}
+
+/*
+ *  Decide whether to make a repair.  Safe repairs only ever rewrite
+ *  an inode in place or relink it; preen mode won't delete anything.
+ */
+static int want_fix(check_context_t *ctx, char *msg, int is_safe)
+{
+	switch (ctx->config->fix_mode)
+	{
+	case FIX_YES:
+		printf("%s yes\n", msg);
+		return 1;
+	case FIX_NO:
+		printf("%s no\n", msg);
+		return 0;
+	case FIX_PREEN:
+		printf("%s %s\n", msg, is_safe ? "yes" : "no (run omfsck manually)");
+		return is_safe;
+	default:
+		return prompt_yesno(msg);
+	}
+}
+
+/*
+ *  The root block is repaired on its own, before the scan: the rest
+ *  of the check goes by it.
+ */
+static int fix_root_block(check_context_t *ctx)
+{
+	ctx->fix_root = 0;
+
+	// write recomputes checksums, for all the mirrors
+	if (omfs_write_root_block(ctx->omfs_info))
+	{
+		perror("omfsck");
+		ctx->unfixed++;
+		return 0;
+	}
+	omfs_sync(ctx->omfs_info);
+	ctx->config->changed = 1;
+	return 1;
+}
+
+/*
+ *  Apply the queued repairs in the order the problems were found.
+ *  Deleted inodes were pruned from the scan, so nothing queued below
+ *  them is left to invalidate.  Returns the number of repairs made.
+ */
+int fix_apply(check_context_t *ctx)
+{
+	struct repair *r, *next;
+	omfs_info_t *info = ctx->omfs_info;
+	int res, count = 0;
+
+	if (ctx->fix_root)
+		return fix_root_block(ctx);
+	if (!ctx->repairs)
+		return 0;
+
+	/* stage everything, then write each block once, in order */
+	if ((res = omfs_trans_begin(info)))
+	{
+		fprintf(stderr, "omfsck: %s\n", strerror(-res));
+		return 0;
+	}
+
+	for (r = ctx->repairs; r; r = next)
+	{
+		next = r->next;
+
+		switch (r->action)
+		{
+		case REPAIR_DELETE:
+		case REPAIR_CUT:
+			res = delete_file(info, r, r->action == REPAIR_CUT);
+			break;
+		case REPAIR_MOVE:
+			res = move_file(info, r, r->parent);
+			break;
+		default:
+			res = rewrite_file(info, r);
+			break;
+		}
+		if (res)
+			ctx->unfixed++;
+		else
+			count++;
+		free(r);
+	}
+	ctx->repairs = ctx->last_repair = NULL;
 
+	if ((res = omfs_trans_commit(info)))
+	{
+		fprintf(stderr, "omfsck: %s\n", strerror(-res));
+		ctx->unfixed += count;
+		return 0;
+	}
+	if (count)
+		ctx->config->changed = 1;
+	return count;
+}
+
+/*
+ *  Just describe a problem.
+ */
+void fix_report(check_error_t error, check_context_t *ctx)
+{
 	sad_print(output_strings[error], ctx);
+}
+
+/* remember a problem, so a checkpoint can carry it to the next run */
+static void record_finding(check_error_t error, check_context_t *ctx)
+{
+	struct finding *f;
+
+	if (ctx->num_findings == ctx->findings_size)
+	{
+		int size = ctx->findings_size ? ctx->findings_size * 2 : 16;
+		f = realloc(ctx->findings, size * sizeof(*f));
+		if (!f)
+			return;
+		ctx->findings = f;
+		ctx->findings_size = size;
+	}
+	f = &ctx->findings[ctx->num_findings++];
+	f->block = ctx->block;
+	f->parent = ctx->parent;
+	f->error = error;
+	f->hash = ctx->hash;
+}
+
+/*
+ *  Report a problem and queue its repair.  Returns 1 if the problem
+ *  will be fixed.
+ */
+int fix_problem(check_error_t error, check_context_t *ctx)
+{
+	int size;
+
+	record_finding(error, ctx);
+
+	if (ctx->config->is_quiet)
+	{
+		ctx->unfixed++;
+		return 0;
+	}
+
+	fix_report(error, ctx);
 
 	switch (error)
 	{
+	case E_LOOP:
+		/* the inode is fine, it's the way back to it that's wrong */
+		if (want_fix(ctx, "Cut the loop?", 0))
+		{
+			queue_repair(ctx, REPAIR_CUT);
+			return 1;
+		}
+		break;
 	case E_SELF_PTR:
 	case E_PARENT_PTR:
-	case E_LOOP:
 	case E_INSANE:
 		/* for now, a take no prisoners approach */
-		if (prompt_yesno("Delete the offending file?"))
+		if (want_fix(ctx, "Delete the offending file?", 0))
 		{
-			printf("Okay, deleting.\n");
-			delete_file(ctx);
+			queue_repair(ctx, error == E_INSANE ? REPAIR_CUT :
+				REPAIR_DELETE);
+			return 1;
+		}
+		break;
+	case E_UNREADABLE:
+		/* nothing to go on past it, so the rest of the chain goes too */
+		if (want_fix(ctx, "Unlink it?", 0))
+		{
+			queue_repair(ctx, REPAIR_CUT);
+			return 1;
 		}
-		else
-			printf("Skipping.\n");
 		break;
 	case E_HEADER_XOR:
 	case E_HEADER_CRC:
-		if (prompt_yesno("Correct?"))
+		if (want_fix(ctx, "Correct?", 1))
 		{
-			printf("Okay, fixing.\n");
-			// write recomputes checksums
-			omfs_write_inode(ctx->omfs_info, ctx->current_inode);
-			omfs_sync(ctx->omfs_info);
+			queue_repair(ctx, REPAIR_REWRITE);
+			return 1;
+		}
+		break;
+	case E_ROOT_CHECKSUM:
+		if (want_fix(ctx, "Correct?", 1))
+		{
+			ctx->fix_root = 1;
+			return 1;
 		}
-		else
-			printf("Skipping.\n");
 		break;
 	case E_HASH_WRONG:
-		if (prompt_yesno("Correct?"))
+		if (want_fix(ctx, "Move to proper location?", 1))
 		{
-			printf("Okay, moving to proper location.\n");
-			move_file(ctx, ctx->parent);
+			queue_repair(ctx, REPAIR_MOVE);
+			return 1;
 		}
-		else
-			printf("Skipping.\n");
 		break;
 	case E_BITMAP:
-		if (prompt_yesno("Rebuild?"))
+		if (want_fix(ctx, "Rebuild?", 1))
 		{
 			printf("Okay writing computed bitmap.\n");
-			ctx->omfs_info->bitmap->bmap = ctx->visited;
-			omfs_flush_bitmap(ctx->omfs_info);
+			size = (swap_be64(ctx->omfs_info->super->s_num_blocks) 
+				+ 7) / 8;
+			memcpy(ctx->omfs_info->bitmap->bmap, ctx->visited, size);
+			omfs_mark_bitmap_dirty(ctx->omfs_info);
+			if (omfs_flush_bitmap(ctx->omfs_info))
+				break;
+			omfs_sync(ctx->omfs_info);
+			ctx->config->changed = 1;
+			return 1;
 		}
-		else
-			printf("Skipping.\n");
 		break;
 	default:
 		printf("Weird, I don't do anything about that yet\n");
 		break;
 	}
+	ctx->unfixed++;
+	return 0;
 }
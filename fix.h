@@ -1,6 +1,8 @@
 #ifndef _FIX_H
 #define _FIX_H
 
-void fix_problem(check_error_t error, check_context_t *ctx);
+void fix_report(check_error_t error, check_context_t *ctx);
+int fix_problem(check_error_t error, check_context_t *ctx);
+int fix_apply(check_context_t *ctx);
 
 #endif /* _FIX_H */
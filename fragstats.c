@@ -0,0 +1,346 @@
+/*
+ *  File and free space layout for omfsdump --extents, --frag-summary
+ *  and --free-stats.
+ *
+ *  One dirscan pass walks each file's extent table and continuation
+ *  blocks.  Everything is worked out from the extent entries
+ *  themselves, a start and a length each, so a big file costs no
+ *  more than its table.  Contiguity is the share of a file's
+ *  consecutive block pairs that are also next to each other on disk;
+ *  extents that happen to sit end to end count as contiguous, as a
+ *  read doesn't have to seek between them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "dirscan.h"
+#include "check.h"
+#include "io.h"
+#include "dump.h"
+
+/* classes 1, 2, 3-4, 5-8, ... up to the last, which is open ended */
+#define NUM_CLASSES 12
+
+struct extent
+{
+	u64 start;
+	u64 len;
+};
+
+struct frag_stats
+{
+	omfs_info_t *info;
+	int list;
+	struct extent *ext;	/* of the file at hand */
+	u64 num_ext;
+	u64 ext_size;
+	u64 conts;
+
+	u64 files;
+	u64 data_files;
+	u64 fragmented;		/* more than one extent */
+	u64 with_conts;
+	u64 bad;		/* tables that don't look right */
+	u64 total_ext;
+	u64 total_conts;
+	u64 blocks;
+	u64 pairs;		/* consecutive block pairs, and of those */
+	u64 seq_pairs;		/* the ones next to each other on disk */
+	u64 max_ext;
+	u64 ext_hist[NUM_CLASSES];	/* extents per file */
+	u64 len_hist[NUM_CLASSES];	/* mean extent length per file */
+};
+
+static void class_name(int c, int num_classes, char *buf, size_t size)
+{
+	if (c < 2)
+		snprintf(buf, size, "%d", c + 1);
+	else if (c == num_classes - 1)
+		snprintf(buf, size, "%" PRIu64 "+", ((u64) 1 << (c - 1)) + 1);
+	else
+		snprintf(buf, size, "%" PRIu64 "-%" PRIu64,
+			((u64) 1 << (c - 1)) + 1, (u64) 1 << c);
+}
+
+static int add_extent(struct frag_stats *fs, u64 start, u64 len)
+{
+	struct extent *ext;
+
+	if (fs->num_ext == fs->ext_size)
+	{
+		fs->ext_size = fs->ext_size ? fs->ext_size * 2 : 64;
+		ext = realloc(fs->ext, fs->ext_size * sizeof(*ext));
+		if (!ext)
+			return -1;
+		fs->ext = ext;
+	}
+	fs->ext[fs->num_ext].start = start;
+	fs->ext[fs->num_ext].len = len;
+	fs->num_ext++;
+	return 0;
+}
+
+/* read the file's extents into fs->ext; 1 if a table looks wrong */
+static int read_extents(struct frag_stats *fs, u64 block,
+	omfs_inode_t *inode)
+{
+	struct omfs_extent_iter it;
+	struct omfs_extent_entry *entry;
+	int count, ret;
+
+	fs->num_ext = 0;
+	omfs_extent_begin(fs->info, block, inode, &it);
+	while ((ret = omfs_extent_next(&it)) > 0)
+	{
+		entry = &it.table->e_entry;
+		for (count = it.count; count; count--, entry++)
+			if (add_extent(fs, swap_be64(entry->e_cluster),
+			    swap_be64(entry->e_blocks)))
+				goto out;
+	}
+out:
+	fs->conts = it.conts;
+	omfs_extent_end(&it);
+	return ret != 0;
+}
+
+static void print_file(struct frag_stats *fs, dirscan_entry_t *entry,
+	u64 blocks, u64 seq)
+{
+	char *name = escape(entry->inode->i_name);
+	u64 i;
+	int col = 0;
+
+	printf("%8" PRIx64 " %s: %" PRIu64 " blocks, %" PRIu64 " extents, %"
+		PRIu64 " continuation blocks, %.1f%% contiguous\n",
+		entry->block, name, blocks, fs->num_ext, fs->conts,
+		blocks > 1 ? 100.0 * seq / (blocks - 1) : 100.0);
+	for (i = 0; i < fs->num_ext; i++)
+	{
+		if (col > 60)
+		{
+			putchar('\n');
+			col = 0;
+		}
+		col += printf("%s%" PRIx64 "+%" PRIu64,
+			col ? " " : "        ", fs->ext[i].start,
+			fs->ext[i].len);
+	}
+	if (col)
+		putchar('\n');
+	free(name);
+}
+
+static int on_node(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct frag_stats *fs = user;
+	u64 i, blocks = 0, seq = 0;
+
+	if (entry->inode->i_type != OMFS_FILE)
+		return 0;
+
+	fs->files++;
+	if (read_extents(fs, entry->block, entry->inode))
+	{
+		fs->bad++;
+		if (fs->list)
+			printf("%8" PRIx64 ": bad extent table\n",
+				entry->block);
+		return 0;
+	}
+
+	for (i = 0; i < fs->num_ext; i++)
+	{
+		blocks += fs->ext[i].len;
+		if (fs->ext[i].len)
+			seq += fs->ext[i].len - 1;
+		if (i && fs->ext[i].start == fs->ext[i - 1].start +
+		    fs->ext[i - 1].len)
+			seq++;
+	}
+	if (fs->list)
+		print_file(fs, entry, blocks, seq);
+	if (!fs->num_ext)
+		return 0;
+
+	fs->data_files++;
+	if (fs->num_ext > 1)
+		fs->fragmented++;
+	if (fs->conts)
+		fs->with_conts++;
+	if (fs->num_ext > fs->max_ext)
+		fs->max_ext = fs->num_ext;
+	fs->total_ext += fs->num_ext;
+	fs->total_conts += fs->conts;
+	fs->blocks += blocks;
+	if (blocks)
+	{
+		fs->pairs += blocks - 1;
+		fs->seq_pairs += seq;
+	}
+	fs->ext_hist[omfs_size_class(fs->num_ext, NUM_CLASSES)]++;
+	fs->len_hist[omfs_size_class(blocks / fs->num_ext, NUM_CLASSES)]++;
+	return 0;
+}
+
+static void print_hist(char *title, u64 *hist, u64 total)
+{
+	char name[32];
+	int c, last;
+
+	for (last = NUM_CLASSES - 1; last > 0 && !hist[last]; last--)
+		;
+	printf("\n%s:\n", title);
+	for (c = 0; c <= last; c++)
+	{
+		class_name(c, NUM_CLASSES, name, sizeof(name));
+		printf("%12s %10" PRIu64 " %5.1f%%\n", name, hist[c],
+			total ? 100.0 * hist[c] / total : 0.0);
+	}
+}
+
+static void print_summary(struct frag_stats *fs)
+{
+	u64 n = fs->data_files;
+
+	if (fs->list)
+		putchar('\n');
+	printf("Files: %" PRIu64 ", %" PRIu64 " with data\n", fs->files, n);
+	printf("Fragmented: %" PRIu64 " (%.1f%%)\n", fs->fragmented,
+		n ? 100.0 * fs->fragmented / n : 0.0);
+	printf("With continuation blocks: %" PRIu64 " (%.1f%%), %" PRIu64
+		" continuation blocks\n", fs->with_conts,
+		n ? 100.0 * fs->with_conts / n : 0.0, fs->total_conts);
+	printf("Extents: %" PRIu64 ", %.2f per file, at most %" PRIu64 "\n",
+		fs->total_ext, n ? (double) fs->total_ext / n : 0.0,
+		fs->max_ext);
+	printf("Mean extent length: %.1f blocks\n", fs->total_ext ?
+		(double) fs->blocks / fs->total_ext : 0.0);
+	printf("Contiguity: %.1f%%\n", fs->pairs ?
+		100.0 * fs->seq_pairs / fs->pairs : 100.0);
+	if (fs->bad)
+		printf("Files with bad extent tables: %" PRIu64 "\n",
+			fs->bad);
+
+	print_hist("Extents per file", fs->ext_hist, n);
+	print_hist("Mean extent length per file, in blocks", fs->len_hist,
+		n);
+}
+
+int dump_frag(omfs_dev_t *dev, dump_scope_t *scope, int list, int summary,
+	int verbose)
+{
+	int ok = 0;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct omfs_stats stats;
+	struct frag_stats fs;
+	omfs_info_t info = {
+		.dev = dev,
+		.super = &super,
+		.root = &root
+	};
+
+	if (omfs_read_super(&info) || omfs_read_root_block(&info))
+	{
+		printf ("Could not read super or root block\n");
+		return 0;
+	}
+
+	memset(&fs, 0, sizeof(fs));
+	fs.info = &info;
+	fs.list = list;
+	if (dump_scan(&info, scope, on_node, &fs) < 0)
+		printf("Dirscan failed\n");
+	else
+	{
+		if (summary)
+			print_summary(&fs);
+		ok = 1;
+	}
+
+	if (verbose)
+	{
+		omfs_get_stats(&info, &stats);
+		putchar('\n');
+		omfs_print_stats(stdout, &stats);
+	}
+	free(fs.ext);
+	return ok;
+}
+
+static void print_free_stats(struct omfs_free_stats *st, u64 num_blocks,
+	u32 cluster)
+{
+	char name[32];
+	int c, last;
+
+	printf("Free blocks: %" PRIu64 " of %" PRIu64 " (%.1f%%)\n", st->free,
+		num_blocks, num_blocks ? 100.0 * st->free / num_blocks : 0.0);
+	printf("Free runs: %" PRIu64 ", mean length %.1f\n", st->runs,
+		st->runs ? (double) st->free / st->runs : 0.0);
+	printf("Largest free run: %" PRIu64 " blocks at %" PRIx64 "\n",
+		st->largest, st->largest_start);
+	printf("Free in whole %u-block clusters: %" PRIu64 " (%.1f%%)\n",
+		cluster, st->cluster_free, st->free ?
+		100.0 * st->cluster_free / st->free : 0.0);
+
+	for (last = OMFS_FREE_CLASSES - 1; last > 0 &&
+	     !st->runs_by_len[last]; last--)
+		;
+	printf("\nFree runs by length:\n%12s %10s %12s %6s\n", "blocks",
+		"runs", "free", "%free");
+	for (c = 0; c <= last; c++)
+	{
+		class_name(c, OMFS_FREE_CLASSES, name, sizeof(name));
+		printf("%12s %10" PRIu64 " %12" PRIu64 " %5.1f%%\n", name,
+			st->runs_by_len[c], st->blocks_by_len[c], st->free ?
+			100.0 * st->blocks_by_len[c] / st->free : 0.0);
+	}
+}
+
+int dump_free_stats(omfs_dev_t *dev, int verbose)
+{
+	int ok = 0, ret;
+	u32 cluster;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct omfs_stats stats;
+	struct omfs_free_stats st;
+	omfs_info_t info = {
+		.dev = dev,
+		.super = &super,
+		.root = &root
+	};
+
+	if (omfs_read_super(&info) || omfs_read_root_block(&info))
+	{
+		printf ("Could not read super or root block\n");
+		return 0;
+	}
+	cluster = swap_be32(root.r_clustersize);
+	if ((ret = omfs_load_bitmap(&info)) ||
+	    (ret = omfs_free_stats(&info, cluster ? cluster : 1, &st)))
+		printf("Could not read bitmap: %s\n", strerror(-ret));
+	else
+	{
+		print_free_stats(&st, swap_be64(super.s_num_blocks), cluster);
+		ok = 1;
+	}
+
+	if (verbose)
+	{
+		omfs_get_stats(&info, &stats);
+		putchar('\n');
+		omfs_print_stats(stdout, &stats);
+	}
+	if (info.bitmap)
+	{
+		free(info.bitmap->bmap);
+		free(info.bitmap->dirty);
+		free(info.bitmap);
+	}
+	return ok;
+}
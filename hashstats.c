@@ -0,0 +1,304 @@
+/*
+ *  Hash chain statistics for omfsdump --hash-stats.
+ *
+ *  Every directory has the same fixed number of buckets, so a big one
+ *  ends up with long sibling chains and linear lookups.  One dirscan
+ *  pass counts each directory's entries per bucket; entries aren't
+ *  visited a directory at a time, so the counts are kept per
+ *  directory block until the scan ends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "dirscan.h"
+#include "check.h"
+#include "io.h"
+#include "dump.h"
+
+/* chain length classes: 0, 1, 2, 3-4, 5-8, 9-16, 17-32, 33+ */
+#define NUM_CLASSES 8
+#define NUM_OUTLIERS 10
+
+struct dir_stats
+{
+	u64 block;
+	u64 parent;
+	char *name;
+	u32 entries;
+	u32 *chains;		/* entries in each bucket */
+	u32 used;
+	u32 max;
+	u32 hist[NUM_CLASSES];
+};
+
+struct hash_stats
+{
+	struct dir_stats *dirs;
+	u32 count;
+	u32 size;
+	u32 *index;		/* open addressing on block, to dirs + 1 */
+	u32 index_mask;
+	int buckets;
+};
+
+static char *class_names[NUM_CLASSES] = {
+	"0", "1", "2", "3-4", "5-8", "9-16", "17-32", "33+"
+};
+
+/* empty chains get a class of their own ahead of the size classes */
+static int chain_class(u32 len)
+{
+	return len ? 1 + omfs_size_class(len, NUM_CLASSES - 1) : 0;
+}
+
+static u32 slot_of(struct hash_stats *hs, u64 block)
+{
+	return (block * 0x9e3779b97f4a7c15ULL >> 32) & hs->index_mask;
+}
+
+static int grow_index(struct hash_stats *hs)
+{
+	u32 i, j, size = hs->index_mask ? (hs->index_mask + 1) * 2 : 1024;
+	u32 *index = calloc(size, sizeof(u32));
+
+	if (!index)
+		return -1;
+	free(hs->index);
+	hs->index = index;
+	hs->index_mask = size - 1;
+	for (i = 0; i < hs->count; i++)
+	{
+		for (j = slot_of(hs, hs->dirs[i].block); index[j];
+		     j = (j + 1) & hs->index_mask)
+			;
+		index[j] = i + 1;
+	}
+	return 0;
+}
+
+static struct dir_stats *get_dir(struct hash_stats *hs, u64 block)
+{
+	struct dir_stats *dirs, *dir;
+	u32 i;
+
+	for (i = slot_of(hs, block); hs->index[i];
+	     i = (i + 1) & hs->index_mask)
+	{
+		if (hs->dirs[hs->index[i] - 1].block == block)
+			return &hs->dirs[hs->index[i] - 1];
+	}
+
+	if (hs->count == hs->size)
+	{
+		hs->size = hs->size ? hs->size * 2 : 256;
+		dirs = realloc(hs->dirs, hs->size * sizeof(*dirs));
+		if (!dirs)
+			return NULL;
+		hs->dirs = dirs;
+	}
+	dir = &hs->dirs[hs->count];
+	memset(dir, 0, sizeof(*dir));
+	dir->block = block;
+	dir->parent = ~0ULL;
+	dir->chains = calloc(hs->buckets, sizeof(u32));
+	if (!dir->chains)
+		return NULL;
+	hs->index[i] = ++hs->count;
+
+	/* keep the index at most half full */
+	if (hs->count * 2 > hs->index_mask && grow_index(hs))
+		return NULL;
+	return &hs->dirs[hs->count - 1];
+}
+
+static int on_node(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct hash_stats *hs = user;
+	struct dir_stats *dir;
+
+	if (entry->inode->i_type == OMFS_DIR)
+	{
+		dir = get_dir(hs, entry->block);
+		if (!dir)
+			return -1;
+		if (!dir->name)
+			dir->name = escape(entry->inode->i_name);
+		dir->parent = entry->parent;
+	}
+	if (entry->parent == ~0ULL)
+		return 0;
+
+	dir = get_dir(hs, entry->parent);
+	if (!dir)
+		return -1;
+	dir->entries++;
+	if (entry->hindex >= 0 && entry->hindex < hs->buckets)
+		dir->chains[entry->hindex]++;
+	return 0;
+}
+
+static struct dir_stats *find_dir(struct hash_stats *hs, u64 block)
+{
+	u32 i;
+
+	for (i = slot_of(hs, block); hs->index[i];
+	     i = (i + 1) & hs->index_mask)
+	{
+		if (hs->dirs[hs->index[i] - 1].block == block)
+			return &hs->dirs[hs->index[i] - 1];
+	}
+	return NULL;
+}
+
+/* the path from the root, as far as the parents are known */
+static void print_path(struct hash_stats *hs, struct dir_stats *dir,
+	int depth)
+{
+	struct dir_stats *parent = find_dir(hs, dir->parent);
+
+	if (!parent)
+	{
+		putchar('/');
+		return;
+	}
+	if (parent != dir && depth < 256)
+		print_path(hs, parent, depth + 1);
+	printf("%s/", dir->name ? dir->name : "?");
+}
+
+static void print_dir(struct hash_stats *hs, struct dir_stats *dir)
+{
+	int i;
+
+	printf("%8" PRIx64 " %8u %5u %5u %6.2f ", dir->block, dir->entries,
+		dir->used, dir->max, dir->used ?
+		(double) dir->entries / dir->used : 0.0);
+	for (i = 0; i < NUM_CLASSES; i++)
+		printf(" %u", dir->hist[i]);
+	putchar(' ');
+	print_path(hs, dir, 0);
+	putchar('\n');
+}
+
+static int by_max(const void *a, const void *b)
+{
+	const struct dir_stats *x = *(struct dir_stats **) a;
+	const struct dir_stats *y = *(struct dir_stats **) b;
+
+	if (x->max != y->max)
+		return x->max < y->max ? 1 : -1;
+	return x->entries < y->entries ? 1 : x->entries > y->entries ? -1 : 0;
+}
+
+static void report(struct hash_stats *hs)
+{
+	struct dir_stats **sorted, *dir;
+	u64 total[NUM_CLASSES] = { 0 }, entries = 0, used = 0;
+	u32 i, b, max = 0;
+	int c;
+
+	for (i = 0; i < hs->count; i++)
+	{
+		dir = &hs->dirs[i];
+		for (b = 0; b < hs->buckets; b++)
+		{
+			if (dir->chains[b])
+				dir->used++;
+			if (dir->chains[b] > dir->max)
+				dir->max = dir->chains[b];
+			dir->hist[chain_class(dir->chains[b])]++;
+		}
+		for (c = 0; c < NUM_CLASSES; c++)
+			total[c] += dir->hist[c];
+		entries += dir->entries;
+		used += dir->used;
+		if (dir->max > max)
+			max = dir->max;
+	}
+
+	printf("Hash chains, %d buckets per directory; histogram of chain "
+		"lengths", hs->buckets);
+	for (c = 0; c < NUM_CLASSES; c++)
+		printf(" %s", class_names[c]);
+	printf("\n\n%8s %8s %5s %5s %6s  %s\n", "block", "entries", "used",
+		"max", "mean", "histogram path");
+	for (i = 0; i < hs->count; i++)
+		print_dir(hs, &hs->dirs[i]);
+
+	printf("\nDirectories: %u\n", hs->count);
+	printf("Entries: %" PRIu64 "\n", entries);
+	printf("Buckets used: %" PRIu64 " of %" PRIu64 "\n", used,
+		(u64) hs->count * hs->buckets);
+	printf("Mean chain: %.2f\n", used ? (double) entries / used : 0.0);
+	printf("Longest chain: %u\n", max);
+	printf("Chain lengths:");
+	for (c = 0; c < NUM_CLASSES; c++)
+		printf(" %s:%" PRIu64, class_names[c], total[c]);
+	putchar('\n');
+
+	sorted = malloc(hs->count * sizeof(*sorted));
+	if (!sorted || !hs->count)
+	{
+		free(sorted);
+		return;
+	}
+	for (i = 0; i < hs->count; i++)
+		sorted[i] = &hs->dirs[i];
+	qsort(sorted, hs->count, sizeof(*sorted), by_max);
+
+	printf("\nLongest chains:\n");
+	for (i = 0; i < hs->count && i < NUM_OUTLIERS && sorted[i]->max > 1;
+	     i++)
+		print_dir(hs, sorted[i]);
+	free(sorted);
+}
+
+int dump_hash_stats(omfs_dev_t *dev, int verbose)
+{
+	int ok = 0;
+	u32 i;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct omfs_stats stats;
+	struct hash_stats hs = { NULL };
+	omfs_info_t info = {
+		.dev = dev,
+		.super = &super,
+		.root = &root
+	};
+
+	if (omfs_read_super(&info) || omfs_read_root_block(&info))
+	{
+		printf ("Could not read super or root block\n");
+		return 0;
+	}
+	hs.buckets = (swap_be32(super.s_sys_blocksize) - OMFS_DIR_START) / 8;
+	if (grow_index(&hs))
+		return 0;
+
+	if (dirscan_begin(&info, on_node, &hs) < 0)
+		printf("Dirscan failed\n");
+	else
+	{
+		report(&hs);
+		ok = 1;
+	}
+
+	if (verbose)
+	{
+		omfs_get_stats(&info, &stats);
+		putchar('\n');
+		omfs_print_stats(stdout, &stats);
+	}
+
+	for (i = 0; i < hs.count; i++)
+	{
+		free(hs.dirs[i].name);
+		free(hs.dirs[i].chains);
+	}
+	free(hs.dirs);
+	free(hs.index);
+	return ok;
+}
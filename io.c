@@ -17,6 +17,17 @@ char *escape(char *s)
 	return tmp;
 }
 
+/* escape() into buf, for when there are a lot of names */
+char *escape_to(char *buf, char *s, int size)
+{
+	int i;
+
+	for (i = 0; i < size - 1 && s[i]; i++)
+		buf[i] = isprint(s[i]) ? s[i] : '.';
+	buf[i] = 0;
+	return buf;
+}
+
 static void expand_custom(char ch, check_context_t *ctx)
 {
 	char *s;
@@ -29,9 +40,18 @@ static void expand_custom(char ch, check_context_t *ctx)
 		fputc('$', stdout);
 		break;
 	case 'I':
-		printf("%" PRIx64, swap_be64(ctx->current_inode->i_head.h_self));
+		if (!ctx->current_inode)
+			printf("%" PRIx64, ctx->block);
+		else
+			printf("%" PRIx64, 
+				swap_be64(ctx->current_inode->i_head.h_self));
 		break;
 	case 'F':
+		if (!ctx->current_inode)
+		{
+			printf("?");
+			break;
+		}
 		s = escape(ctx->current_inode->i_name);
 		printf("%s", s);
 		free(s);
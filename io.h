@@ -2,6 +2,7 @@
 #define IO_H
 
 char *escape(char *s);
+char *escape_to(char *buf, char *s, int size);
 void sad_print(char *fmt, check_context_t *ctx);
 int prompt_yesno(char *msg);
 
@@ -0,0 +1,387 @@
+/*
+ *  Metadata layout for omfsreorder -L.
+ *
+ *  Churn leaves a directory's inodes and extent continuation blocks
+ *  all over the disk, so every traversal seeks.  This lays them out
+ *  again in the order dirscan visits them: a first scan records that
+ *  order, then each block is moved to the free space nearest to where
+ *  the previous one ended up, if that's closer than where it is.  A
+ *  second pass over the new locations rewrites h_self, i_parent, the
+ *  bucket, sibling and e_next pointers, and the bitmap is rebuilt
+ *  from what is actually in use.  The root directory stays put.
+ *
+ *  Blocks are only reused once their contents have been copied, and
+ *  the second pass reads nothing but new locations, so everything can
+ *  be staged in the caller's transaction.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "bits.h"
+#include "dirscan.h"
+#include "reorder.h"
+
+#define ITEM_INODE 0
+#define ITEM_CONT 1
+
+/* a block this close to where it should go isn't worth moving */
+#define LAYOUT_SLACK 16
+
+struct item
+{
+	u64 block;
+	u64 new_block;
+	int kind;
+};
+
+struct move
+{
+	u64 from;
+	u64 to;
+};
+
+struct layout
+{
+	omfs_info_t *info;
+	reorder_config_t *config;
+	struct layout_stats *stats;
+	int mirrors;
+	u64 num_blocks;
+	struct item *items;	/* in dirscan order */
+	u64 count;
+	u64 size;
+	struct move *moves;	/* sorted on from */
+	u64 num_moves;
+	u8 *seen;
+	u8 *in_use;		/* the rebuilt bitmap */
+	int error;
+};
+
+static u64 distance(u64 a, u64 b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static int add_item(struct layout *lo, u64 block, int kind)
+{
+	struct item *items;
+
+	if (block >= lo->num_blocks || test_bit(lo->seen, block))
+		return -EUCLEAN;
+	set_bit(lo->seen, block);
+
+	if (lo->count == lo->size)
+	{
+		lo->size = lo->size ? lo->size * 2 : 1024;
+		items = realloc(lo->items, lo->size * sizeof(*items));
+		if (!items)
+			return -ENOMEM;
+		lo->items = items;
+	}
+	lo->items[lo->count].block = block;
+	lo->items[lo->count].new_block = block;
+	lo->items[lo->count].kind = kind;
+	lo->count++;
+	return 0;
+}
+
+/* data extents go straight into the rebuilt bitmap */
+static int add_file(struct layout *lo, u64 block, omfs_inode_t *inode)
+{
+	struct omfs_extent_iter it;
+	struct omfs_extent_entry *entry;
+	u64 start, len, i;
+	int count, ret;
+
+	omfs_extent_begin(lo->info, block, inode, &it);
+	while ((ret = omfs_extent_next(&it)) > 0)
+	{
+		if (it.conts && (ret = add_item(lo, it.block, ITEM_CONT)))
+			break;
+		entry = &it.table->e_entry;
+		for (count = it.count; count; count--, entry++)
+		{
+			start = swap_be64(entry->e_cluster);
+			len = swap_be64(entry->e_blocks);
+			for (i = 0; i < len && start + i < lo->num_blocks; i++)
+				set_bit(lo->in_use, start + i);
+		}
+	}
+	omfs_extent_end(&it);
+	return ret;
+}
+
+static int collect(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct layout *lo = user;
+	int ret;
+
+	ret = add_item(lo, entry->block, ITEM_INODE);
+	if (!ret && entry->inode->i_type == OMFS_FILE)
+		ret = add_file(lo, entry->block, entry->inode);
+	if (ret)
+	{
+		lo->error = ret;
+		d->stop = 1;
+	}
+	return ret;
+}
+
+/*
+ *  Move one block's copies to new, fixing h_self; the pointers to it
+ *  are fixed later.
+ */
+static int move_block(struct layout *lo, struct item *it, u64 new)
+{
+	omfs_inode_t *inode = omfs_get_inode(lo->info, it->block);
+	int ret;
+
+	if (!inode)
+		return -EIO;
+	inode->i_head.h_self = swap_be64(new);
+	ret = omfs_write_inode(lo->info, inode);
+	omfs_release_inode(inode);
+	if (ret)
+		return ret;
+
+	omfs_clear_range(lo->info, it->block, lo->mirrors);
+	it->new_block = new;
+	return 0;
+}
+
+static int place(struct layout *lo)
+{
+	struct item *it;
+	u64 i, cursor, limit, new;
+	int ret;
+
+	/* the root directory is first and stays where it is */
+	cursor = lo->items[0].block + lo->mirrors;
+	for (i = 1; i < lo->count; i++)
+	{
+		it = &lo->items[i];
+		limit = distance(it->block, cursor);
+		if (limit <= LAYOUT_SLACK)
+		{
+			cursor = it->block + lo->mirrors;
+			continue;
+		}
+
+		limit = limit > lo->config->max_dist ?
+			lo->config->max_dist : limit - 1;
+		if (omfs_allocate_near(lo->info, cursor, lo->mirrors, limit,
+		    &new))
+		{
+			cursor = it->block + lo->mirrors;
+			continue;
+		}
+		if ((ret = move_block(lo, it, new)))
+			return ret;
+		lo->stats->moved++;
+		cursor = new + lo->mirrors;
+	}
+	return 0;
+}
+
+static int by_from(const void *a, const void *b)
+{
+	u64 x = ((struct move *) a)->from, y = ((struct move *) b)->from;
+	return x < y ? -1 : x > y;
+}
+
+static int build_moves(struct layout *lo)
+{
+	u64 i;
+
+	lo->moves = malloc((lo->stats->moved + 1) * sizeof(*lo->moves));
+	if (!lo->moves)
+		return -ENOMEM;
+	for (i = 0; i < lo->count; i++)
+	{
+		if (lo->items[i].block == lo->items[i].new_block)
+			continue;
+		lo->moves[lo->num_moves].from = lo->items[i].block;
+		lo->moves[lo->num_moves].to = lo->items[i].new_block;
+		lo->num_moves++;
+	}
+	qsort(lo->moves, lo->num_moves, sizeof(*lo->moves), by_from);
+	return 0;
+}
+
+/* repoint a big-endian block pointer if its target moved */
+static int remap(struct layout *lo, __be64 *ptr)
+{
+	struct move key, *m;
+
+	if (*ptr == ~0ULL)
+		return 0;
+	key.from = swap_be64(*ptr);
+	m = bsearch(&key, lo->moves, lo->num_moves, sizeof(*m), by_from);
+	if (!m)
+		return 0;
+	*ptr = swap_be64(m->to);
+	return 1;
+}
+
+static int relink(struct layout *lo)
+{
+	omfs_inode_t *inode;
+	struct omfs_extent *oe;
+	struct item *it;
+	__be64 *heads;
+	u64 i;
+	int b, buckets, changed, ret = 0;
+
+	buckets = (swap_be32(lo->info->super->s_sys_blocksize) -
+		OMFS_DIR_START) / 8;
+
+	for (i = 0; i < lo->count && !ret; i++)
+	{
+		it = &lo->items[i];
+		inode = omfs_get_inode(lo->info, it->new_block);
+		if (!inode)
+			return -EIO;
+
+		changed = 0;
+		if (it->kind == ITEM_CONT)
+		{
+			oe = (struct omfs_extent *) ((u8 *) inode +
+				OMFS_EXTENT_CONT);
+			changed |= remap(lo, &oe->e_next);
+		}
+		else
+		{
+			changed |= remap(lo, &inode->i_parent);
+			changed |= remap(lo, &inode->i_sibling);
+			if (inode->i_type == OMFS_DIR)
+			{
+				heads = (__be64 *) ((u8 *) inode + OMFS_DIR_START);
+				for (b = 0; b < buckets; b++)
+					changed |= remap(lo, &heads[b]);
+			}
+			else
+			{
+				oe = (struct omfs_extent *) ((u8 *) inode +
+					OMFS_EXTENT_START);
+				changed |= remap(lo, &oe->e_next);
+			}
+		}
+
+		if (changed)
+		{
+			ret = omfs_write_inode(lo->info, inode);
+			lo->stats->rewritten++;
+		}
+		omfs_release_inode(inode);
+	}
+	return ret;
+}
+
+/*
+ *  Replace the bitmap with the blocks actually in use: the reserved
+ *  area, data extents and the metadata where it now is.
+ */
+static void rebuild_bitmap(struct layout *lo)
+{
+	omfs_info_t *info = lo->info;
+	u64 i, first, bsize = (lo->num_blocks + 7) / 8;
+	int blocksize = swap_be32(info->super->s_blocksize), m;
+	unsigned long before = omfs_count_free(info), after;
+
+	first = swap_be64(info->root->r_bitmap) +
+		(bsize + blocksize - 1) / blocksize;
+	for (i = 0; i < first && i < lo->num_blocks; i++)
+		set_bit(lo->in_use, i);
+	for (i = 0; i < lo->count; i++)
+		for (m = 0; m < lo->mirrors; m++)
+			set_bit(lo->in_use, lo->items[i].new_block + m);
+
+	memcpy(info->bitmap->bmap, lo->in_use, bsize);
+	omfs_mark_bitmap_dirty(info);
+	after = omfs_count_free(info);
+	lo->stats->reclaimed = after > before ? after - before : 0;
+}
+
+static u64 scan_distance(struct layout *lo, int after)
+{
+	u64 i, dist = 0, prev = lo->items[0].block, cur;
+
+	for (i = 1; i < lo->count; i++)
+	{
+		cur = after ? lo->items[i].new_block : lo->items[i].block;
+		dist += distance(prev, cur);
+		prev = cur;
+	}
+	return dist;
+}
+
+int layout_fs(omfs_info_t *info, reorder_config_t *config,
+	struct layout_stats *stats)
+{
+	struct layout lo;
+	u64 bsize;
+	int ret;
+
+	memset(&lo, 0, sizeof(lo));
+	memset(stats, 0, sizeof(*stats));
+	lo.info = info;
+	lo.config = config;
+	lo.stats = stats;
+	lo.mirrors = swap_be32(info->super->s_mirrors);
+	lo.num_blocks = swap_be64(info->super->s_num_blocks);
+
+	if (swap_be64(info->root->r_bitmap) == ~0ULL)
+		return -EOPNOTSUPP;
+
+	bsize = (lo.num_blocks + 7) / 8 + 1;
+	lo.seen = calloc(1, bsize);
+	lo.in_use = calloc(1, bsize);
+	if (!lo.seen || !lo.in_use)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = dirscan_begin(info, collect, &lo);
+	if (lo.error)
+		ret = lo.error;
+	else if (ret != 1 || !lo.count)
+		ret = -EUCLEAN;
+	else
+		ret = 0;
+	if (ret)
+		goto out;
+
+	stats->blocks = lo.count;
+	stats->dist_before = scan_distance(&lo, 0);
+
+	if (!(ret = place(&lo)) && !(ret = build_moves(&lo)) &&
+	    !(ret = relink(&lo)))
+	{
+		rebuild_bitmap(&lo);
+		stats->dist_after = scan_distance(&lo, 1);
+	}
+out:
+	free(lo.items);
+	free(lo.moves);
+	free(lo.seen);
+	free(lo.in_use);
+	return ret;
+}
+
+void layout_print(struct layout_stats *stats)
+{
+	printf("Metadata blocks: %" PRIu64 ", %" PRIu64 " moved\n",
+		stats->blocks, stats->moved);
+	printf("Inodes rewritten: %" PRIu64 "\n", stats->rewritten);
+	printf("Unused blocks freed in the bitmap: %" PRIu64 "\n",
+		stats->reclaimed);
+	if (stats->blocks > 1)
+		printf("Mean blocks between scan reads: %.1f before, "
+			"%.1f after\n", (double) stats->dist_before /
+			(stats->blocks - 1), (double) stats->dist_after /
+			(stats->blocks - 1));
+}
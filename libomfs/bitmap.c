@@ -1,5 +1,6 @@
 /* Routines for bitmap allocation */
 #include <stdlib.h>
+#include <string.h>
 #include "omfs.h"
 #include "bits.h"
 #include "errno.h"
@@ -33,12 +34,25 @@ static void mark_dirty(omfs_info_t *info, u64 block)
     set_bit(info->bitmap->dirty, bit_blk);
 }
 
+/*
+ *  Mark every bitmap block dirty, for when the whole map was replaced.
+ */
+void omfs_mark_bitmap_dirty(omfs_info_t *info)
+{
+    int blocksize = swap_be32(info->super->s_blocksize);
+    u64 size = (swap_be64(info->super->s_num_blocks) + 7) / 8;
+    u64 i, bsize = (size + blocksize - 1) / blocksize;
+
+    for (i = 0; i < bsize; i++)
+        set_bit(info->bitmap->dirty, i);
+}
+
 /* 
  * Scan through a bitmap for power-of-two sized region (max 8).  This 
  * should help to keep down fragmentation as mirrors will generally 
  * align to 2 blocks and clusters to 8.
  */
-static int scan(u8* buf, int bsize, int bits)
+int omfs_scan_bitmap(u8* buf, int bsize, int bits)
 {
     int shift = 1 << bits;
     int mask = shift - 1;
@@ -95,7 +109,7 @@ int omfs_allocate_block(omfs_info_t *info, int size, u64 *return_block)
 
     bsize = (swap_be64(info->super->s_num_blocks) + 7) / 8;
 
-    block = scan(bitmap, bsize, size);
+    block = omfs_scan_bitmap(bitmap, bsize, size);
     if (block == bsize * 8) {
         ret = -ENOSPC;
         goto out;
@@ -110,3 +124,200 @@ out:
     return ret;
 }
 
+static int range_free(u8 *bitmap, u64 start, int count)
+{
+    int i;
+
+    for (i=0; i < count; i++)
+        if (test_bit(bitmap, start + i))
+            return 0;
+    return 1;
+}
+
+/*
+ *  Allocate size blocks, aligned to size, as close to goal as there
+ *  are free ones but no more than max_dist blocks away.  Used to put
+ *  inodes near their directory.
+ */
+int omfs_allocate_near(omfs_info_t *info, u64 goal, int size, u64 max_dist,
+    u64 *return_block)
+{
+    u64 num_blocks = swap_be64(info->super->s_num_blocks);
+    u8 *bitmap = info->bitmap->bmap;
+    u64 d, block;
+    int i, side;
+
+    goal -= goal % size;
+    for (d = 0; d <= max_dist; d += size)
+    {
+        if (goal + d >= num_blocks && d > goal)
+            break;
+
+        for (side = 0; side < 2; side++)
+        {
+            if (side == 0)
+                block = goal + d;
+            else if (d && d <= goal)
+                block = goal - d;
+            else
+                continue;
+
+            if (block + size > num_blocks || !range_free(bitmap, block, size))
+                continue;
+
+            for (i=0; i < size; i++) {
+                set_bit(bitmap, block + i);
+                mark_dirty(info, block + i);
+            }
+            omfs_flush_bitmap(info);
+            *return_block = block;
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+/*
+ *  Allocate count contiguous blocks: the first free run at or after
+ *  goal, or failing that, from the start of the device.
+ */
+int omfs_allocate_run(omfs_info_t *info, u64 goal, u64 count,
+    u64 *return_block)
+{
+    u64 num_blocks = swap_be64(info->super->s_num_blocks);
+    u8 *bitmap = info->bitmap->bmap;
+    u64 i, from, to, run, start;
+    int pass;
+
+    if (!count || goal >= num_blocks)
+        return -EINVAL;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        from = pass ? 0 : goal;
+        to = pass ? goal + count - 1 : num_blocks;
+        if (to > num_blocks)
+            to = num_blocks;
+
+        for (i = from, run = 0; i < to; i++)
+        {
+            /* skip full bytes whole */
+            if (!(i & 7) && bitmap[i >> 3] == 0xff)
+            {
+                i += 7;
+                run = 0;
+                continue;
+            }
+            if (test_bit(bitmap, i))
+            {
+                run = 0;
+                continue;
+            }
+            if (++run == count)
+                goto found;
+        }
+    }
+    return -ENOSPC;
+
+found:
+    start = i + 1 - count;
+    for (i = start; i < start + count; i++) {
+        set_bit(bitmap, i);
+        mark_dirty(info, i);
+    }
+    omfs_flush_bitmap(info);
+    *return_block = start;
+    return 0;
+}
+
+/*
+ *  Bitmap word i, bit n of the word being block 64 * i + n.  Bytes
+ *  past the end of the map read as in use.
+ */
+static u64 bitmap_word(u8 *map, u64 bsize, u64 i)
+{
+    u64 word = 0;
+    int b;
+
+    for (b = 7; b >= 0; b--)
+        word = word << 8 | (i * 8 + b < bsize ? map[i * 8 + b] : 0xff);
+    return word;
+}
+
+/* the first block at or after pos that is in use (or free), or nbits */
+static u64 next_bit(u8 *map, u64 bsize, u64 nbits, u64 pos, int in_use)
+{
+    u64 i = pos >> 6, word;
+
+    if (pos >= nbits)
+        return nbits;
+    word = bitmap_word(map, bsize, i);
+    if (!in_use)
+        word = ~word;
+    word &= ~0ULL << (pos & 63);
+
+    while (!word)
+    {
+        if (++i << 6 >= nbits)
+            return nbits;
+        word = bitmap_word(map, bsize, i);
+        if (!in_use)
+            word = ~word;
+    }
+    pos = (i << 6) + __builtin_ctzll(word);
+    return pos < nbits ? pos : nbits;
+}
+
+/*
+ *  Power of two size classes for histograms: 1, 2, 3-4, 5-8, ... and
+ *  the last of num_classes open ended.  0 goes in with 1.
+ */
+int omfs_size_class(u64 n, int num_classes)
+{
+    int c = 0;
+
+    for (n = n ? n - 1 : 0; n && c < num_classes - 1; n >>= 1)
+        c++;
+    return c;
+}
+
+/*
+ *  Measure how the free space is broken up: runs of free blocks by
+ *  length, the longest, and how many free blocks could still be
+ *  handed out a whole cluster at a time.  The map is scanned a word
+ *  at a time, jumping from one run boundary to the next.
+ */
+int omfs_free_stats(omfs_info_t *info, u32 cluster,
+    struct omfs_free_stats *stats)
+{
+    u64 num_blocks = swap_be64(info->super->s_num_blocks);
+    u64 bsize = (num_blocks + 7) / 8;
+    u64 start, end, len;
+    int c;
+
+    if (!info->bitmap || !cluster)
+        return -EINVAL;
+
+    memset(stats, 0, sizeof(*stats));
+    for (end = 0; end < num_blocks; )
+    {
+        start = next_bit(info->bitmap->bmap, bsize, num_blocks, end, 0);
+        if (start >= num_blocks)
+            break;
+        end = next_bit(info->bitmap->bmap, bsize, num_blocks, start, 1);
+        len = end - start;
+
+        stats->free += len;
+        stats->runs++;
+        stats->cluster_free += len - len % cluster;
+        if (len > stats->largest)
+        {
+            stats->largest = len;
+            stats->largest_start = start;
+        }
+        c = omfs_size_class(len, OMFS_FREE_CLASSES);
+        stats->runs_by_len[c]++;
+        stats->blocks_by_len[c] += len;
+    }
+    return 0;
+}
@@ -13,9 +13,17 @@ typedef int16_t s16;
 typedef int32_t s32;
 typedef int64_t s64;
 
+/*
+ *  glibc's sys/stat.h and friends pull in linux/types.h, which has its
+ *  own __be types; use those rather than clash with them.
+ */
+#ifdef __linux__
+#include <linux/types.h>
+#else
 typedef u64 __be64;
 typedef u32 __be32;
 typedef u16 __be16;
+#endif
 
 #if __BYTE_ORDER == __BIG_ENDIAN
 #define swap_be64(a) (a)
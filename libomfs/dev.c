@@ -0,0 +1,562 @@
+/*
+ *  Block device backends.
+ *
+ *  All device access in libomfs goes through an omfs_dev_t, which is
+ *  a table of operations plus whatever the backend needs.  Offsets
+ *  and lengths are in bytes, and block aligned except for the
+ *  superblock.  Reads and writes return the number of bytes moved,
+ *  or -errno; a short count means the range ran past the end.
+ *
+ *    stdio   FILE *, buffered; what libomfs always used
+ *    pread   pread/pwrite on a file descriptor
+ *    mmap    the whole device mapped shared
+ *    ram     the whole device read into memory; read only, since
+ *            writes would never reach the disk
+ *
+ *  Any of them can be wrapped to add a fixed delay to every access,
+ *  to try out I/O changes against a slower disk than the one at hand.
+ *  Callers hold dev_mutex, so backends needn't lock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "omfs.h"
+
+#define DEFAULT_BACKEND "stdio"
+
+struct stdio_dev {
+    FILE *fp;
+    int owned;                  /* close it with us */
+};
+
+struct fd_dev {
+    int fd;
+    u8 *map;                    /* mmap */
+    u64 size;                   /* mmap, ram */
+};
+
+struct latency_dev {
+    omfs_dev_t *lower;
+    struct timespec read_delay;
+    struct timespec write_delay;
+};
+
+static omfs_dev_t *dev_alloc(const struct omfs_dev_ops *ops, size_t priv)
+{
+    omfs_dev_t *dev = calloc(1, sizeof(*dev) + priv);
+
+    if (!dev)
+        return NULL;
+    dev->ops = ops;
+    dev->priv = dev + 1;
+    return dev;
+}
+
+/* stdio */
+
+static ssize_t stdio_read(omfs_dev_t *dev, u64 offset, void *buf, size_t len)
+{
+    FILE *fp = ((struct stdio_dev *) dev->priv)->fp;
+
+    if (fseeko(fp, offset, SEEK_SET))
+        return -errno;
+    len = fread(buf, 1, len, fp);
+    return ferror(fp) ? -EIO : len;
+}
+
+static ssize_t stdio_write(omfs_dev_t *dev, u64 offset, const void *buf,
+    size_t len)
+{
+    FILE *fp = ((struct stdio_dev *) dev->priv)->fp;
+
+    if (fseeko(fp, offset, SEEK_SET))
+        return -errno;
+    len = fwrite(buf, 1, len, fp);
+    return ferror(fp) ? -EIO : len;
+}
+
+static int stdio_flush(omfs_dev_t *dev)
+{
+    FILE *fp = ((struct stdio_dev *) dev->priv)->fp;
+
+    if (fflush(fp) || fsync(fileno(fp)))
+        return -errno;
+    return 0;
+}
+
+static u64 fd_size(int fd)
+{
+    struct stat st;
+    u64 size = 0;
+
+    if (fstat(fd, &st))
+        return 0;
+    if (S_ISBLK(st.st_mode) && !ioctl(fd, BLKGETSIZE64, &size))
+        return size;
+    return st.st_size;
+}
+
+/*
+ *  Throw away a range: punch a hole in a file, or discard it on a
+ *  block device.  What reads back afterwards depends on the device.
+ */
+static int fd_discard(int fd, u64 offset, u64 len)
+{
+    struct stat st;
+    u64 range[2] = { offset, len };
+
+    if (fstat(fd, &st))
+        return -errno;
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKDISCARD, range) ? -errno : 0;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        offset, len))
+        return -errno;
+    return 0;
+}
+
+static int stdio_discard(omfs_dev_t *dev, u64 offset, u64 len)
+{
+    FILE *fp = ((struct stdio_dev *) dev->priv)->fp;
+
+    if (fflush(fp))
+        return -errno;
+    return fd_discard(fileno(fp), offset, len);
+}
+
+static u64 stdio_size(omfs_dev_t *dev)
+{
+    FILE *fp = ((struct stdio_dev *) dev->priv)->fp;
+
+    fflush(fp);
+    return fd_size(fileno(fp));
+}
+
+static void stdio_close(omfs_dev_t *dev)
+{
+    struct stdio_dev *sd = dev->priv;
+
+    if (sd->owned)
+        fclose(sd->fp);
+}
+
+static const struct omfs_dev_ops stdio_ops = {
+    "stdio", stdio_read, stdio_write, stdio_flush, stdio_discard,
+    stdio_size, stdio_close
+};
+
+/* pread */
+
+static ssize_t pread_read(omfs_dev_t *dev, u64 offset, void *buf, size_t len)
+{
+    struct fd_dev *fd = dev->priv;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = pread(fd->fd, (u8 *) buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t pread_write(omfs_dev_t *dev, u64 offset, const void *buf,
+    size_t len)
+{
+    struct fd_dev *fd = dev->priv;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = pwrite(fd->fd, (u8 *) buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -errno : -EIO;
+        done += n;
+    }
+    return done;
+}
+
+static int pread_flush(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    return fsync(fd->fd) ? -errno : 0;
+}
+
+static int pread_discard(omfs_dev_t *dev, u64 offset, u64 len)
+{
+    struct fd_dev *fd = dev->priv;
+
+    return fd_discard(fd->fd, offset, len);
+}
+
+static u64 pread_size(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    return fd_size(fd->fd);
+}
+
+static void pread_close(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    close(fd->fd);
+}
+
+static const struct omfs_dev_ops pread_ops = {
+    "pread", pread_read, pread_write, pread_flush, pread_discard,
+    pread_size, pread_close
+};
+
+/* mmap and ram: the device is one big buffer */
+
+static ssize_t map_read(omfs_dev_t *dev, u64 offset, void *buf, size_t len)
+{
+    struct fd_dev *fd = dev->priv;
+
+    if (offset >= fd->size)
+        return 0;
+    if (len > fd->size - offset)
+        len = fd->size - offset;
+    memcpy(buf, fd->map + offset, len);
+    return len;
+}
+
+static ssize_t map_write(omfs_dev_t *dev, u64 offset, const void *buf,
+    size_t len)
+{
+    struct fd_dev *fd = dev->priv;
+
+    if (offset >= fd->size)
+        return 0;
+    if (len > fd->size - offset)
+        len = fd->size - offset;
+    memcpy(fd->map + offset, buf, len);
+    return len;
+}
+
+static int mmap_flush(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    return msync(fd->map, fd->size, MS_SYNC) ? -errno : 0;
+}
+
+static int map_discard(omfs_dev_t *dev, u64 offset, u64 len)
+{
+    struct fd_dev *fd = dev->priv;
+
+    if (offset >= fd->size)
+        return 0;
+    if (len > fd->size - offset)
+        len = fd->size - offset;
+    memset(fd->map + offset, 0, len);
+    return 0;
+}
+
+static u64 map_size(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    return fd->size;
+}
+
+static void mmap_close(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    munmap(fd->map, fd->size);
+    close(fd->fd);
+}
+
+static const struct omfs_dev_ops mmap_ops = {
+    "mmap", map_read, map_write, mmap_flush, map_discard, map_size,
+    mmap_close
+};
+
+static int ram_flush(omfs_dev_t *dev)
+{
+    return 0;
+}
+
+static void ram_close(omfs_dev_t *dev)
+{
+    struct fd_dev *fd = dev->priv;
+
+    free(fd->map);
+}
+
+static const struct omfs_dev_ops ram_ops = {
+    "ram", map_read, map_write, ram_flush, map_discard, map_size,
+    ram_close
+};
+
+/* latency wrapper */
+
+static ssize_t latency_read(omfs_dev_t *dev, u64 offset, void *buf,
+    size_t len)
+{
+    struct latency_dev *lat = dev->priv;
+
+    nanosleep(&lat->read_delay, NULL);
+    return lat->lower->ops->read_blocks(lat->lower, offset, buf, len);
+}
+
+static ssize_t latency_write(omfs_dev_t *dev, u64 offset, const void *buf,
+    size_t len)
+{
+    struct latency_dev *lat = dev->priv;
+
+    nanosleep(&lat->write_delay, NULL);
+    return lat->lower->ops->write_blocks(lat->lower, offset, buf, len);
+}
+
+static int latency_flush(omfs_dev_t *dev)
+{
+    struct latency_dev *lat = dev->priv;
+
+    nanosleep(&lat->write_delay, NULL);
+    return lat->lower->ops->flush(lat->lower);
+}
+
+static int latency_discard(omfs_dev_t *dev, u64 offset, u64 len)
+{
+    struct latency_dev *lat = dev->priv;
+
+    return lat->lower->ops->discard(lat->lower, offset, len);
+}
+
+static u64 latency_size(omfs_dev_t *dev)
+{
+    struct latency_dev *lat = dev->priv;
+
+    return lat->lower->ops->size(lat->lower);
+}
+
+static void latency_close(omfs_dev_t *dev)
+{
+    struct latency_dev *lat = dev->priv;
+
+    omfs_dev_close(lat->lower);
+}
+
+static const struct omfs_dev_ops latency_ops = {
+    "latency", latency_read, latency_write, latency_flush,
+    latency_discard, latency_size, latency_close
+};
+
+/*
+ *  Add read_us microseconds to every read and write_us to every write
+ *  and flush of lower, which is closed along with the wrapper.
+ */
+omfs_dev_t *omfs_dev_latency(omfs_dev_t *lower, u32 read_us, u32 write_us)
+{
+    omfs_dev_t *dev = dev_alloc(&latency_ops, sizeof(struct latency_dev));
+    struct latency_dev *lat;
+
+    if (!dev)
+        return NULL;
+    lat = dev->priv;
+    lat->lower = lower;
+    lat->read_delay.tv_sec = read_us / 1000000;
+    lat->read_delay.tv_nsec = (read_us % 1000000) * 1000;
+    lat->write_delay.tv_sec = write_us / 1000000;
+    lat->write_delay.tv_nsec = (write_us % 1000000) * 1000;
+    return dev;
+}
+
+/*
+ *  A zero filled device of the given size that only exists in memory.
+ */
+omfs_dev_t *omfs_dev_ram(u64 size)
+{
+    omfs_dev_t *dev = dev_alloc(&ram_ops, sizeof(struct fd_dev));
+    struct fd_dev *fd;
+
+    if (!dev)
+        return NULL;
+    fd = dev->priv;
+    fd->fd = -1;
+    fd->size = size;
+    if (!(fd->map = calloc(1, size ? size : 1)))
+    {
+        free(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+/*
+ *  Use an already open stdio stream; it's left open on close.
+ */
+omfs_dev_t *omfs_dev_from_file(FILE *fp)
+{
+    omfs_dev_t *dev = dev_alloc(&stdio_ops, sizeof(struct stdio_dev));
+
+    if (dev)
+        ((struct stdio_dev *) dev->priv)->fp = fp;
+    return dev;
+}
+
+static omfs_dev_t *open_backend(char *path, int writable, char *name)
+{
+    omfs_dev_t *dev;
+    struct fd_dev *fd;
+    int flags = writable ? O_RDWR : O_RDONLY;
+    int err;
+
+    if (!strcmp(name, "stdio"))
+    {
+        FILE *fp = fopen(path, writable ? "r+" : "r");
+        if (!fp)
+            return NULL;
+        if (!(dev = omfs_dev_from_file(fp)))
+        {
+            fclose(fp);
+            errno = ENOMEM;
+            return NULL;
+        }
+        ((struct stdio_dev *) dev->priv)->owned = 1;
+        return dev;
+    }
+
+    if (!strcmp(name, "pread"))
+        dev = dev_alloc(&pread_ops, sizeof(*fd));
+    else if (!strcmp(name, "mmap"))
+        dev = dev_alloc(&mmap_ops, sizeof(*fd));
+    else if (!strcmp(name, "ram"))
+    {
+        /* nothing would ever write the buffer back */
+        if (writable)
+        {
+            errno = EROFS;
+            return NULL;
+        }
+        dev = dev_alloc(&ram_ops, sizeof(*fd));
+    }
+    else
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!dev)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    fd = dev->priv;
+    if ((fd->fd = open(path, flags)) < 0)
+        goto err;
+    if (dev->ops == &pread_ops)
+        return dev;
+
+    fd->size = fd_size(fd->fd);
+    if (dev->ops == &mmap_ops)
+    {
+        fd->map = mmap(NULL, fd->size ? fd->size : 1, PROT_READ |
+            (writable ? PROT_WRITE : 0), MAP_SHARED, fd->fd, 0);
+        if (fd->map == MAP_FAILED)
+            goto err;
+        return dev;
+    }
+
+    // ram: read it all in, then let go of the file
+    if (!(fd->map = malloc(fd->size ? fd->size : 1)))
+    {
+        errno = ENOMEM;
+        goto err;
+    }
+    if (pread_read(dev, 0, fd->map, fd->size) != fd->size)
+    {
+        free(fd->map);
+        errno = EIO;
+        goto err;
+    }
+    close(fd->fd);
+    fd->fd = -1;
+    return dev;
+
+err:
+    err = errno;
+    if (fd->fd >= 0)
+        close(fd->fd);
+    free(dev);
+    errno = err;
+    return NULL;
+}
+
+/*
+ *  Open a device with the named backend, or $OMFS_BACKEND, or stdio.
+ *  The name may be followed by ",latency=R" or ",latency=R/W" to add
+ *  R microseconds to reads and W (default R) to writes.  Returns NULL
+ *  with errno set on failure.
+ */
+omfs_dev_t *omfs_dev_open(char *path, int writable, char *backend)
+{
+    omfs_dev_t *dev, *lat;
+    char name[32], *opt;
+    unsigned int read_us = 0, write_us = 0;
+
+    if (!backend)
+        backend = getenv("OMFS_BACKEND");
+    if (!backend || !*backend)
+        backend = DEFAULT_BACKEND;
+
+    snprintf(name, sizeof(name), "%s", backend);
+    if ((opt = strchr(name, ',')))
+    {
+        *opt++ = 0;
+        switch (sscanf(opt, "latency=%u/%u", &read_us, &write_us))
+        {
+        case 1:
+            write_us = read_us;
+            break;
+        case 2:
+            break;
+        default:
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    if (!(dev = open_backend(path, writable, name)))
+        return NULL;
+    if (!opt)
+        return dev;
+
+    if (!(lat = omfs_dev_latency(dev, read_us, write_us)))
+    {
+        omfs_dev_close(dev);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return lat;
+}
+
+void omfs_dev_close(omfs_dev_t *dev)
+{
+    if (!dev)
+        return;
+    dev->ops->close(dev);
+    free(dev);
+}
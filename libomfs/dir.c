@@ -0,0 +1,255 @@
+/*
+ *  Name lookup: one directory entry by name, or a whole path from the
+ *  root.  Names compare case-sensitively, as the kernel does, though
+ *  the bucket hash folds case.
+ *
+ *  An optional dentry cache maps (dir block, name) to the entry's
+ *  block.  It's direct mapped and only holds entries that were found;
+ *  any inode or block write through libomfs bumps its generation,
+ *  which drops everything in it at once.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "omfs.h"
+
+struct omfs_dentry {
+    u64 dir;
+    u64 block;
+    u32 gen;
+    char *name;
+};
+
+struct omfs_dcache {
+    struct omfs_dentry *slots;
+    u32 mask;
+    u32 gen;
+    u64 hits;
+    u64 misses;
+};
+
+static u32 dentry_slot(struct omfs_dcache *dc, u64 dir, const char *name)
+{
+    u64 h = dir * 0x9e3779b97f4a7c15ULL;
+
+    for (; *name; name++)
+        h = (h ^ (u8) *name) * 0x100000001b3ULL;
+    return (h ^ (h >> 32)) & dc->mask;
+}
+
+static int dcache_get(omfs_info_t *info, u64 dir, const char *name,
+    u64 *block)
+{
+    struct omfs_dcache *dc = info->dcache;
+    struct omfs_dentry *de = &dc->slots[dentry_slot(dc, dir, name)];
+
+    if (de->name && de->gen == dc->gen && de->dir == dir &&
+        !strcmp(de->name, name))
+    {
+        dc->hits++;
+        *block = de->block;
+        return 1;
+    }
+    dc->misses++;
+    return 0;
+}
+
+static void dcache_put(omfs_info_t *info, u64 dir, const char *name,
+    u64 block)
+{
+    struct omfs_dcache *dc = info->dcache;
+    struct omfs_dentry *de = &dc->slots[dentry_slot(dc, dir, name)];
+    char *copy = strdup(name);
+
+    if (!copy)
+        return;
+    free(de->name);
+    de->name = copy;
+    de->dir = dir;
+    de->block = block;
+    de->gen = dc->gen;
+}
+
+/*
+ *  Set up a dentry cache of about entries slots, rounded up to a
+ *  power of two.
+ */
+int omfs_dcache_init(omfs_info_t *info, u32 entries)
+{
+    struct omfs_dcache *dc;
+    u32 size = 1;
+
+    while (size < entries && size < (1U << 30))
+        size <<= 1;
+
+    dc = calloc(1, sizeof(*dc));
+    if (!dc)
+        return -ENOMEM;
+    dc->slots = calloc(size, sizeof(*dc->slots));
+    if (!dc->slots)
+    {
+        free(dc);
+        return -ENOMEM;
+    }
+    dc->mask = size - 1;
+    omfs_dcache_free(info);
+    info->dcache = dc;
+    return 0;
+}
+
+void omfs_dcache_free(omfs_info_t *info)
+{
+    struct omfs_dcache *dc = info->dcache;
+    u32 i;
+
+    if (!dc)
+        return;
+    for (i = 0; i <= dc->mask; i++)
+        free(dc->slots[i].name);
+    free(dc->slots);
+    free(dc);
+    info->dcache = NULL;
+}
+
+void omfs_dcache_invalidate(omfs_info_t *info)
+{
+    if (info->dcache)
+        info->dcache->gen++;
+}
+
+void omfs_dcache_stats(omfs_info_t *info, u64 *hits, u64 *misses)
+{
+    *hits = info->dcache ? info->dcache->hits : 0;
+    *misses = info->dcache ? info->dcache->misses : 0;
+}
+
+static int valid_inode(omfs_inode_t *inode, u64 block)
+{
+    return inode->i_head.h_magic == OMFS_IMAGIC &&
+        swap_be64(inode->i_head.h_self) == block;
+}
+
+/*
+ *  Find name in directory dir and return its block.  Returns 0, or
+ *  -ENOENT, -ENOTDIR, -ENAMETOOLONG, -EIO, or -EUCLEAN if the sibling
+ *  chain goes round.
+ */
+int omfs_lookup(omfs_info_t *info, u64 dir, const char *name, u64 *block)
+{
+    omfs_inode_t *inode;
+    struct omfs_cycle cycle;
+    u64 next;
+    int ret = -ENOENT;
+
+    if (strlen(name) >= OMFS_NAMELEN)
+        return -ENAMETOOLONG;
+    if (info->dcache && dcache_get(info, dir, name, block))
+        return 0;
+
+    inode = omfs_get_inode(info, dir);
+    if (!inode)
+        return -EIO;
+    if (!valid_inode(inode, dir))
+    {
+        omfs_release_inode(inode);
+        return -EIO;
+    }
+    if (inode->i_type != OMFS_DIR)
+    {
+        omfs_release_inode(inode);
+        return -ENOTDIR;
+    }
+
+    next = swap_be64(*((u64 *) ((u8 *) inode + OMFS_DIR_START) +
+        omfs_compute_hash(info, name)));
+    omfs_release_inode(inode);
+
+    omfs_cycle_init(&cycle);
+    while (next != ~0ULL)
+    {
+        if (omfs_cycle_step(&cycle, next))
+            return -EUCLEAN;
+        inode = omfs_get_inode(info, next);
+        if (!inode)
+            return -EIO;
+        if (!valid_inode(inode, next))
+        {
+            omfs_release_inode(inode);
+            return -EIO;
+        }
+        if (!strncmp(inode->i_name, name, OMFS_NAMELEN))
+        {
+            omfs_release_inode(inode);
+            *block = next;
+            ret = 0;
+            break;
+        }
+        next = swap_be64(inode->i_sibling);
+        omfs_release_inode(inode);
+    }
+
+    if (!ret && info->dcache)
+        dcache_put(info, dir, name, *block);
+    return ret;
+}
+
+static u64 parent_of(omfs_info_t *info, u64 dir)
+{
+    omfs_inode_t *inode = omfs_get_inode(info, dir);
+    u64 parent = ~0ULL;
+
+    if (inode)
+    {
+        parent = swap_be64(inode->i_parent);
+        omfs_release_inode(inode);
+    }
+    return parent;
+}
+
+/*
+ *  Resolve an absolute path like /a/b/c to a block.  Repeated and
+ *  trailing slashes are ignored, "." stays put and ".." goes up, no
+ *  further than the root.  Returns 0 or a negative errno as for
+ *  omfs_lookup.
+ */
+int omfs_namei(omfs_info_t *info, const char *path, u64 *block)
+{
+    u64 root = swap_be64(info->root->r_root_dir);
+    u64 cur = root, parent;
+    char name[OMFS_NAMELEN];
+    const char *p = path, *end;
+    size_t len;
+    int ret;
+
+    while (*p)
+    {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+        end = strchr(p, '/');
+        len = end ? end - p : strlen(p);
+        if (len >= OMFS_NAMELEN)
+            return -ENAMETOOLONG;
+        memcpy(name, p, len);
+        name[len] = 0;
+        p += len;
+
+        if (!strcmp(name, "."))
+            continue;
+        if (!strcmp(name, ".."))
+        {
+            if (cur != root)
+            {
+                parent = parent_of(info, cur);
+                cur = (parent == ~0ULL) ? root : parent;
+            }
+            continue;
+        }
+        ret = omfs_lookup(info, cur, name, &cur);
+        if (ret)
+            return ret;
+    }
+    *block = cur;
+    return 0;
+}
@@ -12,6 +12,7 @@
 #include <time.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "omfs.h"
 #include "bits.h"
 #include "crc.h"
@@ -27,7 +28,26 @@ static void _omfs_make_empty_table(u8 *buf, int offset)
 }
 
 
-static void _omfs_swap_buffer(void *buf, int count)
+/*
+ *  Move bytes through the backend.  Like fread and fwrite, these
+ *  return the count moved; an error moves nothing.
+ */
+static int _omfs_dev_read(omfs_info_t *info, u64 offset, void *buf, 
+    size_t len)
+{
+    ssize_t n = info->dev->ops->read_blocks(info->dev, offset, buf, len);
+    return n < 0 ? 0 : n;
+}
+
+static int _omfs_dev_write(omfs_info_t *info, u64 offset, void *buf, 
+    size_t len)
+{
+    ssize_t n = info->dev->ops->write_blocks(info->dev, offset, buf, len);
+    return n < 0 ? 0 : n;
+}
+
+/* byte swap count bytes of 32-bit words in place */
+void omfs_swap_buffer(void *buf, int count)
 {
     int i;
     u32 *ibuf = (u32 *) buf;
@@ -43,18 +63,25 @@ static void _omfs_swap_buffer(void *buf, int count)
  */
 int omfs_write_super(omfs_info_t *info)
 {
+    struct timespec start;
     int count;
 
     if (info->swap)
-        _omfs_swap_buffer(info->super, sizeof(struct omfs_super_block));
+        omfs_swap_buffer(info->super, sizeof(struct omfs_super_block));
 
     pthread_mutex_lock(&info->dev_mutex);
-    fseeko(info->dev, 0LL, SEEK_SET);
-    count = fwrite(info->super, 1, sizeof(struct omfs_super_block), info->dev);
+    count = 0;
+    if (omfs_undo_save(info, 0) || omfs_undo_sync(info))
+        goto out;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = _omfs_dev_write(info, 0, info->super, 
+        sizeof(struct omfs_super_block));
+    omfs_stats_io(info, 1, OMFS_CLASS_SUPER, 0, count, &start);
+out:
     pthread_mutex_unlock(&info->dev_mutex);
 
     if (info->swap)
-        _omfs_swap_buffer(info->super, sizeof(struct omfs_super_block));
+        omfs_swap_buffer(info->super, sizeof(struct omfs_super_block));
 
     if (count < sizeof(struct omfs_super_block))
         return -1;
@@ -67,11 +94,14 @@ int omfs_write_super(omfs_info_t *info)
  */
 int omfs_read_super(omfs_info_t *info)
 {
+    struct timespec start;
     int count, err = 0;
 
     pthread_mutex_lock(&info->dev_mutex);
-    fseeko(info->dev, 0LL, SEEK_SET);
-    count = fread(info->super, 1, sizeof(struct omfs_super_block), info->dev);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = _omfs_dev_read(info, 0, info->super, 
+        sizeof(struct omfs_super_block));
+    omfs_stats_io(info, 0, OMFS_CLASS_SUPER, 0, count, &start);
     pthread_mutex_unlock(&info->dev_mutex);
 
     if (count < sizeof(struct omfs_super_block)) 
@@ -83,7 +113,7 @@ int omfs_read_super(omfs_info_t *info)
     info->swap = 0;
     if (info->super->s_magic == OMFS_MAGIC)       // unswapped
     {
-        _omfs_swap_buffer(info->super, count);
+        omfs_swap_buffer(info->super, count);
         info->swap = 1;
     }
     else if (swap_be32(info->super->s_magic) != OMFS_MAGIC)
@@ -96,18 +126,36 @@ out:
 static int _omfs_write_block(omfs_info_t *info, 
         u64 block, u8* buf, size_t len, int mirrors)
 {
-    int i, count, ret = 0;
-    FILE *dev = info->dev;
+    int i, count, class, ret = 0;
     struct omfs_super_block *sb = info->super;
+    struct timespec start;
+    u64 offset;
 
     if (info->swap)
-        _omfs_swap_buffer(buf, len);
+        omfs_swap_buffer(buf, len);
+
+    class = omfs_block_class(info, block, buf);
 
     pthread_mutex_lock(&info->dev_mutex);
     for (i=0; i<mirrors; i++)
     {
-        fseeko(dev, (block + i) * swap_be32(sb->s_blocksize), SEEK_SET);
-        count = fwrite(buf, 1, len, dev);
+        if (omfs_undo_save(info, block + i))
+        {
+            ret = -1;
+            goto out;
+        }
+    }
+    if (omfs_undo_sync(info))
+    {
+        ret = -1;
+        goto out;
+    }
+    for (i=0; i<mirrors; i++)
+    {
+        offset = (block + i) * swap_be32(sb->s_blocksize);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        count = _omfs_dev_write(info, offset, buf, len);
+        omfs_stats_io(info, 1, class, offset, count, &start);
         if (count != len)
         {
             ret = -1;
@@ -116,7 +164,7 @@ static int _omfs_write_block(omfs_info_t *info,
     }
 out:
     if (info->swap)
-        _omfs_swap_buffer(buf, len);
+        omfs_swap_buffer(buf, len);
     pthread_mutex_unlock(&info->dev_mutex);
     return ret;
 }
@@ -129,19 +177,22 @@ out:
 static int _omfs_read_block(omfs_info_t *info, u64 block, u8 *buf)
 {
     int count, ret = 0;
-    FILE *dev = info->dev;
     struct omfs_super_block *sb = info->super;
+    struct timespec start;
     int blocksize;
 
     blocksize = swap_be32(sb->s_blocksize);
 
     pthread_mutex_lock(&info->dev_mutex);
-    fseeko(dev, block * blocksize, SEEK_SET);
-    count = fread(buf, 1, blocksize, dev);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = _omfs_dev_read(info, block * blocksize, buf, blocksize);
+    omfs_stats_io(info, 0, omfs_block_class(info, block, 
+        count >= sizeof(omfs_header_t) ? buf : NULL), block * blocksize, 
+        count, &start);
     pthread_mutex_unlock(&info->dev_mutex);
 
     if (info->swap)
-        _omfs_swap_buffer(buf, count);
+        omfs_swap_buffer(buf, count);
 
     if (count < blocksize)
         ret = -1;
@@ -165,9 +216,263 @@ static void _update_header_checksums(u8 *buf, int block_size)
 }
 
 
+/*
+ *  Transactions.  While one is open, inode and block writes are staged
+ *  in memory instead of going to the device, and reads see the staged
+ *  copies.  Editing the same block several times costs one write; at
+ *  commit each block gets its checksums computed once and everything,
+ *  mirrors and bitmap included, goes out in ascending block order.
+ */
+struct omfs_trans_block {
+    u64 block;
+    int len;                    /* bytes to write of each copy */
+    int mirrors;
+    int is_inode;               /* needs ctime and checksums */
+    u8 *buf;                    /* a full block */
+    struct omfs_trans_block *hnext;
+};
+
+struct omfs_trans {
+    struct omfs_trans_block **hash;
+    int hash_size;              /* power of two */
+    int count;
+};
+
+static int _omfs_trans_hash(struct omfs_trans *trans, u64 block)
+{
+    return (block ^ (block >> 17)) & (trans->hash_size - 1);
+}
+
+static struct omfs_trans_block *_omfs_trans_find(struct omfs_trans *trans,
+        u64 block)
+{
+    struct omfs_trans_block *tb;
+
+    for (tb = trans->hash[_omfs_trans_hash(trans, block)]; tb; tb = tb->hnext)
+        if (tb->block == block)
+            return tb;
+    return NULL;
+}
+
+static int _omfs_trans_grow(struct omfs_trans *trans)
+{
+    struct omfs_trans_block **old = trans->hash;
+    struct omfs_trans_block *tb, *next;
+    int i, old_size = trans->hash_size;
+
+    trans->hash = calloc(old_size * 2, sizeof(*trans->hash));
+    if (!trans->hash) {
+        trans->hash = old;
+        return -ENOMEM;
+    }
+    trans->hash_size = old_size * 2;
+
+    for (i=0; i < old_size; i++)
+    {
+        for (tb = old[i]; tb; tb = next)
+        {
+            int h = _omfs_trans_hash(trans, tb->block);
+            next = tb->hnext;
+            tb->hnext = trans->hash[h];
+            trans->hash[h] = tb;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static int _omfs_trans_stage(omfs_info_t *info, u64 block, u8 *buf, 
+        int len, int mirrors, int is_inode)
+{
+    struct omfs_trans *trans = info->trans;
+    struct omfs_trans_block *tb;
+    int blocksize = swap_be32(info->super->s_blocksize);
+    int h;
+
+    tb = _omfs_trans_find(trans, block);
+    if (!tb)
+    {
+        if (trans->count >= trans->hash_size && _omfs_trans_grow(trans))
+            return -ENOMEM;
+
+        tb = calloc(1, sizeof(*tb));
+        if (!tb)
+            return -ENOMEM;
+        if (!(tb->buf = calloc(1, blocksize))) {
+            free(tb);
+            return -ENOMEM;
+        }
+        tb->block = block;
+        h = _omfs_trans_hash(trans, block);
+        tb->hnext = trans->hash[h];
+        trans->hash[h] = tb;
+        trans->count++;
+    }
+    memcpy(tb->buf, buf, len);
+    tb->len = len;
+    tb->mirrors = mirrors;
+    tb->is_inode = is_inode;
+    return 0;
+}
+
+static int _omfs_trans_cmp(const void *a, const void *b)
+{
+    u64 x = (*(struct omfs_trans_block **) a)->block;
+    u64 y = (*(struct omfs_trans_block **) b)->block;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Stage the dirty bitmap blocks so they are written in order with
+ *  the rest.
+ */
+static int _omfs_trans_stage_bitmap(omfs_info_t *info)
+{
+    u64 bitmap_blk = swap_be64(info->root->r_bitmap);
+    int blocksize = swap_be32(info->super->s_blocksize);
+    size_t size, bsize;
+    int i, ret;
+
+    if (!info->bitmap || bitmap_blk == ~0)
+        return 0;
+
+    size = (swap_be64(info->super->s_num_blocks) + 7) / 8;
+    bsize = (size + blocksize - 1) / blocksize;
+
+    for (i=0; i < bsize; i++)
+    {
+        if (!test_bit(info->bitmap->dirty, i))
+            continue;
+
+        ret = _omfs_trans_stage(info, bitmap_blk + i, 
+            info->bitmap->bmap + i * blocksize, blocksize, 1, 0);
+        if (ret)
+            return ret;
+        clear_bit(info->bitmap->dirty, i);
+    }
+    return 0;
+}
+
+static void _omfs_trans_free(struct omfs_trans *trans)
+{
+    struct omfs_trans_block *tb, *next;
+    int i;
+
+    for (i=0; i < trans->hash_size; i++)
+    {
+        for (tb = trans->hash[i]; tb; tb = next)
+        {
+            next = tb->hnext;
+            free(tb->buf);
+            free(tb);
+        }
+    }
+    free(trans->hash);
+    free(trans);
+}
+
+int omfs_trans_begin(omfs_info_t *info)
+{
+    struct omfs_trans *trans;
+
+    if (info->trans)
+        return -EBUSY;
+
+    if (!(trans = calloc(1, sizeof(*trans))))
+        return -ENOMEM;
+
+    trans->hash_size = 256;
+    if (!(trans->hash = calloc(trans->hash_size, sizeof(*trans->hash)))) {
+        free(trans);
+        return -ENOMEM;
+    }
+    info->trans = trans;
+    return 0;
+}
+
+/*
+ *  Throw away everything staged; the bitmap in memory is left as is.
+ */
+void omfs_trans_abort(omfs_info_t *info)
+{
+    if (!info->trans)
+        return;
+
+    _omfs_trans_free(info->trans);
+    info->trans = NULL;
+}
+
+int omfs_trans_commit(omfs_info_t *info)
+{
+    struct omfs_trans *trans = info->trans;
+    struct omfs_trans_block **sorted, *tb;
+    struct timezone tz;
+    struct timeval tv;
+    struct timespec start;
+    u64 ctime;
+    int i, j, n = 0, ret;
+
+    if (!trans)
+        return -EINVAL;
+
+    if ((ret = _omfs_trans_stage_bitmap(info)))
+        goto out;
+
+    if (!(sorted = malloc((trans->count + 1) * sizeof(*sorted)))) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i=0; i < trans->hash_size; i++)
+        for (tb = trans->hash[i]; tb; tb = tb->hnext)
+            sorted[n++] = tb;
+
+    qsort(sorted, n, sizeof(*sorted), _omfs_trans_cmp);
+
+    // save everything the commit overwrites, with one sync, up front
+    pthread_mutex_lock(&info->dev_mutex);
+    for (i=0; i < n && !ret; i++)
+        for (j=0; j < sorted[i]->mirrors && !ret; j++)
+            ret = omfs_undo_save(info, sorted[i]->block + j);
+    if (!ret)
+        ret = omfs_undo_sync(info);
+    pthread_mutex_unlock(&info->dev_mutex);
+
+    gettimeofday(&tv, &tz);
+    ctime = tv.tv_sec * 1000LL + tv.tv_usec;
+
+    for (i=0; i < n && !ret; i++)
+    {
+        tb = sorted[i];
+        if (tb->is_inode)
+        {
+            ((omfs_inode_t *) tb->buf)->i_ctime = swap_be64(ctime);
+            _update_header_checksums(tb->buf, tb->len);
+        }
+        ret = _omfs_write_block(info, tb->block, tb->buf, tb->len, 
+            tb->mirrors);
+    }
+    free(sorted);
+
+    pthread_mutex_lock(&info->dev_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (info->dev->ops->flush(info->dev))
+        ret = -EIO;
+    omfs_stats_flush(info, &start);
+    pthread_mutex_unlock(&info->dev_mutex);
+
+out:
+    _omfs_trans_free(trans);
+    info->trans = NULL;
+    return ret;
+}
+
 int omfs_write_root_block(omfs_info_t *info)
 {
     u64 block = swap_be64(info->root->r_head.h_self);
+
+    _update_header_checksums((u8 *) info->root, 
+        sizeof(struct omfs_root_block));
     return _omfs_write_block(info, block, (u8*) info->root, 
             sizeof(struct omfs_root_block), 
             swap_be32(info->super->s_mirrors));
@@ -177,9 +482,18 @@ int omfs_write_root_block(omfs_info_t *info)
 static u8 *_omfs_get_block(omfs_info_t *info, u64 block)
 {
     u8 *buf;
-    if (!(buf = malloc(swap_be32(info->super->s_blocksize))))
+    struct omfs_trans_block *tb;
+    int blocksize = swap_be32(info->super->s_blocksize);
+
+    if (!(buf = malloc(blocksize)))
         return 0;
 
+    if (info->trans && (tb = _omfs_trans_find(info->trans, block)))
+    {
+        memcpy(buf, tb->buf, blocksize);
+        return buf;
+    }
+
     if (_omfs_read_block(info, block, buf))
     {
         free(buf);
@@ -217,6 +531,11 @@ int omfs_write_inode(omfs_info_t *info, omfs_inode_t *inode)
     u64 ctime;
     int size = swap_be32(inode->i_head.h_body_size) + sizeof(omfs_header_t);
 
+    omfs_dcache_invalidate(info);
+    if (info->trans)
+        return _omfs_trans_stage(info, swap_be64(inode->i_head.h_self), 
+            (u8 *) inode, size, swap_be32(info->super->s_mirrors), 1);
+
     gettimeofday(&tv, &tz);
 
     ctime = tv.tv_sec * 1000LL + tv.tv_usec;
@@ -234,12 +553,11 @@ omfs_inode_t *omfs_new_inode(omfs_info_t *info, u64 block,
     u8 *buf;
     omfs_inode_t *inode;
 
-    inode = omfs_get_inode(info, block);
+    /* the old contents are all overwritten, so don't read them */
+    inode = calloc(1, swap_be32(info->super->s_blocksize));
     if (!inode)
         return NULL;
 
-    memset(inode, 0, swap_be32(info->super->s_blocksize));
-
     inode->i_head.h_self = swap_be64(block); 
     inode->i_head.h_version = 1;
     inode->i_head.h_magic = OMFS_IMAGIC;
@@ -289,28 +607,39 @@ void omfs_release_inode(omfs_inode_t *oi)
     free(oi);
 }
 
+/*
+ *  Write out the dirty parts of the bitmap.  Inside a transaction
+ *  this waits for the commit.
+ */
 int omfs_flush_bitmap(omfs_info_t *info)
 {
     size_t size, bsize, count, ret = 0;
     u64 bitmap_blk = swap_be64(info->root->r_bitmap);
     int blocksize = swap_be32(info->super->s_blocksize);
     u8 *bmap = info->bitmap->bmap;
+    struct timespec start;
     int i;
 
-    if (bitmap_blk == ~0)
+    if (bitmap_blk == ~0 || info->trans)
         return 0;
 
     size = (swap_be64(info->super->s_num_blocks) + 7) / 8;
     bsize = (size + blocksize - 1) / blocksize;
 
     pthread_mutex_lock(&info->dev_mutex);
-    for (i=0; i < bsize * 8; i++, bitmap_blk++, bmap += blocksize)
+    for (i=0; i < bsize; i++, bitmap_blk++, bmap += blocksize)
     {
         if (test_bit(info->bitmap->dirty, i)) 
         {
-            fseeko(info->dev, bitmap_blk * blocksize, SEEK_SET);
-            count = fwrite(bmap, 1, blocksize, info->dev);
-            if (size != count) {
+            if ((ret = omfs_undo_save(info, bitmap_blk)) ||
+                (ret = omfs_undo_sync(info)))
+                goto out;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            count = _omfs_dev_write(info, bitmap_blk * blocksize, bmap, 
+                blocksize);
+            omfs_stats_io(info, 1, OMFS_CLASS_BITMAP, 
+                bitmap_blk * blocksize, count, &start);
+            if (count != blocksize) {
                 ret = -EIO;
                 goto out;
             }
@@ -325,37 +654,32 @@ out:
 
 int omfs_write_block(omfs_info_t *info, u64 block, u8* buf)
 {
+    omfs_dcache_invalidate(info);
+    if (info->trans)
+        return _omfs_trans_stage(info, block, buf, 
+            swap_be32(info->super->s_blocksize), 1, 0);
+
     return _omfs_write_block(info, block, buf, 
         swap_be32(info->super->s_blocksize), 1);
 }
 
 static void set_inuse_file(omfs_info_t *info, omfs_inode_t *file, u8 *bmap)
 {
-    struct omfs_extent *oe;
+    struct omfs_extent_iter it;
     struct omfs_extent_entry *entry;
-    u64 next;
     int extent_count, i;
-    omfs_inode_t *inode;
 
     if (!file)
         return;
 
-    next = swap_be64(file->i_head.h_self);
-    inode = file;
-    oe = (struct omfs_extent *) (((u8*) inode) + OMFS_EXTENT_START);
-
-    for(;;) 
+    omfs_extent_begin(info, swap_be64(file->i_head.h_self), file, &it);
+    while (omfs_extent_next(&it) > 0)
     {
-        extent_count = swap_be32(oe->e_extent_count);
-
         for (i=0; i<swap_be32(info->super->s_mirrors); i++)
-            set_bit(bmap, next + i);
-
-        next = swap_be64(oe->e_next);
-        entry = &oe->e_entry;
+            set_bit(bmap, it.block + i);
 
-        // ignore last entry as it is the terminator
-        for (; extent_count > 1; extent_count--)
+        entry = &it.table->e_entry;
+        for (extent_count = it.count; extent_count; extent_count--)
         {
             u64 start = swap_be64(entry->e_cluster);
 
@@ -364,24 +688,8 @@ static void set_inuse_file(omfs_info_t *info, omfs_inode_t *file, u8 *bmap)
 
             entry++;
         }
-
-        if (next == ~0)
-            break;
-
-        if (inode != file)
-            omfs_release_inode(inode);
-
-        inode = omfs_get_inode(info, next);
-        if (!inode)
-            goto err;
-
-        oe = (struct omfs_extent *) (((u8*) inode) + OMFS_EXTENT_CONT);
     }
-
-    if (inode != file)
-        omfs_release_inode(inode);
-err:
-    return;
+    omfs_extent_end(&it);
 }
 
 static void set_inuse_dir(omfs_info_t *info, omfs_inode_t *dir, u8 *bmap)
@@ -445,6 +753,8 @@ int omfs_load_bitmap(omfs_info_t *info)
     int blocksize = swap_be32(info->super->s_blocksize);
     int size_blks;
     struct omfs_bitmap *bitmap;
+    struct timespec start;
+    size_t count;
     int ret = 0;
 
     size = (swap_be64(info->super->s_num_blocks) + 7) / 8;
@@ -484,8 +794,10 @@ int omfs_load_bitmap(omfs_info_t *info)
     else
     {
         pthread_mutex_lock(&info->dev_mutex);
-        fseeko(info->dev, bitmap_blk * blocksize, SEEK_SET);
-        fread(buf, 1, size, info->dev);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        count = _omfs_dev_read(info, bitmap_blk * blocksize, buf, size);
+        omfs_stats_io(info, 0, OMFS_CLASS_BITMAP, bitmap_blk * blocksize,
+            count, &start);
         pthread_mutex_unlock(&info->dev_mutex);
     }
     goto out1;
@@ -498,20 +810,90 @@ out1:
     return ret;
 }
 
-int omfs_compute_hash(omfs_info_t *info, char *filename)
+/*
+ *  Lowercase for the name hash, as the kernel does it: ASCII and the
+ *  Latin-1 capitals, built at compile time.
+ */
+#define _L(c) ((((c) >= 'A' && (c) <= 'Z') || \
+    ((c) >= 0xc0 && (c) <= 0xde && (c) != 0xd7)) ? (c) + 32 : (c))
+#define _L4(c) _L(c), _L((c)+1), _L((c)+2), _L((c)+3)
+#define _L16(c) _L4(c), _L4((c)+4), _L4((c)+8), _L4((c)+12)
+#define _L64(c) _L16(c), _L16((c)+16), _L16((c)+32), _L16((c)+48)
+
+static const u8 _omfs_lower[256] = {
+    _L64(0), _L64(64), _L64(128), _L64(192)
+};
+
+/*
+ *  One pass over the name, which stops at OMFS_NAMELEN in case a
+ *  damaged inode's name isn't terminated.
+ */
+int omfs_compute_hash(omfs_info_t *info, const char *filename)
 {
-    int hash = 0, i;
+    const u8 *p = (const u8 *) filename;
+    const u8 *end = p + OMFS_NAMELEN;
+    unsigned int hash = 0, shift = 0;
     int m = (swap_be32(info->super->s_sys_blocksize) - OMFS_DIR_START) / 8;
-    
-    for (i=0; i<strlen(filename); i++)
-        hash ^= tolower(filename[i]) << (i % 24);
-    
+
+    for (; p < end && *p; p++)
+    {
+        hash ^= _omfs_lower[*p] << shift;
+        if (++shift == 24)
+            shift = 0;
+    }
     return hash % m;
 }
 
 void omfs_sync(omfs_info_t *info)
 {
-    fflush(info->dev);
+    struct timespec start;
+
+    pthread_mutex_lock(&info->dev_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    info->dev->ops->flush(info->dev);
+    omfs_stats_flush(info, &start);
+    pthread_mutex_unlock(&info->dev_mutex);
+}
+
+/*
+ *  Move count data blocks starting at block in one device call.  Data
+ *  isn't byte swapped, mirrored or staged in a transaction; writes
+ *  save the old contents to the undo file first.
+ */
+int omfs_read_data(omfs_info_t *info, u64 block, u64 count, u8 *buf)
+{
+    int blocksize = swap_be32(info->super->s_blocksize);
+    size_t len = count * blocksize, n;
+    struct timespec start;
+
+    pthread_mutex_lock(&info->dev_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = _omfs_dev_read(info, block * blocksize, buf, len);
+    omfs_stats_io(info, 0, OMFS_CLASS_DATA, block * blocksize, n, &start);
+    pthread_mutex_unlock(&info->dev_mutex);
+    return n == len ? 0 : -EIO;
+}
+
+int omfs_write_data(omfs_info_t *info, u64 block, u64 count, u8 *buf)
+{
+    int blocksize = swap_be32(info->super->s_blocksize);
+    size_t len = count * blocksize, n = 0;
+    struct timespec start;
+    u64 i;
+
+    pthread_mutex_lock(&info->dev_mutex);
+    for (i=0; i < count; i++)
+        if (omfs_undo_save(info, block + i))
+            goto out;
+    if (omfs_undo_sync(info))
+        goto out;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = _omfs_dev_write(info, block * blocksize, buf, len);
+    omfs_stats_io(info, 1, OMFS_CLASS_DATA, block * blocksize, n, &start);
+out:
+    pthread_mutex_unlock(&info->dev_mutex);
+    return n == len ? 0 : -EIO;
 }
 
 void omfs_clear_data(omfs_info_t *info, u64 block, int count)
@@ -530,3 +912,100 @@ void omfs_clear_data(omfs_info_t *info, u64 block, int count)
     }
 }
 
+/*
+ *  Brent's cycle detection, for following chains of block pointers
+ *  that may loop back on themselves.  Step through every block of the
+ *  chain in turn, the first too; omfs_cycle_step returns 1 when one
+ *  comes round again, within twice the chain's length or so, and
+ *  without remembering more than one block.
+ */
+void omfs_cycle_init(struct omfs_cycle *c)
+{
+    c->saved = ~0ULL;
+    c->power = 1;
+    c->steps = 0;
+}
+
+int omfs_cycle_step(struct omfs_cycle *c, u64 block)
+{
+    if (block == c->saved)
+        return 1;
+    if (++c->steps == c->power)
+    {
+        c->saved = block;
+        c->power <<= 1;
+        c->steps = 0;
+    }
+    return 0;
+}
+
+/*
+ *  Walk the extent tables of the file at block: the inode's own, then
+ *  each continuation block.  Set up with omfs_extent_begin, then
+ *
+ *      while ((ret = omfs_extent_next(&it)) > 0)
+ *          ... it.count entries from &it.table->e_entry ...
+ *      omfs_extent_end(&it);
+ *
+ *  omfs_extent_next returns 1 for each table, 0 after the last, or
+ *  -EUCLEAN if a table's count or next pointer is out of range or the
+ *  chain loops, and
+ *  -EIO if a continuation block can't be read.  The entries themselves
+ *  aren't checked.
+ */
+void omfs_extent_begin(omfs_info_t *info, u64 block, omfs_inode_t *inode,
+    struct omfs_extent_iter *it)
+{
+    it->info = info;
+    it->block = block;
+    it->table = NULL;
+    it->count = 0;
+    it->conts = 0;
+    it->buf = (u8 *) inode;
+    omfs_cycle_init(&it->cycle);
+    omfs_cycle_step(&it->cycle, block);
+}
+
+int omfs_extent_next(struct omfs_extent_iter *it)
+{
+    u64 num_blocks = swap_be64(it->info->super->s_num_blocks);
+    u32 sys_blocksize = swap_be32(it->info->super->s_sys_blocksize);
+    int offset = OMFS_EXTENT_START;
+    u64 next;
+    u32 count;
+
+    if (it->table)
+    {
+        next = swap_be64(it->table->e_next);
+        if (next == ~0ULL)
+            return 0;
+        if (next >= num_blocks || omfs_cycle_step(&it->cycle, next))
+            return -EUCLEAN;
+
+        if (it->conts)
+            free(it->buf);
+        it->table = NULL;
+        it->buf = omfs_get_block(it->info, next);
+        it->conts++;
+        if (!it->buf)
+            return -EIO;
+        it->block = next;
+        offset = OMFS_EXTENT_CONT;
+    }
+
+    it->table = (struct omfs_extent *) (it->buf + offset);
+    count = swap_be32(it->table->e_extent_count);
+    if (count < 1 || count > (sys_blocksize - offset) /
+        sizeof(struct omfs_extent_entry) - 1)
+        return -EUCLEAN;
+    it->count = count - 1;
+    return 1;
+}
+
+void omfs_extent_end(struct omfs_extent_iter *it)
+{
+    if (it->conts)
+        free(it->buf);
+    it->buf = NULL;
+}
+
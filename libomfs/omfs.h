@@ -2,17 +2,79 @@
 #define _OMFS_H
 
 #include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
 #include "config.h"
 #include "omfs_fs.h"
 #include "crc.h"
 
+struct omfs_trans;
+struct omfs_undo;
+struct omfs_trace;
+struct omfs_dcache;
+
+/* what a block holds, for the I/O stats */
+enum omfs_block_class {
+    OMFS_CLASS_SUPER,
+    OMFS_CLASS_ROOT,
+    OMFS_CLASS_INODE,
+    OMFS_CLASS_CONT,            /* extent continuation */
+    OMFS_CLASS_BITMAP,
+    OMFS_CLASS_DATA,
+    OMFS_NUM_CLASSES
+};
+
+/* latency histogram bucket i counts ops taking [2^i, 2^(i+1)) ns */
+#define OMFS_STAT_BUCKETS 32
+
+struct omfs_io_stats {
+    u64 ops;
+    u64 bytes;
+    u64 seeks;                  /* ops not starting where the last ended */
+    u64 ns;                     /* total latency */
+    u64 hist[OMFS_STAT_BUCKETS];
+};
+
+struct omfs_stats {
+    struct omfs_io_stats read[OMFS_NUM_CLASSES];
+    struct omfs_io_stats write[OMFS_NUM_CLASSES];
+    u64 flushes;
+    u64 flush_ns;
+};
+
+/* a block device backend, see dev.c */
+typedef struct omfs_dev omfs_dev_t;
+
+struct omfs_dev_ops {
+    char *name;
+    ssize_t (*read_blocks)(omfs_dev_t *dev, u64 offset, void *buf, 
+        size_t len);
+    ssize_t (*write_blocks)(omfs_dev_t *dev, u64 offset, const void *buf,
+        size_t len);
+    int (*flush)(omfs_dev_t *dev);
+    int (*discard)(omfs_dev_t *dev, u64 offset, u64 len);
+    u64 (*size)(omfs_dev_t *dev);
+    void (*close)(omfs_dev_t *dev);
+};
+
+struct omfs_dev {
+    const struct omfs_dev_ops *ops;
+    void *priv;
+};
+
 struct omfs_info {
-    FILE *dev;
+    omfs_dev_t *dev;
     struct omfs_super_block *super;
     struct omfs_root_block *root;
     struct omfs_bitmap *bitmap;
     int swap;
     pthread_mutex_t dev_mutex;
+    struct omfs_trans *trans;   /* open transaction, if any */
+    struct omfs_undo *undo;     /* undo file being recorded, if any */
+    struct omfs_stats stats;    /* kept under dev_mutex */
+    struct omfs_trace *trace;   /* block trace being recorded, if any */
+    u64 io_pos;                 /* device offset after the last I/O */
+    struct omfs_dcache *dcache; /* dentry cache, if any; see dir.c */
 };
 
 struct omfs_bitmap {
@@ -20,6 +82,37 @@ struct omfs_bitmap {
     u8 *bmap;
 };
 
+/* runs of free blocks, by length: 1, 2, 3-4, 5-8, ... the last open */
+#define OMFS_FREE_CLASSES 16
+
+struct omfs_free_stats {
+    u64 free;                   /* free blocks */
+    u64 runs;                   /* runs of them */
+    u64 largest;                /* the longest run */
+    u64 largest_start;
+    u64 cluster_free;           /* free blocks in whole clusters */
+    u64 runs_by_len[OMFS_FREE_CLASSES];
+    u64 blocks_by_len[OMFS_FREE_CLASSES];
+};
+
+/* catches a chain of blocks going round, see omfs_cycle_step */
+struct omfs_cycle {
+    u64 saved;
+    u64 power;
+    u64 steps;
+};
+
+/* walks a file's extent tables, see omfs_extent_next */
+struct omfs_extent_iter {
+    struct omfs_info *info;
+    u64 block;                  /* holding the current table */
+    struct omfs_extent *table;
+    int count;                  /* its extents, less the terminator */
+    u64 conts;                  /* continuation blocks so far */
+    u8 *buf;                    /* the one being looked at, if any */
+    struct omfs_cycle cycle;
+};
+
 typedef struct omfs_info omfs_info_t;
 typedef struct omfs_header omfs_header_t;
 typedef struct omfs_super_block omfs_super_t;
@@ -41,15 +134,73 @@ void omfs_release_inode(omfs_inode_t *inode);
 void omfs_sync(omfs_info_t *info);
 int omfs_load_bitmap(omfs_info_t *info);
 int omfs_flush_bitmap(omfs_info_t *info);
-int omfs_compute_hash(omfs_info_t *info, char *filename);
+int omfs_compute_hash(omfs_info_t *info, const char *filename);
 omfs_inode_t *omfs_new_inode(omfs_info_t *info, u64 block, char *name, 
     char type);
 void omfs_clear_data(omfs_info_t *info, u64 block, int count);
+void omfs_cycle_init(struct omfs_cycle *c);
+int omfs_cycle_step(struct omfs_cycle *c, u64 block);
+void omfs_extent_begin(omfs_info_t *info, u64 block, omfs_inode_t *inode,
+    struct omfs_extent_iter *it);
+int omfs_extent_next(struct omfs_extent_iter *it);
+void omfs_extent_end(struct omfs_extent_iter *it);
+int omfs_read_data(omfs_info_t *info, u64 block, u64 count, u8 *buf);
+int omfs_write_data(omfs_info_t *info, u64 block, u64 count, u8 *buf);
+int omfs_trans_begin(omfs_info_t *info);
+int omfs_trans_commit(omfs_info_t *info);
+void omfs_trans_abort(omfs_info_t *info);
+void omfs_swap_buffer(void *buf, int count);
 
 /* bitmap.c */
+int omfs_scan_bitmap(u8 *buf, int bsize, int bits);
 int omfs_allocate_one_block(omfs_info_t *info, u64 block);
 int omfs_allocate_block(omfs_info_t *info, int size, u64 *return_block);
 int omfs_clear_range(omfs_info_t *info, u64 start, int count);
+int omfs_allocate_near(omfs_info_t *info, u64 goal, int size, u64 max_dist,
+    u64 *return_block);
+int omfs_allocate_run(omfs_info_t *info, u64 goal, u64 count,
+    u64 *return_block);
 unsigned long omfs_count_free(omfs_info_t *info);
+int omfs_free_stats(omfs_info_t *info, u32 cluster,
+    struct omfs_free_stats *stats);
+int omfs_size_class(u64 n, int num_classes);
+void omfs_mark_bitmap_dirty(omfs_info_t *info);
+
+/* dir.c */
+int omfs_lookup(omfs_info_t *info, u64 dir, const char *name, u64 *block);
+int omfs_namei(omfs_info_t *info, const char *path, u64 *block);
+int omfs_dcache_init(omfs_info_t *info, u32 entries);
+void omfs_dcache_free(omfs_info_t *info);
+void omfs_dcache_invalidate(omfs_info_t *info);
+void omfs_dcache_stats(omfs_info_t *info, u64 *hits, u64 *misses);
+
+/* dev.c */
+omfs_dev_t *omfs_dev_open(char *path, int writable, char *backend);
+omfs_dev_t *omfs_dev_from_file(FILE *fp);
+omfs_dev_t *omfs_dev_ram(u64 size);
+omfs_dev_t *omfs_dev_latency(omfs_dev_t *lower, u32 read_us, u32 write_us);
+void omfs_dev_close(omfs_dev_t *dev);
+
+/* stats.c */
+void omfs_get_stats(omfs_info_t *info, struct omfs_stats *stats);
+u64 omfs_stats_bytes(struct omfs_stats *stats, int write);
+void omfs_print_stats(FILE *fp, struct omfs_stats *stats);
+int omfs_block_class(omfs_info_t *info, u64 block, u8 *buf);
+void omfs_stats_io(omfs_info_t *info, int write, int class, u64 offset,
+    size_t len, struct timespec *start);
+void omfs_stats_flush(omfs_info_t *info, struct timespec *start);
+
+/* trace.c */
+int omfs_trace_open(omfs_info_t *info, char *path);
+void omfs_trace_record(omfs_info_t *info, int op, int class, u64 offset,
+    size_t len, struct timespec *start);
+int omfs_trace_close(omfs_info_t *info);
+
+/* undo.c */
+int omfs_undo_open(omfs_info_t *info, char *path);
+int omfs_undo_save(omfs_info_t *info, u64 block);
+int omfs_undo_sync(omfs_info_t *info);
+int omfs_undo_close(omfs_info_t *info);
+int omfs_undo_replay(omfs_dev_t *dev, char *path, int list);
 
 #endif
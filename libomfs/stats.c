@@ -0,0 +1,168 @@
+/*
+ *  I/O statistics: operation and byte counts, seeks and latency
+ *  histograms for reads and writes of each class of block, and
+ *  flushes.  The same hooks feed the block trace, if one is open.
+ *
+ *  Every device access already holds dev_mutex, so the counters are
+ *  updated under it rather than kept per thread; the cost is two
+ *  clock reads per I/O.  Callers of omfs_stats_io and omfs_stats_flush
+ *  must hold dev_mutex.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "omfs.h"
+#include "trace.h"
+
+static char *class_names[] = {
+    "super", "root", "inode", "continuation", "bitmap", "data"
+};
+
+static u64 elapsed_ns(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + 
+        now.tv_nsec - start->tv_nsec;
+}
+
+static int bucket(u64 ns)
+{
+    int b;
+
+    if (!ns)
+        return 0;
+    b = 63 - __builtin_clzll(ns);
+    return b < OMFS_STAT_BUCKETS ? b : OMFS_STAT_BUCKETS - 1;
+}
+
+/*
+ *  Tell what a block is from where it is and, failing that, from its
+ *  header.  buf holds the block as it is on disk.
+ */
+int omfs_block_class(omfs_info_t *info, u64 block, u8 *buf)
+{
+    omfs_header_t *hdr = (omfs_header_t *) buf;
+    u64 root_blk, bitmap_blk;
+    int blocksize, mirrors;
+    u64 size;
+
+    if (block == 0)
+        return OMFS_CLASS_SUPER;
+
+    root_blk = swap_be64(info->super->s_root_block);
+    mirrors = swap_be32(info->super->s_mirrors);
+    if (block >= root_blk && block < root_blk + mirrors)
+        return OMFS_CLASS_ROOT;
+
+    if (info->root && (bitmap_blk = swap_be64(info->root->r_bitmap)) != ~0)
+    {
+        blocksize = swap_be32(info->super->s_blocksize);
+        size = (swap_be64(info->super->s_num_blocks) + 7) / 8;
+        if (block >= bitmap_blk && 
+            block < bitmap_blk + (size + blocksize - 1) / blocksize)
+            return OMFS_CLASS_BITMAP;
+    }
+
+    if (buf && hdr->h_magic == OMFS_IMAGIC && 
+        swap_be64(hdr->h_self) == block)
+    {
+        if (hdr->h_type == OMFS_INODE_CONTINUATION)
+            return OMFS_CLASS_CONT;
+        if (hdr->h_type == OMFS_INODE_NORMAL)
+            return OMFS_CLASS_INODE;
+    }
+    return OMFS_CLASS_DATA;
+}
+
+void omfs_stats_io(omfs_info_t *info, int write, int class, u64 offset,
+    size_t len, struct timespec *start)
+{
+    struct omfs_io_stats *st = write ? &info->stats.write[class] : 
+        &info->stats.read[class];
+    u64 ns = elapsed_ns(start);
+
+    st->ops++;
+    st->bytes += len;
+    st->ns += ns;
+    st->hist[bucket(ns)]++;
+    if (offset != info->io_pos)
+        st->seeks++;
+    info->io_pos = offset + len;
+
+    omfs_trace_record(info, write ? OMFS_TRACE_WRITE : OMFS_TRACE_READ,
+        class, offset, len, start);
+}
+
+void omfs_stats_flush(omfs_info_t *info, struct timespec *start)
+{
+    info->stats.flushes++;
+    info->stats.flush_ns += elapsed_ns(start);
+
+    omfs_trace_record(info, OMFS_TRACE_FLUSH, 0, 0, 0, start);
+}
+
+void omfs_get_stats(omfs_info_t *info, struct omfs_stats *stats)
+{
+    pthread_mutex_lock(&info->dev_mutex);
+    memcpy(stats, &info->stats, sizeof(*stats));
+    pthread_mutex_unlock(&info->dev_mutex);
+}
+
+/* bytes read, or written, over all classes */
+u64 omfs_stats_bytes(struct omfs_stats *stats, int write)
+{
+    struct omfs_io_stats *st = write ? stats->write : stats->read;
+    u64 bytes = 0;
+    int i;
+
+    for (i=0; i < OMFS_NUM_CLASSES; i++)
+        bytes += st[i].bytes;
+    return bytes;
+}
+
+/* upper bound of the bucket holding the given fraction of ops, in us */
+static double percentile(struct omfs_io_stats *st, double frac)
+{
+    u64 want = st->ops * frac, seen = 0;
+    int i;
+
+    for (i=0; i < OMFS_STAT_BUCKETS; i++)
+    {
+        seen += st->hist[i];
+        if (seen > want)
+            break;
+    }
+    return (double) (2ULL << i) / 1000;
+}
+
+static void print_line(FILE *fp, char *op, int class, 
+    struct omfs_io_stats *st)
+{
+    fprintf(fp, "%-6s %-13s %8" PRIu64 " %11" PRIu64 " %7" PRIu64 
+        " %9.1f %9.1f %9.1f\n", op, class_names[class], st->ops, 
+        st->bytes, st->seeks, (double) st->ns / st->ops / 1000, 
+        percentile(st, 0.5), percentile(st, 0.99));
+}
+
+/*
+ *  A table of the above, for -v in the tools.  Percentiles are
+ *  bucket bounds, so only good to a factor of two.
+ */
+void omfs_print_stats(FILE *fp, struct omfs_stats *stats)
+{
+    int i;
+
+    fprintf(fp, "%-6s %-13s %8s %11s %7s %9s %9s %9s\n", "op", "class", 
+        "ops", "bytes", "seeks", "avg us", "p50 us", "p99 us");
+    for (i=0; i < OMFS_NUM_CLASSES; i++)
+        if (stats->read[i].ops)
+            print_line(fp, "read", i, &stats->read[i]);
+    for (i=0; i < OMFS_NUM_CLASSES; i++)
+        if (stats->write[i].ops)
+            print_line(fp, "write", i, &stats->write[i]);
+    if (stats->flushes)
+        fprintf(fp, "flush  %22" PRIu64 " %29.1f\n", stats->flushes, 
+            (double) stats->flush_ns / stats->flushes / 1000);
+}
@@ -0,0 +1,117 @@
+/*
+ *  Block access traces.
+ *
+ *  While a trace is open every read, write and flush of the device is
+ *  appended to it as a struct omfs_trace_record: when, what, where,
+ *  how much and what kind of block.  omfsreplay plays a trace back
+ *  against an image, so one captured run can be used to compare I/O
+ *  strategies offline.
+ *
+ *  The header is rewritten on close with the block size and record
+ *  count, so a trace can be started before the superblock is read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "omfs.h"
+#include "trace.h"
+
+struct omfs_trace {
+    FILE *fp;
+    struct timespec start;
+    u64 count;
+    int error;
+};
+
+static int trace_write_header(omfs_info_t *info, struct omfs_trace *trace)
+{
+    struct omfs_trace_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.t_magic, OMFS_TRACE_MAGIC, sizeof(hdr.t_magic));
+    hdr.t_version = swap_be32(1);
+    if (swap_be32(info->super->s_magic) == OMFS_MAGIC)
+    {
+        hdr.t_blocksize = info->super->s_blocksize;
+        hdr.t_num_blocks = info->super->s_num_blocks;
+    }
+    hdr.t_count = swap_be64(trace->count);
+
+    fseeko(trace->fp, 0, SEEK_SET);
+    if (fwrite(&hdr, sizeof(hdr), 1, trace->fp) != 1)
+        return -EIO;
+    return 0;
+}
+
+int omfs_trace_open(omfs_info_t *info, char *path)
+{
+    struct omfs_trace *trace;
+    int ret;
+
+    if (!(trace = calloc(1, sizeof(*trace))))
+        return -ENOMEM;
+
+    if (!(trace->fp = fopen(path, "w"))) {
+        ret = -errno;
+        free(trace);
+        return ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace->start);
+
+    // placeholder until we know the block size
+    fseeko(trace->fp, sizeof(struct omfs_trace_header), SEEK_SET);
+
+    info->trace = trace;
+    return 0;
+}
+
+/*
+ *  Append a record for an access begun at start.  Called with
+ *  dev_mutex held, from the stats hooks.
+ *  Errors are remembered and returned by omfs_trace_close.
+ */
+void omfs_trace_record(omfs_info_t *info, int op, int class, u64 offset,
+    size_t len, struct timespec *start)
+{
+    struct omfs_trace *trace = info->trace;
+    struct omfs_trace_record rec;
+    u64 ns;
+
+    if (!trace)
+        return;
+
+    ns = (start->tv_sec - trace->start.tv_sec) * 1000000000ULL + 
+        start->tv_nsec - trace->start.tv_nsec;
+
+    rec.t_ns = swap_be64(ns);
+    rec.t_block = swap_be64(offset ? 
+        offset / swap_be32(info->super->s_blocksize) : 0);
+    rec.t_len = swap_be32(len);
+    rec.t_op = op;
+    rec.t_class = class;
+    rec.t_fill = 0;
+
+    if (fwrite(&rec, sizeof(rec), 1, trace->fp) != 1)
+        trace->error = -EIO;
+    trace->count++;
+}
+
+int omfs_trace_close(omfs_info_t *info)
+{
+    struct omfs_trace *trace = info->trace;
+    int ret;
+
+    if (!trace)
+        return 0;
+
+    ret = trace->error;
+    if (!ret)
+        ret = trace_write_header(info, trace);
+    if (fclose(trace->fp))
+        ret = -EIO;
+
+    free(trace);
+    info->trace = NULL;
+    return ret;
+}
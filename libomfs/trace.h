@@ -0,0 +1,31 @@
+#ifndef _OMFS_TRACE_H
+#define _OMFS_TRACE_H
+
+#include "config.h"
+
+/* Block access trace, see trace.c; not part of the filesystem */
+
+#define OMFS_TRACE_MAGIC "OMFSTRCE"
+
+#define OMFS_TRACE_READ 'R'
+#define OMFS_TRACE_WRITE 'W'
+#define OMFS_TRACE_FLUSH 'F'
+
+struct omfs_trace_header {
+	char t_magic[8];		/* OMFS_TRACE_MAGIC */
+	__be32 t_version;		/* 1 */
+	__be32 t_blocksize;		/* size of a block */
+	__be64 t_num_blocks;		/* of the traced fs */
+	__be64 t_count;			/* # of records */
+};
+
+struct omfs_trace_record {
+	__be64 t_ns;			/* since the trace started */
+	__be64 t_block;			/* first block accessed */
+	__be32 t_len;			/* bytes */
+	u8 t_op;			/* OMFS_TRACE_X */
+	u8 t_class;			/* enum omfs_block_class */
+	__be16 t_fill;
+};
+
+#endif
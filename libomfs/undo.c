@@ -0,0 +1,292 @@
+/*
+ *  Undo files.
+ *
+ *  Before a block is overwritten for the first time, its old contents
+ *  are appended to the undo file.  Replaying the file puts them back,
+ *  so a repair can be rolled back at a cost proportional to what it
+ *  changed rather than to the size of the device.
+ *
+ *  Layout, all big-endian:
+ *
+ *    header       struct omfs_undo_header
+ *    records      struct omfs_undo_record, then r_len bytes of data
+ *    index        struct omfs_undo_index for each record, by block
+ *
+ *  The index is written when the file is closed.  A file whose writer
+ *  died has none (u_index == 0) but can still be replayed by scanning
+ *  the records.  Writers call omfs_undo_sync between saving blocks and
+ *  overwriting them, so no block changes on disk before its old
+ *  contents are safe in the file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "omfs.h"
+#include "undo.h"
+#include "bits.h"
+
+struct omfs_undo {
+    FILE *fp;
+    u8 *saved;                  /* bit per fs block */
+    u8 *buf;
+    int blocksize;
+    u64 num_blocks;
+    struct omfs_undo_index *index;
+    u64 count;
+    u64 index_size;
+    int unsynced;               /* records saved since the last sync */
+};
+
+static int undo_write_header(struct omfs_undo *undo, u64 index)
+{
+    struct omfs_undo_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.u_magic, OMFS_UNDO_MAGIC, sizeof(hdr.u_magic));
+    hdr.u_version = swap_be32(1);
+    hdr.u_blocksize = swap_be32(undo->blocksize);
+    hdr.u_count = swap_be64(undo->count);
+    hdr.u_index = swap_be64(index);
+
+    fseeko(undo->fp, 0, SEEK_SET);
+    if (fwrite(&hdr, sizeof(hdr), 1, undo->fp) != 1)
+        return -EIO;
+    return 0;
+}
+
+/*
+ *  Start recording into a new undo file.  The superblock must already
+ *  be loaded.
+ */
+int omfs_undo_open(omfs_info_t *info, char *path)
+{
+    struct omfs_undo *undo;
+    int ret = -ENOMEM;
+
+    if (!(undo = calloc(1, sizeof(*undo))))
+        return ret;
+
+    undo->blocksize = swap_be32(info->super->s_blocksize);
+    undo->num_blocks = swap_be64(info->super->s_num_blocks);
+
+    if (!(undo->saved = calloc(1, (undo->num_blocks + 7) / 8)))
+        goto err;
+    if (!(undo->buf = malloc(undo->blocksize)))
+        goto err;
+
+    if (!(undo->fp = fopen(path, "w+"))) {
+        ret = -errno;
+        goto err;
+    }
+    if ((ret = undo_write_header(undo, 0)))
+        goto err;
+
+    info->undo = undo;
+    return 0;
+
+err:
+    if (undo->fp)
+        fclose(undo->fp);
+    free(undo->buf);
+    free(undo->saved);
+    free(undo);
+    return ret;
+}
+
+/*
+ *  Save the current contents of a block, unless we already have them.
+ *  Called with dev_mutex held, just before the block is written.
+ */
+int omfs_undo_save(omfs_info_t *info, u64 block)
+{
+    struct omfs_undo *undo = info->undo;
+    struct omfs_undo_record rec;
+    struct omfs_undo_index *ix;
+    ssize_t len;
+
+    if (!undo || block >= undo->num_blocks || test_bit(undo->saved, block))
+        return 0;
+
+    if (undo->count == undo->index_size)
+    {
+        u64 size = undo->index_size ? undo->index_size * 2 : 64;
+        void *tmp = realloc(undo->index, size * sizeof(*ix));
+        if (!tmp)
+            return -ENOMEM;
+        undo->index = tmp;
+        undo->index_size = size;
+    }
+
+    // a short read just means the block lies past the current end
+    len = info->dev->ops->read_blocks(info->dev, block * undo->blocksize,
+        undo->buf, undo->blocksize);
+    if (len < 0)
+        return len;
+
+    rec.r_block = swap_be64(block);
+    rec.r_len = swap_be32(len);
+    rec.r_fill = 0;
+
+    fseeko(undo->fp, 0, SEEK_END);
+    ix = &undo->index[undo->count];
+    ix->x_block = rec.r_block;
+    ix->x_offset = swap_be64(ftello(undo->fp));
+
+    if (fwrite(&rec, sizeof(rec), 1, undo->fp) != 1 ||
+        fwrite(undo->buf, 1, len, undo->fp) != len)
+        return -EIO;
+
+    undo->count++;
+    undo->unsynced = 1;
+    set_bit(undo->saved, block);
+    return 0;
+}
+
+/*
+ *  Get the records saved so far onto disk.  Called with dev_mutex
+ *  held, after saving and before writing the blocks.
+ */
+int omfs_undo_sync(omfs_info_t *info)
+{
+    struct omfs_undo *undo = info->undo;
+
+    if (!undo || !undo->unsynced)
+        return 0;
+    if (fflush(undo->fp) || fsync(fileno(undo->fp)))
+        return -errno;
+    undo->unsynced = 0;
+    return 0;
+}
+
+static int _cmp_index(const void *a, const void *b)
+{
+    u64 x = swap_be64(((struct omfs_undo_index *) a)->x_block);
+    u64 y = swap_be64(((struct omfs_undo_index *) b)->x_block);
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Write the index and stop recording.
+ */
+int omfs_undo_close(omfs_info_t *info)
+{
+    struct omfs_undo *undo = info->undo;
+    int ret = 0;
+    off_t index;
+
+    if (!undo)
+        return 0;
+
+    qsort(undo->index, undo->count, sizeof(*undo->index), _cmp_index);
+
+    fseeko(undo->fp, 0, SEEK_END);
+    index = ftello(undo->fp);
+    if (fwrite(undo->index, sizeof(*undo->index), undo->count, 
+        undo->fp) != undo->count)
+        ret = -EIO;
+
+    if (!ret)
+        ret = undo_write_header(undo, index);
+
+    if (fclose(undo->fp))
+        ret = -EIO;
+
+    free(undo->index);
+    free(undo->buf);
+    free(undo->saved);
+    free(undo);
+    info->undo = NULL;
+    return ret;
+}
+
+/*
+ *  Put the saved blocks back onto dev.  With an index, the records are
+ *  visited in block order; otherwise in the order they were saved.
+ *  If list is set, print the blocks instead of writing them.
+ */
+int omfs_undo_replay(omfs_dev_t *dev, char *path, int list)
+{
+    struct omfs_undo_header hdr;
+    struct omfs_undo_record rec;
+    struct omfs_undo_index ix;
+    FILE *fp;
+    u8 *buf = NULL;
+    u64 i, count, index;
+    off_t pos = sizeof(hdr);
+    int blocksize, len, ret = 0;
+
+    if (!(fp = fopen(path, "r")))
+        return -errno;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.u_magic, OMFS_UNDO_MAGIC, sizeof(hdr.u_magic)))
+    {
+        ret = -EMEDIUMTYPE;
+        goto out;
+    }
+
+    blocksize = swap_be32(hdr.u_blocksize);
+    count = swap_be64(hdr.u_count);
+    index = swap_be64(hdr.u_index);
+
+    if (!(buf = malloc(blocksize))) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i=0; !index || i < count; i++)
+    {
+        if (index)
+        {
+            fseeko(fp, index + i * sizeof(ix), SEEK_SET);
+            if (fread(&ix, sizeof(ix), 1, fp) != 1) {
+                ret = -EIO;
+                break;
+            }
+            pos = swap_be64(ix.x_offset);
+        }
+
+        // without an index, a short record is where the writer died
+        fseeko(fp, pos, SEEK_SET);
+        if (fread(&rec, sizeof(rec), 1, fp) != 1)
+        {
+            if (index)
+                ret = -EIO;
+            break;
+        }
+        len = swap_be32(rec.r_len);
+        if (len > blocksize) {
+            ret = -EIO;
+            break;
+        }
+        if (fread(buf, 1, len, fp) != len)
+        {
+            if (index)
+                ret = -EIO;
+            break;
+        }
+        pos += sizeof(rec) + len;
+
+        if (list)
+        {
+            printf("%" PRIx64 " %d\n", swap_be64(rec.r_block), len);
+            continue;
+        }
+
+        if (dev->ops->write_blocks(dev, swap_be64(rec.r_block) * blocksize,
+            buf, len) != len) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    if (!list && !ret && dev->ops->flush(dev))
+        ret = -EIO;
+out:
+    free(buf);
+    fclose(fp);
+    return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef _OMFS_UNDO_H
+#define _OMFS_UNDO_H
+
+#include "config.h"
+
+/* Undo file, see undo.c; not part of the filesystem itself */
+
+#define OMFS_UNDO_MAGIC "OMFSUNDO"
+
+struct omfs_undo_header {
+	char u_magic[8];		/* OMFS_UNDO_MAGIC */
+	__be32 u_version;		/* 1 */
+	__be32 u_blocksize;		/* size of a block */
+	__be64 u_count;			/* # of records in the index */
+	__be64 u_index;			/* file offset of index, 0 if none */
+};
+
+struct omfs_undo_record {
+	__be64 r_block;			/* FS block saved */
+	__be32 r_len;			/* bytes of data following */
+	__be32 r_fill;
+};
+
+struct omfs_undo_index {
+	__be64 x_block;			/* FS block saved */
+	__be64 x_offset;		/* file offset of its record */
+};
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ *  Inode manifests for omfsdump --format, one record per inode in
+ *  scan order: NDJSON, one JSON object to a line, or a binary file of
+ *  struct omfs_manifest_entry records.
+ *
+ *  A big volume has tens of millions of inodes, so nothing here is
+ *  allocated per inode or goes through printf.  Records are built,
+ *  names escaped in place, straight into one large buffer that is
+ *  written out whenever it fills.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "dirscan.h"
+#include "dump.h"
+#include "manifest.h"
+
+#define OUT_SIZE (1 << 20)
+
+/* room for the longest record, a name all of \u00XX escapes */
+#define OUT_MAX_RECORD (OMFS_NAMELEN * 6 + 256)
+
+struct outbuf
+{
+	FILE *fp;
+	char *buf;
+	size_t len;
+	int error;
+	u64 records;
+};
+
+static void out_flush(struct outbuf *out)
+{
+	if (out->len && !out->error &&
+	    fwrite(out->buf, 1, out->len, out->fp) != out->len)
+		out->error = 1;
+	out->len = 0;
+}
+
+/* make sure there's room for one more record */
+static char *out_reserve(struct outbuf *out)
+{
+	if (out->len + OUT_MAX_RECORD > OUT_SIZE)
+		out_flush(out);
+	return out->buf + out->len;
+}
+
+static char *put_str(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+static char *put_u64(char *p, u64 n)
+{
+	char tmp[20];
+	int i = 0;
+
+	do
+		tmp[i++] = '0' + n % 10;
+	while (n /= 10);
+	while (i)
+		*p++ = tmp[--i];
+	return p;
+}
+
+/*
+ *  A name as a JSON string.  Names are bytes, not UTF-8, so anything
+ *  outside printable ASCII is written as the Latin-1 code point.
+ */
+static char *put_json_name(char *p, const char *name, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	int i;
+
+	*p++ = '"';
+	for (i = 0; i < len; i++)
+	{
+		c = name[i];
+		if (c == '"' || c == '\\')
+		{
+			*p++ = '\\';
+			*p++ = c;
+		}
+		else if (c < 0x20 || c >= 0x7f)
+		{
+			p = put_str(p, "\\u00");
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 0xf];
+		}
+		else
+			*p++ = c;
+	}
+	*p++ = '"';
+	return p;
+}
+
+static char *type_name(char type)
+{
+	switch (type)
+	{
+	case OMFS_DIR:
+		return "dir";
+	case OMFS_FILE:
+		return "file";
+	}
+	return "other";
+}
+
+static int name_len(omfs_inode_t *inode)
+{
+	int len = strnlen(inode->i_name, OMFS_NAMELEN);
+	return len > 255 ? 255 : len;
+}
+
+static int on_node_json(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct outbuf *out = user;
+	omfs_inode_t *inode = entry->inode;
+	char *p = out_reserve(out);
+
+	p = put_str(p, "{\"block\":");
+	p = put_u64(p, entry->block);
+	p = put_str(p, ",\"parent\":");
+	if (entry->parent == ~0ULL)
+		p = put_str(p, "null");
+	else
+		p = put_u64(p, entry->parent);
+	p = put_str(p, ",\"level\":");
+	p = put_u64(p, entry->level);
+	p = put_str(p, ",\"hash\":");
+	p = put_u64(p, entry->hindex < 0 ? 0 : entry->hindex);
+	p = put_str(p, ",\"type\":\"");
+	p = put_str(p, type_name(inode->i_type));
+	p = put_str(p, "\",\"size\":");
+	p = put_u64(p, swap_be64(inode->i_size));
+	p = put_str(p, ",\"ctime\":");
+	p = put_u64(p, swap_be64(inode->i_ctime));
+	p = put_str(p, ",\"name\":");
+	p = put_json_name(p, inode->i_name, name_len(inode));
+	p = put_str(p, "}\n");
+
+	out->len = p - out->buf;
+	out->records++;
+	if (out->error)
+		d->stop = 1;
+	return out->error ? -1 : 0;
+}
+
+static int on_node_binary(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct outbuf *out = user;
+	omfs_inode_t *inode = entry->inode;
+	struct omfs_manifest_entry rec;
+	char *p = out_reserve(out);
+	int len = name_len(inode);
+
+	rec.d_block = swap_be64(entry->block);
+	rec.d_parent = swap_be64(entry->parent);
+	rec.d_size = inode->i_size;
+	rec.d_ctime = inode->i_ctime;
+	rec.d_hash = swap_be16(entry->hindex < 0 ? 0 : entry->hindex);
+	rec.d_level = swap_be16(entry->level);
+	rec.d_type = inode->i_type;
+	rec.d_name_len = len;
+	rec.d_fill = 0;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), inode->i_name, len);
+
+	out->len += sizeof(rec) + len;
+	out->records++;
+	if (out->error)
+		d->stop = 1;
+	return out->error ? -1 : 0;
+}
+
+int dump_manifest(omfs_dev_t *dev, dump_scope_t *scope,
+	dump_format_t format, int verbose)
+{
+	int ok = 0, ret;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct omfs_stats stats;
+	struct omfs_manifest_header hdr;
+	struct outbuf out = { stdout };
+	omfs_info_t info = {
+		.dev = dev,
+		.super = &super,
+		.root = &root
+	};
+
+	if (omfs_read_super(&info) || omfs_read_root_block(&info))
+	{
+		fprintf(stderr, "Could not read super or root block\n");
+		return 0;
+	}
+	out.buf = malloc(OUT_SIZE);
+	if (!out.buf)
+		return 0;
+
+	if (format == DUMP_MANIFEST)
+	{
+		memcpy(hdr.m_magic, OMFS_MANIFEST_MAGIC, sizeof(hdr.m_magic));
+		hdr.m_version = swap_be32(1);
+		hdr.m_blocksize = super.s_blocksize;
+		hdr.m_num_blocks = super.s_num_blocks;
+		memcpy(out.buf, &hdr, sizeof(hdr));
+		out.len = sizeof(hdr);
+	}
+
+	ret = dump_scan(&info, scope, format == DUMP_MANIFEST ?
+		on_node_binary : on_node_json, &out);
+	out_flush(&out);
+	if (out.error || fflush(stdout))
+		perror("omfsdump");
+	else if (ret < 0)
+		fprintf(stderr, "Dirscan failed\n");
+	else
+		ok = 1;
+
+	if (verbose)
+	{
+		omfs_get_stats(&info, &stats);
+		fprintf(stderr, "\n%" PRIu64 " inodes\n", out.records);
+		omfs_print_stats(stderr, &stats);
+	}
+	free(out.buf);
+	return ok;
+}
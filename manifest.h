@@ -0,0 +1,30 @@
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include "omfs.h"
+
+/* Inode manifest, see omfsdump --format; not part of the filesystem */
+
+#define OMFS_MANIFEST_MAGIC "OMFSMANI"
+
+struct omfs_manifest_header {
+	char m_magic[8];		/* OMFS_MANIFEST_MAGIC */
+	__be32 m_version;		/* 1 */
+	__be32 m_blocksize;		/* size of a block */
+	__be64 m_num_blocks;		/* of the dumped fs */
+};
+
+/* one per inode, in scan order, to the end of the file */
+struct omfs_manifest_entry {
+	__be64 d_block;			/* where the inode is */
+	__be64 d_parent;		/* its directory, ~0 for the root */
+	__be64 d_size;			/* i_size */
+	__be64 d_ctime;			/* i_ctime */
+	__be16 d_hash;			/* bucket in the parent */
+	__be16 d_level;			/* depth below the root */
+	u8 d_type;			/* i_type */
+	u8 d_name_len;			/* bytes of name following */
+	__be16 d_fill;
+};
+
+#endif
@@ -18,21 +18,22 @@
 
 int main(int argc, char *argv[])
 {
-	FILE *fp;
+	omfs_dev_t *fp;
 	char *dev;
 	u64 size;
 
 	fs_config_t config = {
 		.block_size = 8192,
 		.cluster_size = 8,
-		.clear_dev = 0
+		.clear_dev = 0,
+		.undo_file = NULL
 	};
 
 	while (1) 
 	{
 		int c;
 
-		c = getopt(argc, argv, "b:c:x");
+		c = getopt(argc, argv, "b:c:u:xv");
 		if (c == -1)
 			break;
 
@@ -44,9 +45,15 @@ int main(int argc, char *argv[])
 			case 'c':
 				config.cluster_size = atoi(optarg);
 				break;
+			case 'u':
+				config.undo_file = optarg;
+				break;
 			case 'x':
 				config.clear_dev = 1;
 				break;
+			case 'v':
+				config.verbose = 1;
+				break;
 		}
 	}
 
@@ -58,6 +65,13 @@ int main(int argc, char *argv[])
 
 	dev = argv[optind];
 
+	if (config.undo_file && config.clear_dev)
+	{
+		fprintf(stderr, "Clearing the device can't be undone; "
+			"use -u or -x, not both\n");
+		exit(1);
+	}
+
 	if (!get_disk_size(dev, &size))
 	{
 		fprintf(stderr, "Could not get size of disk %s\n", 
@@ -73,14 +87,18 @@ int main(int argc, char *argv[])
 	if (ch != 'y')
 		exit(0);
 
-	fp = fopen(dev, "r+");
+	fp = omfs_dev_open(dev, 1, NULL);
 	if (!fp)
 	{
 		perror("mkomfs: ");
 		exit(2);
 	}
 
-	create_fs(fp, size/512, &config);
-	fclose(fp);
+	if (!create_fs(fp, size/512, &config))
+	{
+		omfs_dev_close(fp);
+		exit(3);
+	}
+	omfs_dev_close(fp);
 	return 0;
 }
@@ -2,6 +2,9 @@
  *  Filesystem check for OMFS
  */
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include <getopt.h>
 #include "config.h"
 #include "omfs.h"
@@ -10,18 +13,35 @@
 
 int main(int argc, char *argv[])
 {
-	FILE *fp;
+	omfs_dev_t *fp;
 	char *dev;
+	int res;
+	unsigned int seed = time(NULL) ^ getpid();
+
+	static struct option long_options[] = {
+		{"sample", required_argument, NULL, 'S'},
+		{"seed", required_argument, NULL, 'R'},
+		{"time-budget", required_argument, NULL, 'T'},
+		{"io-budget", required_argument, NULL, 'O'},
+		{"checkpoint", required_argument, NULL, 'K'},
+		{"report", required_argument, NULL, 'r'},
+		{"report-file", required_argument, NULL, 'F'},
+		{"trace", required_argument, NULL, 't'},
+		{NULL, 0, NULL, 0}
+	};
 
 	check_fs_config_t config = {
 		.is_quiet = 0,
+		.fix_mode = FIX_ASK,
+		.level = CHECK_FULL,
+		.progress_fd = -1,
 	};
 
 	while (1) 
 	{
 		int c;
 
-		c = getopt(argc, argv, "q");
+		c = getopt_long(argc, argv, "qynpl:u:I:fC:v", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -30,9 +50,104 @@ int main(int argc, char *argv[])
 			case 'q':
 				config.is_quiet = 1;
 				break;
+			case 'y':
+				config.fix_mode = FIX_YES;
+				break;
+			case 'n':
+				config.fix_mode = FIX_NO;
+				break;
+			case 'p':
+				config.fix_mode = FIX_PREEN;
+				break;
+			case 'l':
+				config.level = atoi(optarg);
+				if (config.level < CHECK_SUPER || 
+				    config.level > CHECK_FULL)
+				{
+					fprintf(stderr, "Check level must be "
+						"0, 1 or 2\n");
+					exit(1);
+				}
+				break;
+			case 'u':
+				config.undo_file = optarg;
+				break;
+			case 'I':
+				config.index_file = optarg;
+				break;
+			case 'f':
+				config.force = 1;
+				break;
+			case 'C':
+				config.progress_fd = atoi(optarg);
+				break;
+			case 'v':
+				config.verbose = 1;
+				break;
+			case 'S':
+				config.sample = atoi(optarg);
+				break;
+			case 'R':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'T':
+				config.time_budget = atoi(optarg);
+				break;
+			case 'O':
+				config.io_budget = strtoull(optarg, NULL, 0);
+				break;
+			case 'K':
+				config.checkpoint_file = optarg;
+				break;
+			case 'r':
+				if (!strcmp(optarg, "json"))
+					config.report = REPORT_JSON;
+				else if (!strcmp(optarg, "prom"))
+					config.report = REPORT_PROM;
+				else
+				{
+					fprintf(stderr, "Report format must "
+						"be json or prom\n");
+					exit(1);
+				}
+				break;
+			case 'F':
+				config.report_file = optarg;
+				break;
+			case 't':
+				config.trace_file = optarg;
+				break;
 		}
 	}
 
+	/*
+	 * A checkpoint is only good while the fs doesn't change under
+	 * it, and repairs are deferred to the end of a whole scan.
+	 */
+	if ((config.time_budget || config.io_budget) && 
+	    !config.checkpoint_file)
+	{
+		fprintf(stderr, "A budget needs --checkpoint\n");
+		exit(1);
+	}
+	/* a sample never sees the whole fs, so it has no business fixing it */
+	if (config.sample)
+	{
+		if (config.fix_mode == FIX_YES || config.fix_mode == FIX_PREEN)
+		{
+			fprintf(stderr, "--sample can't be used with -y or -p\n");
+			exit(1);
+		}
+		config.fix_mode = FIX_NO;
+	}
+	if (config.checkpoint_file && (config.fix_mode != FIX_NO ||
+	    config.index_file || config.sample))
+	{
+		fprintf(stderr, "--checkpoint only works with -n, and not "
+			"with -I or --sample\n");
+		exit(1);
+	}
+
 	if (argc - optind < 1)
 	{
 		fprintf(stderr, "Usage: %s [options] <device>\n", argv[0]);
@@ -40,20 +155,31 @@ int main(int argc, char *argv[])
 	}
 
 	dev = argv[optind];
+	config.device = dev;
+	srandom(seed);
 
-	fp = fopen(dev, "r+");
+	fp = omfs_dev_open(dev, config.fix_mode != FIX_NO, NULL);
 	if (!fp)
 	{
 		perror("omfsck: ");
 		exit(2);
 	}
 
-	if (!check_fs(fp, &config))
-	{
-		fclose(fp);
+	res = check_fs(fp, &config);
+	omfs_dev_close(fp);
+
+	/* problems found so far are reported again by the last slice */
+	if (config.stopped)
+		return 32;
+	if (!res)
 		exit(3);
+
+	if (config.changed)
+	{
+		if (!config.is_quiet)
+			printf("File system was modified\n");
+		return 1;
 	}
-	fclose(fp);
 
 	if (!config.is_quiet)
 		printf("File system check successful\n");
@@ -0,0 +1,78 @@
+/*
+ *  omfsdefrag - make fragmented files contiguous
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "defrag.h"
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n] [-c] [-e extents] [--io-budget bytes] "
+		"[-u undo] [-v] <device>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	omfs_dev_t *fp;
+	int c, res;
+	static struct option long_options[] = {
+		{"io-budget", required_argument, NULL, 'O'},
+		{NULL, 0, NULL, 0}
+	};
+
+	defrag_config_t config = {
+		.dry_run = 0,
+		.compact = 0,
+		.min_extents = 2,
+		.io_budget = 0,
+		.undo_file = NULL,
+		.verbose = 0
+	};
+
+	while ((c = getopt_long(argc, argv, "nce:u:v", long_options,
+	    NULL)) != -1)
+	{
+		switch(c)
+		{
+			case 'n':
+				config.dry_run = 1;
+				break;
+			case 'c':
+				config.compact = 1;
+				break;
+			case 'e':
+				config.min_extents = atoi(optarg);
+				if (config.min_extents < 2)
+					config.min_extents = 2;
+				break;
+			case 'O':
+				config.io_budget = strtoull(optarg, NULL, 0);
+				break;
+			case 'u':
+				config.undo_file = optarg;
+				break;
+			case 'v':
+				config.verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 1)
+		usage(argv[0]);
+
+	fp = omfs_dev_open(argv[optind], !config.dry_run, NULL);
+	if (!fp)
+	{
+		perror("omfsdefrag: ");
+		exit(2);
+	}
+
+	res = defrag_fs(fp, &config);
+	omfs_dev_close(fp);
+	return res ? 0 : 3;
+}
@@ -2,25 +2,154 @@
  *  Filesystem check for OMFS
  */
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
 #include "dump.h"
 
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-v] [-l path]... [--hash-stats] "
+		"[--extents] [--frag-summary] [--free-stats] "
+		"[--format fmt] [--subtree path] [--max-depth n] "
+		"[--type d|f] [--name glob] <device>\n", prog);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-	FILE *fp;
+	omfs_dev_t *fp;
+	int c, verbose = 0, num_paths = 0, hash_stats = 0, ret = 0;
+	int extents = 0, frag_summary = 0, free_stats = 0, scoped;
+	dump_format_t format = DUMP_TEXT;
+	dump_scope_t scope = {
+		.path = NULL,
+		.filter = { .max_depth = -1 }
+	};
+	char **paths;
+	static struct option long_options[] = {
+		{"hash-stats", no_argument, NULL, 'H'},
+		{"extents", no_argument, NULL, 'E'},
+		{"frag-summary", no_argument, NULL, 'G'},
+		{"free-stats", no_argument, NULL, 'F'},
+		{"format", required_argument, NULL, 'f'},
+		{"subtree", required_argument, NULL, 's'},
+		{"max-depth", required_argument, NULL, 'D'},
+		{"type", required_argument, NULL, 't'},
+		{"name", required_argument, NULL, 'N'},
+		{NULL, 0, NULL, 0}
+	};
 
-	if (argc < 2)
+	paths = malloc(argc * sizeof(char *));
+	if (!paths)
+		exit(2);
+
+	while ((c = getopt_long(argc, argv, "vl:", long_options, NULL)) != -1)
+	{
+		switch(c)
+		{
+			case 'v':
+				verbose = 1;
+				break;
+			case 'l':
+				paths[num_paths++] = optarg;
+				break;
+			case 'H':
+				hash_stats = 1;
+				break;
+			case 'E':
+				extents = 1;
+				break;
+			case 'G':
+				frag_summary = 1;
+				break;
+			case 'F':
+				free_stats = 1;
+				break;
+			case 'f':
+				if (!strcmp(optarg, "text"))
+					format = DUMP_TEXT;
+				else if (!strcmp(optarg, "ndjson"))
+					format = DUMP_NDJSON;
+				else if (!strcmp(optarg, "manifest"))
+					format = DUMP_MANIFEST;
+				else
+				{
+					fprintf(stderr, "Format must be text, "
+						"ndjson or manifest\n");
+					exit(1);
+				}
+				break;
+			case 's':
+				scope.path = optarg;
+				break;
+			case 'D':
+				scope.filter.max_depth = atoi(optarg);
+				break;
+			case 't':
+				if (!strcmp(optarg, "d"))
+					scope.filter.type = OMFS_DIR;
+				else if (!strcmp(optarg, "f"))
+					scope.filter.type = OMFS_FILE;
+				else
+				{
+					fprintf(stderr, "Type must be d or "
+						"f\n");
+					exit(1);
+				}
+				break;
+			case 'N':
+				scope.filter.glob = optarg;
+				break;
+		}
+	}
+
+	if (argc - optind < 1)
+		usage(argv[0]);
+
+	/* one mode at a time, and only the tree walks can be narrowed */
+	scoped = scope.path || scope.filter.max_depth >= 0 ||
+		scope.filter.type || scope.filter.glob;
+	if (!!num_paths + hash_stats + (extents || frag_summary) +
+	    free_stats > 1)
+	{
+		fprintf(stderr, "Only one of -l, --hash-stats, --extents or "
+			"--frag-summary, and --free-stats at a time\n");
+		usage(argv[0]);
+	}
+	if ((num_paths || hash_stats || free_stats) && scoped)
+	{
+		fprintf(stderr, "--subtree, --max-depth, --type and --name "
+			"don't apply to -l, --hash-stats or --free-stats\n");
+		usage(argv[0]);
+	}
+	if (format != DUMP_TEXT && (num_paths || hash_stats || extents ||
+	    frag_summary || free_stats))
 	{
-		fprintf(stderr, "Usage: %s <device>\n", argv[0]);
-		exit(1);
+		fprintf(stderr, "--format only applies to the tree dump\n");
+		usage(argv[0]);
 	}
 
-	fp = fopen(argv[1], "rb");
+	fp = omfs_dev_open(argv[optind], 0, NULL);
 	if (!fp)
 	{
 		perror("omfsdump: ");
 		exit(2);
 	}
 
-    dump_fs(fp);
-    return 0;
+    if (num_paths)
+        ret = dump_paths(fp, paths, num_paths, verbose) ? 1 : 0;
+    else if (hash_stats)
+        ret = !dump_hash_stats(fp, verbose);
+    else if (extents || frag_summary)
+        ret = !dump_frag(fp, &scope, extents, frag_summary, verbose);
+    else if (free_stats)
+        ret = !dump_free_stats(fp, verbose);
+    else if (format != DUMP_TEXT)
+        ret = !dump_manifest(fp, &scope, format, verbose);
+    else
+        ret = !dump_fs(fp, &scope, verbose);
+    omfs_dev_close(fp);
+    free(paths);
+    return ret;
 }
@@ -0,0 +1,71 @@
+/*
+ *  omfsreorder - relink directory hash chains in block order
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "reorder.h"
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n] [-r | -L] [-d blocks] [-u undo] [-v] "
+		"<device>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	omfs_dev_t *fp;
+	int c, res;
+
+	reorder_config_t config = {
+		.relocate = 0,
+		.layout = 0,
+		.max_dist = 4096,
+		.dry_run = 0,
+		.undo_file = NULL,
+		.verbose = 0
+	};
+
+	while ((c = getopt(argc, argv, "nrLd:u:v")) != -1)
+	{
+		switch(c)
+		{
+			case 'n':
+				config.dry_run = 1;
+				break;
+			case 'r':
+				config.relocate = 1;
+				break;
+			case 'L':
+				config.layout = 1;
+				break;
+			case 'd':
+				config.max_dist = strtoull(optarg, NULL, 0);
+				break;
+			case 'u':
+				config.undo_file = optarg;
+				break;
+			case 'v':
+				config.verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	/* -L lays out everything; it has no use for -r */
+	if (argc - optind < 1 || (config.relocate && config.layout))
+		usage(argv[0]);
+
+	fp = omfs_dev_open(argv[optind], !config.dry_run, NULL);
+	if (!fp)
+	{
+		perror("omfsreorder: ");
+		exit(2);
+	}
+
+	res = reorder_fs(fp, &config);
+	omfs_dev_close(fp);
+	return res ? 0 : 3;
+}
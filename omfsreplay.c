@@ -0,0 +1,649 @@
+/*
+ *  omfsreplay.c - Play a block trace (see omfsck --trace) back against
+ *  an image, to compare I/O strategies on a real access pattern.
+ *
+ *  The same reads, and with -w the same writes and flushes, are issued
+ *  in the same order through the chosen backend, optionally behind an
+ *  LRU block cache.  Writes put junk in the blocks, so only use -w on
+ *  a scratch copy.
+ *
+ *  Licensed under GPL version 2 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <aio.h>
+#include <getopt.h>
+#include "omfs.h"
+#include "trace.h"
+
+#define DIRECT_ALIGN 4096
+
+struct replay;
+
+struct backend
+{
+	char *name;
+	int (*open)(struct replay *r, char *path);
+	int (*read)(struct replay *r, u64 off, u8 *buf, size_t len);
+	int (*write)(struct replay *r, u64 off, u8 *buf, size_t len);
+	int (*flush)(struct replay *r);
+	void (*close)(struct replay *r);
+};
+
+struct aio_slot
+{
+	struct aiocb cb;
+	u8 *buf;
+	int busy;
+};
+
+struct cache_entry
+{
+	u64 block;
+	struct cache_entry *prev, *next;	/* LRU, most recent first */
+	struct cache_entry *hnext;
+	u8 *data;
+};
+
+struct replay
+{
+	struct backend *be;
+	char *be_name;		/* -b */
+	int writes;		/* -w */
+	int blocksize;
+
+	omfs_dev_t *dev;	/* libomfs backends */
+	int fd;			/* direct, async */
+	u8 *dbuf;		/* aligned bounce buffer, direct */
+	size_t dbuf_len;
+	struct aio_slot *slots;	/* async */
+	int depth;
+	int next_slot;
+
+	struct cache_entry *entries;
+	struct cache_entry **hash;
+	struct cache_entry *lru, *lru_tail;
+	int cache_size;
+	int hash_mask;
+	int cached;
+
+	u64 hits, misses, skipped;
+	u64 backend_bytes;
+};
+
+/* any libomfs backend, as omfs_dev_open names them */
+
+static int dev_open(struct replay *r, char *path)
+{
+	r->dev = omfs_dev_open(path, r->writes, r->be_name);
+	return r->dev ? 0 : -errno;
+}
+
+static int dev_read(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	ssize_t ret = r->dev->ops->read_blocks(r->dev, off, buf, len);
+	return ret < 0 ? ret : ret == len ? 0 : -EIO;
+}
+
+static int dev_write(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	ssize_t ret = r->dev->ops->write_blocks(r->dev, off, buf, len);
+	return ret < 0 ? ret : ret == len ? 0 : -EIO;
+}
+
+static int dev_flush(struct replay *r)
+{
+	return r->dev->ops->flush(r->dev);
+}
+
+static void dev_close(struct replay *r)
+{
+	omfs_dev_close(r->dev);
+}
+
+/* plain descriptors, under the two backends libomfs doesn't have */
+
+static int fd_open(struct replay *r, char *path, int flags)
+{
+	r->fd = open(path, (r->writes ? O_RDWR : O_RDONLY) | flags);
+	return r->fd < 0 ? -errno : 0;
+}
+
+static int fd_write(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	return pwrite(r->fd, buf, len, off) == len ? 0 : -EIO;
+}
+
+static int fd_flush(struct replay *r)
+{
+	return fsync(r->fd) ? -errno : 0;
+}
+
+/*
+ *  O_DIRECT: everything goes through an aligned buffer, and ranges
+ *  are widened to whole DIRECT_ALIGN units.
+ */
+
+static int direct_open(struct replay *r, char *path)
+{
+	return fd_open(r, path, O_DIRECT);
+}
+
+static int direct_span(struct replay *r, u64 off, size_t len,
+		u64 *start, size_t *span)
+{
+	void *p;
+
+	*start = off & ~(u64) (DIRECT_ALIGN - 1);
+	*span = (off + len - *start + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+	if (*span > r->dbuf_len)
+	{
+		free(r->dbuf);
+		if (posix_memalign(&p, DIRECT_ALIGN, *span))
+		{
+			r->dbuf = NULL;
+			r->dbuf_len = 0;
+			return -ENOMEM;
+		}
+		r->dbuf = p;
+		r->dbuf_len = *span;
+	}
+	return 0;
+}
+
+static int direct_read(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	u64 start;
+	size_t span;
+	ssize_t got;
+
+	if (direct_span(r, off, len, &start, &span))
+		return -ENOMEM;
+
+	// the last unit may run past the end of the image
+	got = pread(r->fd, r->dbuf, span, start);
+	if (got < (ssize_t) (off - start + len))
+		return -EIO;
+	memcpy(buf, r->dbuf + (off - start), len);
+	return 0;
+}
+
+static int direct_write(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	u64 start;
+	size_t span;
+
+	if (direct_span(r, off, len, &start, &span))
+		return -ENOMEM;
+
+	// read-modify-write the units the range only partly covers
+	if ((off != start || len != span) &&
+	    pread(r->fd, r->dbuf, span, start) < 0)
+		return -EIO;
+	memcpy(r->dbuf + (off - start), buf, len);
+	return pwrite(r->fd, r->dbuf, span, start) == span ? 0 : -EIO;
+}
+
+static void direct_close(struct replay *r)
+{
+	free(r->dbuf);
+	close(r->fd);
+}
+
+/*
+ *  POSIX AIO: reads are queued, up to depth at a time, each into a
+ *  buffer of its own.  Writes and flushes wait for everything queued
+ *  so the order on disk is kept.
+ */
+
+static int async_wait(struct replay *r, struct aio_slot *slot)
+{
+	const struct aiocb *list[1] = { &slot->cb };
+	int err;
+
+	if (!slot->busy)
+		return 0;
+	while ((err = aio_error(&slot->cb)) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
+	slot->busy = 0;
+	return (err || aio_return(&slot->cb) != slot->cb.aio_nbytes) ?
+		-EIO : 0;
+}
+
+static int async_drain(struct replay *r)
+{
+	int i, ret = 0;
+
+	for (i=0; i < r->depth; i++)
+		ret |= async_wait(r, &r->slots[i]);
+	return ret;
+}
+
+static int async_open(struct replay *r, char *path)
+{
+	int ret;
+
+	if ((ret = fd_open(r, path, 0)))
+		return ret;
+	r->slots = calloc(r->depth, sizeof(*r->slots));
+	return r->slots ? 0 : -ENOMEM;
+}
+
+static int async_read(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	struct aio_slot *slot = &r->slots[r->next_slot];
+	int ret;
+
+	r->next_slot = (r->next_slot + 1) % r->depth;
+	if ((ret = async_wait(r, slot)))
+		return ret;
+
+	// the caller's buffer is reused at once; read into our own
+	free(slot->buf);
+	if (!(slot->buf = malloc(len)))
+		return -ENOMEM;
+
+	memset(&slot->cb, 0, sizeof(slot->cb));
+	slot->cb.aio_fildes = r->fd;
+	slot->cb.aio_buf = slot->buf;
+	slot->cb.aio_nbytes = len;
+	slot->cb.aio_offset = off;
+	if (aio_read(&slot->cb))
+		return -errno;
+	slot->busy = 1;
+	return 0;
+}
+
+static int async_write(struct replay *r, u64 off, u8 *buf, size_t len)
+{
+	int ret;
+
+	if ((ret = async_drain(r)))
+		return ret;
+	return fd_write(r, off, buf, len);
+}
+
+static int async_flush(struct replay *r)
+{
+	int ret;
+
+	if ((ret = async_drain(r)))
+		return ret;
+	return fd_flush(r);
+}
+
+static void async_close(struct replay *r)
+{
+	int i;
+
+	async_drain(r);
+	for (i=0; i < r->depth; i++)
+		free(r->slots[i].buf);
+	free(r->slots);
+	close(r->fd);
+}
+
+static struct backend backends[] =
+{
+	{ "async", async_open, async_read, async_write, async_flush,
+		async_close },
+	{ "direct", direct_open, direct_read, direct_write, fd_flush,
+		direct_close },
+	{ "libomfs", dev_open, dev_read, dev_write, dev_flush, dev_close }
+};
+
+/* LRU block cache; only single block accesses go through it */
+
+static int cache_init(struct replay *r)
+{
+	int i, hsize = 1;
+
+	if (!r->cache_size)
+		return 0;
+
+	while (hsize < r->cache_size * 2)
+		hsize <<= 1;
+	r->hash_mask = hsize - 1;
+	r->hash = calloc(hsize, sizeof(*r->hash));
+	r->entries = calloc(r->cache_size, sizeof(*r->entries));
+	if (!r->hash || !r->entries)
+		return -ENOMEM;
+	for (i=0; i < r->cache_size; i++)
+		if (!(r->entries[i].data = malloc(r->blocksize)))
+			return -ENOMEM;
+	return 0;
+}
+
+static struct cache_entry **cache_slot(struct replay *r, u64 block)
+{
+	struct cache_entry **p = &r->hash[(block * 0x9e3779b97f4a7c15ULL >>
+		32) & r->hash_mask];
+
+	while (*p && (*p)->block != block)
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void lru_unlink(struct replay *r, struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		r->lru = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		r->lru_tail = e->prev;
+}
+
+static void lru_push(struct replay *r, struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = r->lru;
+	if (r->lru)
+		r->lru->prev = e;
+	else
+		r->lru_tail = e;
+	r->lru = e;
+}
+
+static struct cache_entry *cache_lookup(struct replay *r, u64 block)
+{
+	struct cache_entry *e = *cache_slot(r, block);
+
+	if (e)
+	{
+		lru_unlink(r, e);
+		lru_push(r, e);
+	}
+	return e;
+}
+
+static struct cache_entry *cache_insert(struct replay *r, u64 block)
+{
+	struct cache_entry *e;
+
+	if (r->cached < r->cache_size)
+		e = &r->entries[r->cached++];
+	else
+	{
+		e = r->lru_tail;
+		lru_unlink(r, e);
+		*cache_slot(r, e->block) = e->hnext;
+	}
+	e->block = block;
+	e->hnext = NULL;
+	*cache_slot(r, block) = e;
+	lru_push(r, e);
+	return e;
+}
+
+static void cache_drop(struct replay *r, u64 block)
+{
+	struct cache_entry **p = cache_slot(r, block);
+	struct cache_entry *e = *p;
+
+	if (!e)
+		return;
+	*p = e->hnext;
+	lru_unlink(r, e);
+
+	// move the last used entry into the hole to keep them packed
+	r->cached--;
+	if (e != &r->entries[r->cached])
+	{
+		struct cache_entry *last = &r->entries[r->cached];
+		u8 *data = e->data;
+
+		*cache_slot(r, last->block) = e;
+		e->block = last->block;
+		e->hnext = last->hnext;
+		e->data = last->data;
+		last->data = data;
+		e->prev = last->prev;
+		e->next = last->next;
+		if (e->prev)
+			e->prev->next = e;
+		else
+			r->lru = e;
+		if (e->next)
+			e->next->prev = e;
+		else
+			r->lru_tail = e;
+	}
+}
+
+static int replay_read(struct replay *r, u64 block, u8 *buf, size_t len)
+{
+	struct cache_entry *e;
+	int ret;
+
+	if (!r->cache_size || len > r->blocksize)
+	{
+		r->backend_bytes += len;
+		return r->be->read(r, block * r->blocksize, buf, len);
+	}
+	if ((e = cache_lookup(r, block)))
+	{
+		r->hits++;
+		memcpy(buf, e->data, len);
+		return 0;
+	}
+	r->misses++;
+	r->backend_bytes += len;
+	if ((ret = r->be->read(r, block * r->blocksize, buf, len)))
+		return ret;
+	e = cache_insert(r, block);
+	memcpy(e->data, buf, len);
+	return 0;
+}
+
+static int replay_write(struct replay *r, u64 block, u8 *buf, size_t len)
+{
+	struct cache_entry *e;
+	u64 i;
+
+	if (!r->writes)
+	{
+		r->skipped++;
+		return 0;
+	}
+	if (r->cache_size)
+	{
+		if (len <= r->blocksize && (e = cache_lookup(r, block)))
+			memcpy(e->data, buf, len);
+		else
+			for (i=0; i * r->blocksize < len; i++)
+				cache_drop(r, block + i);
+	}
+	r->backend_bytes += len;
+	return r->be->write(r, block * r->blocksize, buf, len);
+}
+
+static double seconds(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static struct omfs_trace_record *load_trace(char *path,
+		struct omfs_trace_header *hdr, u64 *count)
+{
+	struct omfs_trace_record *recs = NULL;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		return NULL;
+
+	if (fread(hdr, sizeof(*hdr), 1, fp) != 1 ||
+	    memcmp(hdr->t_magic, OMFS_TRACE_MAGIC, sizeof(hdr->t_magic)) ||
+	    !hdr->t_blocksize)
+	{
+		errno = EINVAL;
+		goto out;
+	}
+	*count = swap_be64(hdr->t_count);
+	if (!(recs = malloc(*count * sizeof(*recs) + 1)))
+		goto out;
+	if (fread(recs, sizeof(*recs), *count, fp) != *count)
+	{
+		free(recs);
+		recs = NULL;
+		errno = EIO;
+	}
+out:
+	fclose(fp);
+	return recs;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay r;
+	struct omfs_trace_header hdr;
+	struct omfs_trace_record *recs;
+	struct timespec start, end, now;
+	char *backend = "pread";
+	int pace = 0;
+	u64 i, count, ops = 0, max_len = 0;
+	u8 *buf;
+	double secs;
+	int ret = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.depth = 16;
+
+	while (1)
+	{
+		int c;
+
+		c = getopt(argc, argv, "b:c:d:pw");
+		if (c == -1)
+			break;
+
+		switch(c)
+		{
+			case 'b':
+				backend = optarg;
+				break;
+			case 'c':
+				r.cache_size = atoi(optarg);
+				break;
+			case 'd':
+				r.depth = atoi(optarg);
+				break;
+			case 'p':
+				pace = 1;
+				break;
+			case 'w':
+				r.writes = 1;
+				break;
+		}
+	}
+
+	if (argc - optind < 2 || r.depth < 1 || r.cache_size < 0)
+	{
+		fprintf(stderr, "Usage: %s [-b stdio|pread|mmap|ram|async|"
+			"direct] [-c cache blocks] [-d depth] [-p] [-w] <trace> "
+			"<image>\n", argv[0]);
+		exit(1);
+	}
+
+	// anything but async and direct is up to omfs_dev_open
+	for (r.be = backends; r.be->open != dev_open; r.be++)
+		if (!strcmp(r.be->name, backend))
+			break;
+	r.be_name = backend;
+
+	// queued reads aren't there yet to be cached
+	if (r.be->read == async_read && r.cache_size)
+	{
+		fprintf(stderr, "omfsreplay: -c doesn't work with async\n");
+		exit(1);
+	}
+
+	if (!(recs = load_trace(argv[optind], &hdr, &count)))
+	{
+		fprintf(stderr, "omfsreplay: %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(2);
+	}
+	r.blocksize = swap_be32(hdr.t_blocksize);
+
+	for (i=0; i < count; i++)
+		if (swap_be32(recs[i].t_len) > max_len)
+			max_len = swap_be32(recs[i].t_len);
+	buf = calloc(1, max_len + 1);
+
+	if (!buf || (ret = cache_init(&r)) ||
+	    (ret = r.be->open(&r, argv[optind + 1])))
+	{
+		fprintf(stderr, "omfsreplay: %s: %s\n", argv[optind + 1],
+			strerror(ret ? -ret : ENOMEM));
+		exit(2);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i < count && !ret; i++)
+	{
+		struct omfs_trace_record *rec = &recs[i];
+		u64 block = swap_be64(rec->t_block);
+		size_t len = swap_be32(rec->t_len);
+
+		if (pace)
+		{
+			u64 due = swap_be64(rec->t_ns);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			secs = due / 1e9 - seconds(&start, &now);
+			if (secs > 0)
+			{
+				struct timespec ts = { secs,
+					(secs - (long) secs) * 1e9 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		switch (rec->t_op)
+		{
+		case OMFS_TRACE_READ:
+			ret = replay_read(&r, block, buf, len);
+			break;
+		case OMFS_TRACE_WRITE:
+			ret = replay_write(&r, block, buf, len);
+			break;
+		case OMFS_TRACE_FLUSH:
+			if (r.writes)
+				ret = r.be->flush(&r);
+			break;
+		}
+		ops++;
+	}
+	r.be->close(&r);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (ret)
+		fprintf(stderr, "omfsreplay: op %" PRIu64 ": %s\n", i - 1,
+			strerror(-ret));
+
+	secs = seconds(&start, &end);
+	printf("backend %s, cache %d blocks%s\n", r.be_name, r.cache_size,
+		pace ? ", paced" : "");
+	printf("%" PRIu64 " ops in %.3f s, %.0f ops/s\n", ops, secs,
+		secs > 0 ? ops / secs : 0);
+	printf("%" PRIu64 " bytes from the backend, %.1f MB/s\n",
+		r.backend_bytes, secs > 0 ? r.backend_bytes / secs / 1e6 : 0);
+	if (r.cache_size)
+		printf("cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+			"%.1f%% hit rate\n", r.hits, r.misses,
+			r.hits + r.misses ?
+			100.0 * r.hits / (r.hits + r.misses) : 0);
+	if (r.skipped)
+		printf("%" PRIu64 " writes skipped (use -w)\n", r.skipped);
+
+	free(buf);
+	free(recs);
+	return ret ? 3 : 0;
+}
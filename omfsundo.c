@@ -0,0 +1,60 @@
+/*
+ *  omfsundo.c - Roll back the changes recorded in an undo file.
+ *
+ *  Licensed under GPL version 2 or later.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "omfs.h"
+
+int main(int argc, char *argv[])
+{
+	omfs_dev_t *fp = NULL;
+	int list = 0;
+	int ret;
+
+	while (1) 
+	{
+		int c;
+
+		c = getopt(argc, argv, "l");
+		if (c == -1)
+			break;
+
+		switch(c)
+		{
+			case 'l':
+				list = 1;
+				break;
+		}
+	}
+
+	if (argc - optind < 1 + !list)
+	{
+		fprintf(stderr, "Usage: %s [-l] <undo file> [device]\n", argv[0]);
+		exit(1);
+	}
+
+	if (!list)
+	{
+		fp = omfs_dev_open(argv[optind + 1], 1, NULL);
+		if (!fp)
+		{
+			perror("omfsundo: ");
+			exit(2);
+		}
+	}
+
+	ret = omfs_undo_replay(fp, argv[optind], list);
+	omfs_dev_close(fp);
+
+	if (ret)
+	{
+		fprintf(stderr, "omfsundo: %s: %s\n", argv[optind], 
+			strerror(-ret));
+		exit(3);
+	}
+	return 0;
+}
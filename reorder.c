@@ -0,0 +1,417 @@
+/*
+ *  Reorder directory hash chains for faster lookups.
+ *
+ *  The bucket count is fixed, so a lookup in a big directory walks a
+ *  sibling chain one inode read at a time.  Relinking each chain in
+ *  ascending block order turns that walk into a forward sweep, and
+ *  with relocation, file inodes are also moved to free blocks nearer
+ *  their directory so the sweep is short.  Directories stay where
+ *  they are; moving one would mean rewriting all its children too.
+ *
+ *  The tree is scanned first, and a scan that hits unreadable inodes
+ *  or loops stops the run before anything is staged.  Everything is
+ *  then staged in one transaction and written at the end, in block
+ *  order with one flush: stopping before the commit changes nothing,
+ *  but the commit itself isn't atomic, and a crash part way through
+ *  leaves some blocks old and some new.  The undo file (-u) is synced
+ *  before the first of them is written, and puts them all back.
+ *  Chains that don't look right are left alone for omfsck.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "bits.h"
+#include "dirscan.h"
+#include "reorder.h"
+
+struct chain_entry
+{
+	u64 block;
+	int is_file;
+};
+
+struct reorder_ctx
+{
+	omfs_info_t *info;
+	reorder_config_t *config;
+	int mirrors;
+	u64 *dirs;		/* directories to do */
+	u64 num_dirs;
+	u64 dirs_size;
+	struct chain_entry *chain;
+	u64 chain_size;
+	u8 *seen;		/* blocks in the chain being walked */
+
+	u64 chains;
+	u64 reordered;
+	u64 rewritten;
+	u64 moved;
+	u64 skipped;
+	u64 links;
+	u64 dist_before;
+	u64 dist_after;
+};
+
+static u64 distance(u64 a, u64 b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static int collect_dir(dirscan_t *d, dirscan_entry_t *entry, void *user)
+{
+	struct reorder_ctx *ctx = user;
+	u64 *dirs;
+
+	if (entry->inode->i_type != OMFS_DIR)
+		return 0;
+
+	if (ctx->num_dirs == ctx->dirs_size)
+	{
+		ctx->dirs_size = ctx->dirs_size ? ctx->dirs_size * 2 : 256;
+		dirs = realloc(ctx->dirs, ctx->dirs_size * sizeof(u64));
+		if (!dirs)
+		{
+			d->stop = 1;
+			return -1;
+		}
+		ctx->dirs = dirs;
+	}
+	ctx->dirs[ctx->num_dirs++] = entry->block;
+	return 0;
+}
+
+static int valid_inode(omfs_inode_t *inode, u64 block)
+{
+	return inode->i_head.h_magic == OMFS_IMAGIC &&
+		swap_be64(inode->i_head.h_self) == block;
+}
+
+/*
+ *  Read the chain starting at head into ctx->chain.  Returns its
+ *  length, or -1 if it loops or holds an unreadable inode.
+ */
+static s64 walk_chain(struct reorder_ctx *ctx, u64 head)
+{
+	struct chain_entry *chain;
+	omfs_inode_t *inode;
+	u64 next = head, num_blocks = swap_be64(ctx->info->super->s_num_blocks);
+	s64 n = 0, i;
+
+	while (next != ~0ULL)
+	{
+		if (next >= num_blocks || test_bit(ctx->seen, next))
+			goto bad;
+
+		inode = omfs_get_inode(ctx->info, next);
+		if (!inode)
+			goto bad;
+		if (!valid_inode(inode, next))
+		{
+			omfs_release_inode(inode);
+			goto bad;
+		}
+
+		if (n == ctx->chain_size)
+		{
+			ctx->chain_size = ctx->chain_size ?
+				ctx->chain_size * 2 : 64;
+			chain = realloc(ctx->chain, ctx->chain_size *
+				sizeof(*chain));
+			if (!chain)
+			{
+				omfs_release_inode(inode);
+				goto bad;
+			}
+			ctx->chain = chain;
+		}
+		set_bit(ctx->seen, next);
+		ctx->chain[n].block = next;
+		ctx->chain[n].is_file = inode->i_type == OMFS_FILE;
+		n++;
+
+		next = swap_be64(inode->i_sibling);
+		omfs_release_inode(inode);
+	}
+	for (i = 0; i < n; i++)
+		clear_bit(ctx->seen, ctx->chain[i].block);
+	return n;
+bad:
+	for (i = 0; i < n; i++)
+		clear_bit(ctx->seen, ctx->chain[i].block);
+	return -1;
+}
+
+static u64 chain_distance(u64 dir, struct chain_entry *chain, s64 n)
+{
+	u64 dist = distance(dir, chain[0].block);
+	s64 i;
+
+	for (i = 1; i < n; i++)
+		dist += distance(chain[i - 1].block, chain[i].block);
+	return dist;
+}
+
+static int by_block(const void *a, const void *b)
+{
+	u64 x = ((struct chain_entry *) a)->block;
+	u64 y = ((struct chain_entry *) b)->block;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ *  Copy a file inode to free blocks nearer dir, if there are any, and
+ *  free the old ones.  Its sibling pointer is fixed up by the relink.
+ */
+static int move_inode(struct reorder_ctx *ctx, u64 dir,
+	struct chain_entry *ce)
+{
+	omfs_info_t *info = ctx->info;
+	omfs_inode_t *inode;
+	u64 dist = distance(dir, ce->block), limit, block;
+	int ret;
+
+	if (dist <= ctx->mirrors)
+		return 0;
+	limit = dist - 1;
+	if (limit > ctx->config->max_dist)
+		limit = ctx->config->max_dist;
+	if (omfs_allocate_near(info, dir, ctx->mirrors, limit, &block))
+		return 0;
+
+	inode = omfs_get_inode(info, ce->block);
+	if (!inode)
+		return -EIO;
+	inode->i_head.h_self = swap_be64(block);
+	ret = omfs_write_inode(info, inode);
+	omfs_release_inode(inode);
+	if (ret)
+		return ret;
+
+	omfs_clear_range(info, ce->block, ctx->mirrors);
+	ce->block = block;
+	ctx->moved++;
+	return 1;
+}
+
+static int reorder_dir(struct reorder_ctx *ctx, u64 dir)
+{
+	omfs_info_t *info = ctx->info;
+	omfs_inode_t *dir_inode, *inode;
+	u64 *heads, want;
+	s64 n, i;
+	int b, buckets, moved, ret = 0, dirty = 0;
+
+	dir_inode = omfs_get_inode(info, dir);
+	if (!dir_inode)
+		return -EIO;
+	if (!valid_inode(dir_inode, dir) || dir_inode->i_type != OMFS_DIR)
+	{
+		ctx->skipped++;
+		goto out;
+	}
+
+	buckets = (swap_be32(info->super->s_sys_blocksize) -
+		OMFS_DIR_START) / 8;
+	heads = (u64 *) ((u8 *) dir_inode + OMFS_DIR_START);
+
+	for (b = 0; b < buckets && !ret; b++)
+	{
+		n = walk_chain(ctx, swap_be64(heads[b]));
+		if (n < 0)
+		{
+			ctx->skipped++;
+			continue;
+		}
+		if (!n)
+			continue;
+
+		ctx->chains++;
+		ctx->links += n;
+		ctx->dist_before += chain_distance(dir, ctx->chain, n);
+
+		moved = 0;
+		for (i = 0; i < n && ctx->config->relocate; i++)
+		{
+			if (!ctx->chain[i].is_file)
+				continue;
+			ret = move_inode(ctx, dir, &ctx->chain[i]);
+			if (ret < 0)
+				break;
+			moved |= ret;
+			ret = 0;
+		}
+
+		for (i = 1; i < n && !moved; i++)
+			if (ctx->chain[i - 1].block > ctx->chain[i].block)
+				break;
+		if (!moved && i == n)
+		{
+			ctx->dist_after += chain_distance(dir, ctx->chain, n);
+			continue;
+		}
+
+		qsort(ctx->chain, n, sizeof(*ctx->chain), by_block);
+		ctx->reordered++;
+		ctx->dist_after += chain_distance(dir, ctx->chain, n);
+
+		heads[b] = swap_be64(ctx->chain[0].block);
+		dirty = 1;
+		for (i = 0; i < n && !ret; i++)
+		{
+			inode = omfs_get_inode(info, ctx->chain[i].block);
+			if (!inode)
+			{
+				ret = -EIO;
+				break;
+			}
+			want = i + 1 < n ? ctx->chain[i + 1].block : ~0ULL;
+			if (inode->i_sibling != swap_be64(want))
+			{
+				inode->i_sibling = swap_be64(want);
+				ret = omfs_write_inode(info, inode);
+				ctx->rewritten++;
+			}
+			omfs_release_inode(inode);
+		}
+	}
+
+	if (dirty && !ret)
+	{
+		ret = omfs_write_inode(info, dir_inode);
+		ctx->rewritten++;
+	}
+out:
+	omfs_release_inode(dir_inode);
+	return ret;
+}
+
+static void print_summary(struct reorder_ctx *ctx)
+{
+	printf("Directories: %" PRIu64 "\n", ctx->num_dirs);
+	printf("Chains: %" PRIu64 ", %" PRIu64 " reordered, %" PRIu64
+		" skipped\n", ctx->chains, ctx->reordered, ctx->skipped);
+	printf("Inodes rewritten: %" PRIu64 ", moved: %" PRIu64 "\n",
+		ctx->rewritten, ctx->moved);
+	if (ctx->links)
+		printf("Mean blocks between chain links: %.1f before, "
+			"%.1f after\n", (double) ctx->dist_before / ctx->links,
+			(double) ctx->dist_after / ctx->links);
+}
+
+static int run_reorder(struct reorder_ctx *ctx)
+{
+	omfs_info_t *info = ctx->info;
+	reorder_config_t *config = ctx->config;
+	struct layout_stats layout;
+	u64 i;
+	int ret, err;
+
+	if (omfs_read_super(info) || omfs_read_root_block(info))
+	{
+		fprintf(stderr, "omfsreorder: not an OMFS filesystem\n");
+		return 0;
+	}
+	if ((ret = omfs_load_bitmap(info)))
+	{
+		fprintf(stderr, "omfsreorder: could not load bitmap: %s\n",
+			strerror(-ret));
+		return 0;
+	}
+	ctx->mirrors = swap_be32(info->super->s_mirrors);
+	ctx->seen = calloc(1, (swap_be64(info->super->s_num_blocks) + 7) / 8);
+	if (!ctx->seen)
+		return 0;
+
+	if (!config->layout && dirscan_begin(info, collect_dir, ctx) != 1)
+	{
+		fprintf(stderr, "omfsreorder: directory scan failed; "
+			"run omfsck first\n");
+		return 0;
+	}
+
+	if ((ret = omfs_trans_begin(info)))
+		goto out;
+	if (config->layout)
+		ret = layout_fs(info, config, &layout);
+	for (i = 0; i < ctx->num_dirs && !ret; i++)
+		ret = reorder_dir(ctx, ctx->dirs[i]);
+
+	/* nothing is written before the commit, so no undo file before */
+	if (!ret && !config->dry_run && config->undo_file &&
+	    (ret = omfs_undo_open(info, config->undo_file)))
+	{
+		fprintf(stderr, "omfsreorder: %s: %s\n", config->undo_file,
+			strerror(-ret));
+		omfs_trans_abort(info);
+		return 0;
+	}
+
+	if (ret || config->dry_run)
+		omfs_trans_abort(info);
+	else
+		ret = omfs_trans_commit(info);
+out:
+	if (ret)
+		fprintf(stderr, "omfsreorder: %s; nothing was changed%s\n",
+			strerror(-ret), ret == -EUCLEAN ?
+			"; run omfsck first" : "");
+	else
+	{
+		if (config->layout)
+			layout_print(&layout);
+		else
+			print_summary(ctx);
+		if (config->dry_run)
+			printf("Dry run; nothing was written\n");
+	}
+
+	if (info->undo && (err = omfs_undo_close(info)))
+	{
+		fprintf(stderr, "omfsreorder: %s: %s\n", config->undo_file,
+			strerror(-err));
+		ret = err;
+	}
+	return !ret;
+}
+
+int reorder_fs(omfs_dev_t *dev, reorder_config_t *config)
+{
+	int res;
+	omfs_super_t super;
+	omfs_root_t root;
+	struct reorder_ctx ctx;
+	omfs_info_t info = {
+		.dev = dev,
+		.super = &super,
+		.root = &root
+	};
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.info = &info;
+	ctx.config = config;
+
+	res = run_reorder(&ctx);
+
+	if (config->verbose)
+	{
+		struct omfs_stats stats;
+
+		omfs_get_stats(&info, &stats);
+		putchar('\n');
+		omfs_print_stats(stdout, &stats);
+	}
+
+	if (info.bitmap)
+	{
+		free(info.bitmap->bmap);
+		free(info.bitmap->dirty);
+		free(info.bitmap);
+	}
+	free(ctx.dirs);
+	free(ctx.chain);
+	free(ctx.seen);
+	return res;
+}
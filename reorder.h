@@ -0,0 +1,33 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include "omfs.h"
+
+typedef struct _reorder_config
+{
+	int relocate;		/* move file inodes nearer their directory */
+	int layout;		/* lay out all metadata in scan order */
+	u64 max_dist;		/* ...but no further than this from it */
+	int dry_run;		/* work it all out, then throw it away */
+	char *undo_file;	/* save overwritten blocks here */
+	int verbose;		/* print I/O stats at the end */
+} reorder_config_t;
+
+struct layout_stats
+{
+	u64 blocks;		/* inodes and continuation blocks */
+	u64 moved;
+	u64 rewritten;
+	u64 reclaimed;		/* free in the rebuilt bitmap, not before */
+	u64 dist_before;	/* blocks seeked over by a scan */
+	u64 dist_after;
+};
+
+int reorder_fs(omfs_dev_t *dev, reorder_config_t *config);
+
+/* layout.c */
+int layout_fs(omfs_info_t *info, reorder_config_t *config,
+	struct layout_stats *stats);
+void layout_print(struct layout_stats *stats);
+
+#endif
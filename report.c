@@ -0,0 +1,337 @@
+/*
+ *  report.c - machine readable summary of an omfsck run: how long
+ *  each phase took, how much was read and what was found.  Written
+ *  as JSON, or in the Prometheus textfile collector format.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "omfs.h"
+#include "check.h"
+#include "report.h"
+
+static char *phase_names[] = 
+{
+	"superblock",
+	"bitmap_load",
+	"traversal",
+	"extents",
+	"bitmap_compare",
+	"repair"
+};
+
+/* check_error_t, for scripts; keep in order */
+static char *error_names[] = 
+{
+	"none",
+	"header_xor",
+	"header_crc",
+	"bit_set",
+	"bit_clear",
+	"bitmap",
+	"hash_wrong",
+	"blocksize",
+	"sys_blocksize",
+	"mirrors",
+	"extent_count",
+	"terminator",
+	"magic",
+	"file_magic",
+	"self_ptr",
+	"parent_ptr",
+	"read_super",
+	"read_root",
+	"insane",
+	"scan",
+	"loop",
+	"device_size",
+	"root_block",
+	"root_checksum",
+	"root_mirror",
+	"root_dir",
+	"bitmap_reserved",
+	"unreadable"
+};
+
+#define NUM_ERRORS (sizeof(error_names) / sizeof(error_names[0]))
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + 
+		(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void phase_begin(check_stats_t *stats, check_phase_t phase)
+{
+	struct phase_time *p = &stats->phase[phase];
+
+	if (!stats->timed)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &p->wall_start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &p->cpu_start);
+}
+
+void phase_end(check_stats_t *stats, check_phase_t phase)
+{
+	struct phase_time *p = &stats->phase[phase];
+	struct timespec now;
+
+	if (!stats->timed)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	p->wall += elapsed(&p->wall_start, &now);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	p->cpu += elapsed(&p->cpu_start, &now);
+}
+
+static char *error_name(u32 error)
+{
+	return error < NUM_ERRORS ? error_names[error] : "unknown";
+}
+
+/* the device path, made safe for a JSON or label string */
+static void print_quoted(FILE *fp, char *s)
+{
+	fputc('"', fp);
+	for (; s && *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/* what's been read so far; blocks are the bytes rounded up */
+static void read_totals(omfs_info_t *info, u64 *bytes, u64 *blocks)
+{
+	struct omfs_stats st;
+	u32 blocksize = swap_be32(info->super->s_blocksize);
+
+	omfs_get_stats(info, &st);
+	*bytes = omfs_stats_bytes(&st, 0);
+	*blocks = blocksize ? (*bytes + blocksize - 1) / blocksize : 0;
+}
+
+static void write_json(FILE *fp, check_context_t *ctx, struct phase_time *t,
+		int result)
+{
+	check_stats_t *stats = &ctx->stats;
+	omfs_info_t *info = ctx->omfs_info;
+	double walk = t[PHASE_TRAVERSAL].wall + t[PHASE_EXTENTS].wall;
+	u64 bytes, blocks;
+	int i;
+
+	read_totals(info, &bytes, &blocks);
+	fprintf(fp, "{\n  \"device\": ");
+	print_quoted(fp, ctx->config->device);
+	fprintf(fp, ",\n  \"level\": %d,\n", ctx->config->level);
+	fprintf(fp, "  \"result\": \"%s\",\n", 
+		ctx->config->stopped ? "stopped" : 
+		!result ? "failed" : 
+		ctx->config->changed ? "repaired" : "clean");
+
+	fprintf(fp, "  \"phases\": {\n");
+	for (i=0; i < NUM_PHASES; i++)
+		fprintf(fp, "    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }%s\n",
+			phase_names[i], t[i].wall, t[i].cpu,
+			i < NUM_PHASES - 1 ? "," : "");
+	fprintf(fp, "  },\n");
+
+	fprintf(fp, "  \"inodes\": %" PRIu64 ",\n", stats->inodes);
+	fprintf(fp, "  \"inodes_per_sec\": %.1f,\n", 
+		walk > 0 ? stats->inodes / walk : 0);
+	fprintf(fp, "  \"blocks_read\": %" PRIu64 ",\n", blocks);
+	fprintf(fp, "  \"bytes_read\": %" PRIu64 ",\n", bytes);
+
+	fprintf(fp, "  \"findings\": [");
+	for (i=0; i < ctx->num_findings; i++)
+	{
+		struct finding *f = &ctx->findings[i];
+		fprintf(fp, "%s\n    { \"code\": %u, \"error\": \"%s\", "
+			"\"block\": %" PRIu64 ", \"parent\": %" PRId64 ", "
+			"\"hash\": %d }", i ? "," : "", f->error, 
+			error_name(f->error), f->block, (s64) f->parent, 
+			f->hash);
+	}
+	fprintf(fp, "%s]\n}\n", ctx->num_findings ? "\n  " : "");
+}
+
+static void prom_head(FILE *fp, char *name, char *help)
+{
+	fprintf(fp, "# HELP omfsck_%s %s\n", name, help);
+	fprintf(fp, "# TYPE omfsck_%s gauge\n", name);
+}
+
+static void prom_label(FILE *fp, char *name, check_context_t *ctx)
+{
+	fprintf(fp, "omfsck_%s{device=", name);
+	print_quoted(fp, ctx->config->device);
+}
+
+static void write_prom(FILE *fp, check_context_t *ctx, struct phase_time *t,
+		int result)
+{
+	check_stats_t *stats = &ctx->stats;
+	omfs_info_t *info = ctx->omfs_info;
+	double walk = t[PHASE_TRAVERSAL].wall + t[PHASE_EXTENTS].wall;
+	int counts[NUM_ERRORS];
+	u64 bytes, blocks;
+	int i;
+
+	read_totals(info, &bytes, &blocks);
+
+	prom_head(fp, "phase_wall_seconds", "Wall time spent in each phase.");
+	for (i=0; i < NUM_PHASES; i++)
+	{
+		prom_label(fp, "phase_wall_seconds", ctx);
+		fprintf(fp, ",phase=\"%s\"} %.6f\n", phase_names[i], 
+			t[i].wall);
+	}
+	prom_head(fp, "phase_cpu_seconds", "CPU time spent in each phase.");
+	for (i=0; i < NUM_PHASES; i++)
+	{
+		prom_label(fp, "phase_cpu_seconds", ctx);
+		fprintf(fp, ",phase=\"%s\"} %.6f\n", phase_names[i], 
+			t[i].cpu);
+	}
+
+	prom_head(fp, "inodes", "Inodes visited.");
+	prom_label(fp, "inodes", ctx);
+	fprintf(fp, "} %" PRIu64 "\n", stats->inodes);
+	prom_head(fp, "inodes_per_second", "Inodes visited per second.");
+	prom_label(fp, "inodes_per_second", ctx);
+	fprintf(fp, "} %.1f\n", walk > 0 ? stats->inodes / walk : 0);
+	prom_head(fp, "blocks_read", "Blocks read from the device.");
+	prom_label(fp, "blocks_read", ctx);
+	fprintf(fp, "} %" PRIu64 "\n", blocks);
+	prom_head(fp, "bytes_read", "Bytes read from the device.");
+	prom_label(fp, "bytes_read", ctx);
+	fprintf(fp, "} %" PRIu64 "\n", bytes);
+
+	memset(counts, 0, sizeof(counts));
+	for (i=0; i < ctx->num_findings; i++)
+		if (ctx->findings[i].error < NUM_ERRORS)
+			counts[ctx->findings[i].error]++;
+	prom_head(fp, "findings", "Problems found, by kind.");
+	for (i=1; i < NUM_ERRORS; i++)
+	{
+		if (!counts[i])
+			continue;
+		prom_label(fp, "findings", ctx);
+		fprintf(fp, ",error=\"%s\",code=\"%d\"} %d\n", error_names[i], 
+			i, counts[i]);
+	}
+
+	prom_head(fp, "clean", "1 if the check finished and found nothing "
+		"left to fix.");
+	prom_label(fp, "clean", ctx);
+	fprintf(fp, "} %d\n", result && !ctx->config->stopped);
+}
+
+/*
+ *  Write the report for a finished (or stopped) run to the configured
+ *  file, or stdout.
+ */
+int report_write(check_context_t *ctx, int result)
+{
+	check_fs_config_t *config = ctx->config;
+	struct phase_time t[NUM_PHASES];
+	FILE *fp = stdout;
+	int ret = 0;
+
+	/* traversal is timed around extent marking, take that out */
+	memcpy(t, ctx->stats.phase, sizeof(t));
+	t[PHASE_TRAVERSAL].wall -= t[PHASE_EXTENTS].wall;
+	t[PHASE_TRAVERSAL].cpu -= t[PHASE_EXTENTS].cpu;
+	if (t[PHASE_TRAVERSAL].wall < 0)
+		t[PHASE_TRAVERSAL].wall = 0;
+	if (t[PHASE_TRAVERSAL].cpu < 0)
+		t[PHASE_TRAVERSAL].cpu = 0;
+
+	if (config->report_file)
+	{
+		fp = fopen(config->report_file, "w");
+		if (!fp)
+			return -errno;
+	}
+
+	if (config->report == REPORT_JSON)
+		write_json(fp, ctx, t, result);
+	else
+		write_prom(fp, ctx, t, result);
+
+	if (fp != stdout && fclose(fp))
+		ret = -EIO;
+	return ret;
+}
+
+/*
+ *  Progress, for -C fd.  Each update is one line:
+ *
+ *	phase inodes blocks_read in_use eta_seconds
+ *
+ *  in_use is the number of blocks in use according to the bitmap.
+ *  Only metadata is read, so it's an upper bound and the ETA errs on
+ *  the long side; both are 0 and -1 when there's no estimate.  On fd
+ *  0 a one line summary is drawn on the terminal instead.
+ */
+#define PROGRESS_INTERVAL 0.5	/* seconds */
+#define PROGRESS_CHECK 64	/* inodes between looks at the clock */
+
+void progress_update(check_context_t *ctx, check_phase_t phase, int force)
+{
+	check_stats_t *stats = &ctx->stats;
+	u64 bytes, blocks;
+	int fd = ctx->config->progress_fd;
+	struct timespec now;
+	double eta = -1, spent;
+	char line[160];
+	int len;
+
+	if (fd < 0 || (!force && stats->inodes % PROGRESS_CHECK))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!force && elapsed(&stats->last_progress, &now) < PROGRESS_INTERVAL)
+		return;
+	stats->last_progress = now;
+	read_totals(ctx->omfs_info, &bytes, &blocks);
+
+	spent = elapsed(&stats->start, &now);
+	if (stats->in_use && blocks)
+		eta = blocks < stats->in_use ? 
+			spent * (stats->in_use - blocks) / blocks : 0;
+
+	if (fd == 0)
+	{
+		len = snprintf(line, sizeof(line), "%-14s %" PRIu64 
+			" inodes, %" PRIu64 "/%" PRIu64 " blocks", 
+			phase_names[phase], stats->inodes, blocks, 
+			stats->in_use);
+		if (eta >= 0)
+			len += snprintf(line + len, sizeof(line) - len, 
+				", about %d:%02d left", (int) eta / 60, 
+				(int) eta % 60);
+		printf("\r%-72s", line);
+		fflush(stdout);
+		return;
+	}
+	len = snprintf(line, sizeof(line), "%s %" PRIu64 " %" PRIu64 " %" 
+		PRIu64 " %d\n", phase_names[phase], stats->inodes, blocks,
+		stats->in_use, (int) eta);
+	if (write(fd, line, len) < 0)
+		ctx->config->progress_fd = -1;
+}
+
+/* end the terminal progress line */
+void progress_done(check_context_t *ctx)
+{
+	if (ctx->config->progress_fd == 0 && ctx->stats.last_progress.tv_sec)
+		fputc('\n', stdout);
+}
@@ -0,0 +1,52 @@
+#ifndef _REPORT_H
+#define _REPORT_H
+
+#include <time.h>
+#include "config.h"
+
+typedef enum
+{
+	REPORT_NONE,
+	REPORT_JSON,
+	REPORT_PROM		/* Prometheus textfile collector format */
+} report_format_t;
+
+typedef enum
+{
+	PHASE_SUPER,
+	PHASE_BITMAP_LOAD,
+	PHASE_TRAVERSAL,	/* not counting extents, below */
+	PHASE_EXTENTS,
+	PHASE_BITMAP_COMPARE,
+	PHASE_REPAIR,
+	NUM_PHASES
+} check_phase_t;
+
+struct phase_time
+{
+	double wall;		/* seconds */
+	double cpu;
+	struct timespec wall_start;
+	struct timespec cpu_start;
+};
+
+typedef struct check_stats
+{
+	int timed;		/* phases are only timed for a report */
+	struct phase_time phase[NUM_PHASES];
+	u64 inodes;		/* visited */
+	u64 in_use;		/* blocks, from the bitmap, or 0 */
+	struct timespec start;
+	struct timespec last_progress;
+} check_stats_t;
+
+struct check_context;
+
+void phase_begin(check_stats_t *stats, check_phase_t phase);
+void phase_end(check_stats_t *stats, check_phase_t phase);
+int report_write(struct check_context *ctx, int result);
+void progress_update(struct check_context *ctx, check_phase_t phase, 
+		int force);
+void progress_done(struct check_context *ctx);
+
+#endif
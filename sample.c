@@ -0,0 +1,199 @@
+/*
+ *  sample.c - estimate the corruption rate of a filesystem by checking
+ *  a random sample of its metadata blocks.
+ *
+ *  Candidates are drawn uniformly from the blocks the free space
+ *  bitmap marks in use, past the reserved area, so every allocated
+ *  block is as likely to be picked as any other whatever state the
+ *  tree is in.  Each one is read and classified by its header: blocks
+ *  without the inode magic are file data and are passed over, the
+ *  rest make up the sample and are checked against their own header
+ *  and, for inodes, their parent directory.  Reaching an inode through
+ *  a hash chain isn't checked; that takes the full scan.
+ *
+ *  The cost is one read of the bitmap, plus a read or two per block
+ *  drawn; how many draws a sample takes depends on the share of the
+ *  blocks in use that hold metadata, not on the size of the
+ *  filesystem.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "omfs.h"
+#include "check.h"
+#include "fix.h"
+#include "bits.h"
+
+/* give up on finding metadata after this many data blocks per sample */
+#define MAX_DATA_DRAWS 64
+
+static u64 rand64(void)
+{
+	return ((u64) random() << 31) ^ random();
+}
+
+/* first block past the super, root and bitmap blocks */
+static u64 first_unreserved(omfs_info_t *info)
+{
+	u64 bsize = (swap_be64(info->super->s_num_blocks) + 7) / 8;
+	u32 blocksize = swap_be32(info->super->s_blocksize);
+
+	return swap_be64(info->root->r_bitmap) +
+		(bsize + blocksize - 1) / blocksize;
+}
+
+/* a block in use at or past first, each equally likely */
+static u64 draw_block(u8 *bmap, u64 first, u64 num_blocks)
+{
+	u64 block;
+
+	do
+		block = first + rand64() % (num_blocks - first);
+	while (!test_bit(bmap, block));
+	return block;
+}
+
+static int parent_ok(omfs_info_t *info, u64 parent)
+{
+	omfs_inode_t *dir;
+	int ok;
+
+	if (parent >= swap_be64(info->super->s_num_blocks))
+		return 0;
+	dir = omfs_get_inode(info, parent);
+	if (!dir)
+		return 0;
+	ok = dir->i_head.h_magic == OMFS_IMAGIC &&
+		dir->i_head.h_type == OMFS_INODE_NORMAL &&
+		dir->i_type == OMFS_DIR &&
+		swap_be64(dir->i_head.h_self) == parent;
+	omfs_release_inode(dir);
+	return ok;
+}
+
+/*
+ *  Returns E_NONE if the metadata block looks fine, otherwise the
+ *  first problem found.  Mirror copies are checked like the primary
+ *  copy, but only the primary's parent is looked up.
+ */
+static check_error_t sample_one(check_context_t *ctx, u8 *buf, u64 block)
+{
+	omfs_info_t *info = ctx->omfs_info;
+	omfs_inode_t *inode = (omfs_inode_t *) buf;
+	u64 self = swap_be64(inode->i_head.h_self);
+	u64 root_dir = swap_be64(info->root->r_root_dir);
+
+	if (swap_be32(inode->i_head.h_body_size) >
+	    swap_be32(info->super->s_sys_blocksize))
+		return E_INSANE;
+	if (inode->i_head.h_type != OMFS_INODE_NORMAL &&
+	    inode->i_head.h_type != OMFS_INODE_CONTINUATION)
+		return E_FILE_MAGIC;
+	if (!check_header(buf))
+		return E_HEADER_XOR;
+	if (!check_crc(buf))
+		return E_HEADER_CRC;
+	if (self > block || block - self >=
+	    swap_be32(info->super->s_mirrors))
+		return E_SELF_PTR;
+
+	if (inode->i_head.h_type == OMFS_INODE_NORMAL && self == block &&
+	    block != root_dir && !parent_ok(info, swap_be64(inode->i_parent)))
+		return E_PARENT_PTR;
+
+	return E_NONE;
+}
+
+static void free_bitmap(omfs_info_t *info)
+{
+	free(info->bitmap->bmap);
+	free(info->bitmap->dirty);
+	free(info->bitmap);
+	info->bitmap = NULL;
+}
+
+/*
+ *  Check up to count random metadata blocks, and print the estimated
+ *  fraction that are bad.  Returns 1 if none of them were.
+ */
+int sample_fs(check_context_t *ctx, int count)
+{
+	omfs_info_t *info = ctx->omfs_info;
+	u64 num_blocks = swap_be64(info->super->s_num_blocks);
+	u64 first = first_unreserved(info);
+	u64 block, i, data = 0;
+	u8 *buf;
+	check_error_t err;
+	int n = 0, bad = 0;
+	double p, z = 1.96, center, half;
+
+	if (omfs_load_bitmap(info))
+	{
+		fprintf(stderr, "omfsck: can't read the free space bitmap\n");
+		return 0;
+	}
+	// draw_block needs something to find
+	for (i = first; i < num_blocks && !test_bit(info->bitmap->bmap, i);
+	     i++)
+		;
+	if (i >= num_blocks)
+		count = 0;
+
+	while (n < count && data < (u64) count * MAX_DATA_DRAWS)
+	{
+		block = draw_block(info->bitmap->bmap, first, num_blocks);
+		buf = omfs_get_block(info, block);
+		if (!buf)
+		{
+			n++;
+			bad++;
+			continue;
+		}
+		if (((omfs_inode_t *) buf)->i_head.h_magic != OMFS_IMAGIC)
+		{
+			data++;
+			free(buf);
+			continue;
+		}
+
+		n++;
+		err = sample_one(ctx, buf, block);
+		if (err != E_NONE)
+		{
+			bad++;
+			if (!ctx->config->is_quiet)
+			{
+				ctx->current_inode = (omfs_inode_t *) buf;
+				ctx->block = block;
+				ctx->parent = swap_be64(
+					ctx->current_inode->i_parent);
+				ctx->hash = -1;
+				fix_report(err, ctx);
+			}
+		}
+		free(buf);
+	}
+	ctx->current_inode = NULL;
+	free_bitmap(info);
+
+	if (!n)
+		return 0;
+
+	/* Wilson score interval */
+	p = (double) bad / n;
+	center = (p + z * z / (2 * n)) / (1 + z * z / n);
+	half = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) /
+		(1 + z * z / n);
+
+	if (!ctx->config->is_quiet)
+	{
+		printf("Sampled %d metadata blocks, %d bad; passed over %"
+			PRIu64 " data blocks\n", n, bad, data);
+		printf("Estimated corruption rate: %.4f%% "
+			"(95%% confidence: %.4f%% - %.4f%%)\n", 100 * p,
+			100 * (center - half > 0 ? center - half : 0),
+			100 * (center + half < 1 ? center + half : 1));
+	}
+	return !bad;
+}
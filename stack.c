@@ -5,7 +5,9 @@
 
 stack_t *stack_init()
 {
-	stack_t *stack = malloc(sizeof(stack));
+	stack_t *stack = malloc(sizeof(stack_t));
+	if (!stack)
+		return NULL;
 	stack->next = NULL;
 	return stack;
 }
@@ -17,7 +19,7 @@ int stack_empty(stack_t *stack)
 
 int stack_push(stack_t *stack, void *user)
 {
-	stack_t *new = malloc(sizeof(stack));
+	stack_t *new = malloc(sizeof(stack_t));
 	if (!new)
 		return 0;
 
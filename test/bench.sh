@@ -0,0 +1,98 @@
+#! /bin/bash
+#
+# End-to-end timings of omfsck, omfsdump and mkomfs on generated images.
+#
+# Each tool is run once with the image dropped from the page cache
+# (cold) and once straight after (warm).  Results are appended to
+# $BENCH_OUT, one tab-separated line per run, so runs from different
+# builds can be compared with sort/join or a spreadsheet.
+#
+# Environment:
+#   BENCH_SIZES   entry counts to generate (default "10000 100000")
+#   BENCH_GENFS   extra genfs options, e.g. "-x 20 -H 10"
+#   BENCH_OUT     results file (default bench.tsv)
+#   OMFS_BACKEND  passed through to the tools
+#
+OMFSPROGS=..
+SIZES=${BENCH_SIZES:-"10000 100000"}
+OUT=${BENCH_OUT:-bench.tsv}
+COMMIT=`git rev-parse --short HEAD 2>/dev/null || echo -`
+BACKEND=${OMFS_BACKEND:-stdio}
+DATE=`date +%Y-%m-%dT%H:%M:%S`
+
+# drop an image from the page cache, as root or not
+function drop_cache
+{
+    sync
+    if [[ -w /proc/sys/vm/drop_caches ]]; then
+        echo 1 > /proc/sys/vm/drop_caches
+    else
+        dd if=$1 iflag=nocache count=0 2>/dev/null
+    fi
+}
+
+function now
+{
+    date +%s%N
+}
+
+# pass in:
+# tool cache image entries command...
+function record
+{
+    local tool=$1 cache=$2 img=$3 entries=$4 start end ns rc
+    shift 4
+
+    start=`now`
+    "$@" > /dev/null 2>&1
+    rc=$?
+    end=`now`
+    ns=$((end - start))
+
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%d\t%d.%03d\t%d\n" \
+        $DATE $COMMIT $BACKEND $tool $cache $img "$GENFS_OPTS" $entries \
+        $((ns / 1000000000)) $((ns / 1000000 % 1000)) \
+        $((entries * 1000000000 / (ns ? ns : 1))) | tee -a $OUT
+    if [[ $rc -ne 0 ]]; then
+        echo "$tool exited $rc on $img" >&2
+    fi
+}
+
+# pass in:
+# tool image entries command...
+function cold_warm
+{
+    local tool=$1
+    shift
+
+    drop_cache $1
+    record $tool cold "$@"
+    record $tool warm "$@"
+}
+
+GENFS_OPTS=${BENCH_GENFS:-""}
+
+if [[ ! -s $OUT ]]; then
+    printf "date\tcommit\tbackend\ttool\tcache\timage\tgenfs\tentries\tseconds\tentries/s\n" > $OUT
+fi
+
+for n in $SIZES; do
+    img=bench-$n.img
+    opts="-n $n $GENFS_OPTS"
+    if [[ ! -e $img || "`cat $img.opts 2>/dev/null`" != "$opts" ]]; then
+        ./genfs $opts $img > /dev/null || exit 1
+        echo "$opts" > $img.opts
+    fi
+
+    cold_warm omfsck $img $n $OMFSPROGS/omfsck -n $img
+    cold_warm omfsdump $img $n $OMFSPROGS/omfsdump $img
+
+    # mkomfs on a fresh sparse file the size of the generated image
+    mk=bench-mk.img
+    rm -f $mk
+    truncate -s `stat -c %s $img` $mk
+    mkcmd="yes | $OMFSPROGS/mkomfs -b 2048 $mk"
+    record mkomfs cold $img $n sh -c "$mkcmd"
+    record mkomfs warm $img $n sh -c "$mkcmd"
+    rm -f $mk
+done
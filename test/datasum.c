@@ -0,0 +1,154 @@
+/*
+ *  datasum.c - fill the files of an OMFS image with known data, or
+ *  checksum what they hold.
+ *
+ *  Each file gets a line of name, data blocks and a checksum of its
+ *  blocks in file order, so two listings of the same files can be
+ *  compared after sorting, wherever the tools have moved the inodes
+ *  and data in between.  Files are told apart by name; genfs never
+ *  makes two the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "dirscan.h"
+
+#define FNV_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static omfs_info_t info;
+static int fill;
+static u8 *buf;
+static u32 blocksize;
+
+static u64 fnv(u64 h, const u8 *p, size_t len)
+{
+	while (len--)
+		h = (h ^ *p++) * FNV_PRIME;
+	return h;
+}
+
+/* data block n of the named file */
+static void make_block(const char *name, u64 n)
+{
+	u64 x = fnv(FNV_BASIS, (u8 *) name, strlen(name)) ^ (n + 1);
+	u32 i;
+
+	for (i = 0; i < blocksize; i += sizeof(x))
+	{
+		/* xorshift64 */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(buf + i, &x, sizeof(x));
+	}
+}
+
+static int visit(dirscan_t *d, dirscan_entry_t *de, void *user)
+{
+	omfs_inode_t *inode = de->inode;
+	struct omfs_extent_iter it;
+	struct omfs_extent_entry *entry;
+	u64 start, len, i, n = 0, sum = FNV_BASIS;
+	int count, ret;
+
+	if (inode->i_type != OMFS_FILE)
+		return 0;
+
+	omfs_extent_begin(&info, de->block, inode, &it);
+	while ((ret = omfs_extent_next(&it)) > 0)
+	{
+		entry = &it.table->e_entry;
+		for (count = it.count; count; count--, entry++)
+		{
+			start = swap_be64(entry->e_cluster);
+			len = swap_be64(entry->e_blocks);
+			for (i = 0; i < len; i++, n++)
+			{
+				if (fill)
+				{
+					make_block(inode->i_name, n);
+					ret = omfs_write_data(&info, start + i,
+						1, buf);
+				}
+				else
+					ret = omfs_read_data(&info, start + i,
+						1, buf);
+				if (ret)
+					goto out;
+				sum = fnv(sum, buf, blocksize);
+			}
+		}
+	}
+out:
+	omfs_extent_end(&it);
+	if (ret)
+	{
+		fprintf(stderr, "datasum: %s: %s\n", inode->i_name,
+			strerror(-ret));
+		d->stop = 1;
+		return ret;
+	}
+	if (!fill)
+		printf("%s %" PRIu64 " %016" PRIx64 "\n", inode->i_name, n,
+			sum);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: datasum [-f] <image>\n"
+"  -f        fill every file's data blocks first, from its name\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	omfs_super_t super;
+	omfs_root_t root;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "f")) != -1)
+	{
+		switch (c)
+		{
+			case 'f':
+				fill = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	info.dev = omfs_dev_open(argv[optind], fill, NULL);
+	if (!info.dev)
+	{
+		perror(argv[optind]);
+		exit(2);
+	}
+	info.super = &super;
+	info.root = &root;
+	if (omfs_read_super(&info) || omfs_read_root_block(&info))
+	{
+		fprintf(stderr, "datasum: %s is not an OMFS image\n",
+			argv[optind]);
+		exit(2);
+	}
+	blocksize = swap_be32(super.s_blocksize);
+	buf = malloc(blocksize);
+	if (!buf)
+		exit(2);
+
+	ret = dirscan_begin(&info, visit, &info);
+	omfs_sync(&info);
+	omfs_dev_close(info.dev);
+	free(buf);
+	return ret == 1 ? 0 : 3;
+}
@@ -0,0 +1,66 @@
+#! /bin/bash
+#
+# Plant faults in a generated image with inject, then time omfsck
+# finding and repairing them and check every fault was reported.
+#
+# Usage: faults.sh [entries] [faults] [inject options...]
+#
+OMFSPROGS=..
+ENTRIES=${1:-100000}
+FAULTS=${2:-1000}
+shift $(($# < 2 ? $# : 2))
+BASE=fault-base-$ENTRIES.img
+IMG=fault.img
+OUT=fault-out
+
+function now
+{
+    date +%s%N
+}
+
+function elapsed
+{
+    local ns=$(($2 - $1))
+    printf "%d.%03d" $((ns / 1000000000)) $((ns / 1000000 % 1000))
+}
+
+if [[ ! -e $BASE ]]; then
+    ./genfs -n $ENTRIES $BASE > /dev/null || exit 1
+fi
+cp --sparse=always $BASE $IMG
+./inject -n $FAULTS -o $OUT.manifest "$@" $IMG || exit 1
+
+start=`now`
+$OMFSPROGS/omfsck -n --report=json --report-file=$OUT.json $IMG \
+    > /dev/null
+end=`now`
+echo "detect: `elapsed $start $end`s"
+
+# one "block error" line per finding
+sed -n 's/.*"error": "\([a-z_]*\)", "block": \([0-9]*\).*/\2 \1/p' \
+    $OUT.json > $OUT.found
+
+# bitmap drift shows up as a single bitmap finding, whatever the block
+awk 'NR == FNR { found[$1 " " $2] = 1; if ($2 == "bitmap") bitmap = 1; next }
+     /^#/ { next }
+     { total[$1]++
+       if ($3 == "-") { unchecked[$1]++; next }
+       if (found[$2 " " $3] || ($3 == "bitmap" && bitmap)) hit[$1]++
+       else { missed[$1]++; print "missed: " $0 > "/dev/stderr" } }
+     END { for (k in total)
+             printf "%-10s %6d planted %6d found %6d missed %6d unchecked\n",
+               k, total[k], hit[k], missed[k], unchecked[k]
+           for (k in total) if (missed[k]) bad = 1
+           exit bad }' $OUT.found $OUT.manifest
+result=$?
+
+start=`now`
+$OMFSPROGS/omfsck -y $IMG > /dev/null
+end=`now`
+echo "repair: `elapsed $start $end`s"
+
+$OMFSPROGS/omfsck -n $IMG > /dev/null
+rc=$?
+echo "recheck: exit $rc"
+[[ $rc -ne 0 ]] && result=1
+exit $result
@@ -0,0 +1,564 @@
+/*
+ *  genfs.c - generate a large synthetic OMFS image for benchmarks.
+ *
+ *  The tree is built breadth first: each directory gets up to fanout
+ *  entries, some of which are subdirectories until the depth limit is
+ *  reached.  File data is allocated but never written, so the image
+ *  file stays sparse and only the metadata takes up disk space.
+ *
+ *  The same options and seed always give the same image.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "bits.h"
+#include "create_fs.h"
+
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct gen_config
+{
+	u64 inodes;		/* entries to make, not counting the root */
+	int fanout;		/* entries per directory */
+	int depth;		/* deepest level with subdirectories */
+	int dir_pct;		/* share of entries that are directories */
+	int collide_pct;	/* share of names forced into one bucket */
+	int frag_pct;		/* chance each data block starts a new extent */
+	int adjacent_pct;	/* chance a new extent follows right on */
+	int block_size;
+	int size_dist;
+	u64 size_a, size_b;	/* distribution parameters, in bytes */
+	u64 num_blocks;		/* 0 to estimate */
+	int verbose;
+};
+
+struct queued_dir
+{
+	u64 block;
+	int depth;
+};
+
+struct gen_stats
+{
+	u64 dirs, files, extents, conts, data_blocks;
+};
+
+static omfs_info_t info;
+static struct gen_config cfg = {
+	.inodes = 100000,
+	.fanout = 100,
+	.depth = 8,
+	.dir_pct = 10,
+	.collide_pct = 0,
+	.frag_pct = 0,
+	.block_size = 2048,
+	.size_dist = SIZE_EXP,
+	.size_a = 16384,
+};
+static struct gen_stats gs;
+static u64 next_blk;		/* allocation cursor */
+static u64 made;
+
+static u64 rand64(void)
+{
+	return ((u64) random() << 31) ^ random();
+}
+
+static int parse_size(char *s, u64 *size)
+{
+	char *end;
+
+	*size = strtoull(s, &end, 0);
+	switch (*end)
+	{
+		case 'g': case 'G':
+			*size <<= 10;
+		case 'm': case 'M':
+			*size <<= 10;
+		case 'k': case 'K':
+			*size <<= 10;
+			end++;
+	}
+	return *end == 0 || *end == ':';
+}
+
+/*
+ *  fixed:SIZE, uniform:MIN:MAX or exp:MEAN
+ */
+static int parse_dist(char *s)
+{
+	char *arg = strchr(s, ':');
+
+	if (!arg)
+		return 0;
+	arg++;
+
+	if (!strncmp(s, "fixed:", 6))
+	{
+		cfg.size_dist = SIZE_FIXED;
+		return parse_size(arg, &cfg.size_a);
+	}
+	if (!strncmp(s, "exp:", 4))
+	{
+		cfg.size_dist = SIZE_EXP;
+		return parse_size(arg, &cfg.size_a);
+	}
+	if (!strncmp(s, "uniform:", 8))
+	{
+		char *max = strchr(arg, ':');
+
+		cfg.size_dist = SIZE_UNIFORM;
+		return max && parse_size(arg, &cfg.size_a) &&
+			parse_size(max + 1, &cfg.size_b) &&
+			cfg.size_a <= cfg.size_b;
+	}
+	return 0;
+}
+
+static u64 mean_size(void)
+{
+	if (cfg.size_dist == SIZE_UNIFORM)
+		return (cfg.size_a + cfg.size_b) / 2;
+	return cfg.size_a;
+}
+
+static u64 file_size(void)
+{
+	double u;
+
+	switch (cfg.size_dist)
+	{
+		case SIZE_UNIFORM:
+			return cfg.size_a +
+				rand64() % (cfg.size_b - cfg.size_a + 1);
+		case SIZE_EXP:
+			u = random() / (RAND_MAX + 1.0);
+			return -log(1 - u) * cfg.size_a;
+	}
+	return cfg.size_a;
+}
+
+/*
+ *  Blocks come off a cursor that only moves forward; fragmentation
+ *  leaves holes behind it.
+ */
+static int alloc(u64 count, int align, u64 *block)
+{
+	u64 i, b = next_blk;
+
+	b = (b + align - 1) / align * align;
+	if (b + count > swap_be64(info.super->s_num_blocks))
+		return -ENOSPC;
+
+	for (i = 0; i < count; i++)
+		set_bit(info.bitmap->bmap, b + i);
+
+	next_blk = b + count;
+	*block = b;
+	return 0;
+}
+
+static int alloc_inode(u64 *block)
+{
+	int mirrors = swap_be32(info.super->s_mirrors);
+	return alloc(mirrors, mirrors, block);
+}
+
+static struct omfs_extent *extent_table(omfs_inode_t *inode)
+{
+	int offset = inode->i_head.h_type == OMFS_INODE_CONTINUATION ?
+		OMFS_EXTENT_CONT : OMFS_EXTENT_START;
+
+	return (struct omfs_extent *) ((u8 *) inode + offset);
+}
+
+static int table_size(omfs_inode_t *inode)
+{
+	int offset = inode->i_head.h_type == OMFS_INODE_CONTINUATION ?
+		OMFS_EXTENT_CONT : OMFS_EXTENT_START;
+
+	/* less the table header */
+	return (swap_be32(info.super->s_sys_blocksize) - offset) /
+		sizeof(struct omfs_extent_entry) - 1;
+}
+
+/* put the terminator after count entries, holding total blocks */
+static void end_table(omfs_inode_t *inode, int count, u64 total)
+{
+	struct omfs_extent *oe = extent_table(inode);
+	struct omfs_extent_entry *entry = &oe->e_entry + count;
+
+	entry->e_cluster = ~0ULL;
+	entry->e_blocks = swap_be64(~total);
+	oe->e_extent_count = swap_be32(count + 1);
+}
+
+/*
+ *  Give a file inode the data blocks for size bytes, chaining
+ *  continuation blocks on as each extent table fills.
+ */
+static int add_data(omfs_inode_t *file, u64 size)
+{
+	int bs = swap_be32(info.super->s_blocksize);
+	u64 left = (size + bs - 1) / bs;
+	omfs_inode_t *table = file, *cont;
+	int count = 0, ret = 0;
+	u64 total = 0, start, run, next;
+
+	while (left)
+	{
+		for (run = 1; run < left; run++)
+			if (cfg.frag_pct && random() % 100 < cfg.frag_pct)
+				break;
+
+		if (count == table_size(table) - 1)
+		{
+			if ((ret = alloc_inode(&next)))
+				goto out;
+			cont = omfs_new_inode(&info, next, "",
+				OMFS_INODE_CONTINUATION);
+			if (!cont)
+			{
+				ret = -ENOMEM;
+				goto out;
+			}
+			end_table(table, count, total);
+			extent_table(table)->e_next = swap_be64(next);
+			if (table != file)
+			{
+				omfs_write_inode(&info, table);
+				free(table);
+			}
+			table = cont;
+			count = 0;
+			total = 0;
+			gs.conts++;
+		}
+
+		if ((ret = alloc(run, 1, &start)))
+			goto out;
+
+		(&extent_table(table)->e_entry)[count].e_cluster =
+			swap_be64(start);
+		(&extent_table(table)->e_entry)[count].e_blocks =
+			swap_be64(run);
+		count++;
+		total += run;
+		left -= run;
+		gs.extents++;
+		gs.data_blocks += run;
+
+		if (left && !(cfg.adjacent_pct &&
+		    random() % 100 < cfg.adjacent_pct))
+			next_blk += 1 + random() % 8;
+	}
+out:
+	end_table(table, count, total);
+	if (table != file)
+	{
+		omfs_write_inode(&info, table);
+		free(table);
+	}
+	file->i_size = swap_be64(size);
+	return ret;
+}
+
+/*
+ *  Name the n'th entry, pushing it into the hot bucket if asked.
+ */
+static int make_name(char *name, char type, u64 n, int hot)
+{
+	int k, hash;
+
+	sprintf(name, "%c%" PRIu64, type == OMFS_DIR ? 'd' : 'f', n);
+	hash = omfs_compute_hash(&info, name);
+	if (hot < 0)
+		return hash;
+
+	for (k = 0; hash != hot; k++)
+	{
+		sprintf(name, "%c%" PRIu64 "_%d",
+			type == OMFS_DIR ? 'd' : 'f', n, k);
+		hash = omfs_compute_hash(&info, name);
+	}
+	return hash;
+}
+
+/*
+ *  Fill one directory, adding any subdirectories to the queue.
+ */
+static int fill_dir(struct queued_dir *qd, struct queued_dir **queue,
+	u64 *tail, u64 *qsize)
+{
+	int buckets = (swap_be32(info.super->s_sys_blocksize) -
+		OMFS_DIR_START) / 8;
+	int hot = random() % buckets;
+	char name[64];
+	omfs_inode_t *dir, *inode;
+	u64 *table, block;
+	int i, hash, ret = 0;
+	char type;
+
+	dir = omfs_get_inode(&info, qd->block);
+	if (!dir)
+		return -EIO;
+	table = (u64 *) ((u8 *) dir + OMFS_DIR_START);
+
+	for (i = 0; i < cfg.fanout && made < cfg.inodes; i++)
+	{
+		type = OMFS_FILE;
+		if (qd->depth < cfg.depth && random() % 100 < cfg.dir_pct)
+			type = OMFS_DIR;
+
+		hash = make_name(name, type, made,
+			random() % 100 < cfg.collide_pct ? hot : -1);
+
+		if ((ret = alloc_inode(&block)))
+			break;
+
+		inode = omfs_new_inode(&info, block, name, type);
+		if (!inode)
+		{
+			ret = -ENOMEM;
+			break;
+		}
+		inode->i_parent = swap_be64(qd->block);
+		inode->i_sibling = table[hash];
+		table[hash] = swap_be64(block);
+
+		if (type == OMFS_FILE)
+		{
+			ret = add_data(inode, file_size());
+			gs.files++;
+		}
+		else
+		{
+			if (*tail == *qsize)
+			{
+				struct queued_dir *q;
+
+				*qsize = *qsize ? *qsize * 2 : 1024;
+				q = realloc(*queue, *qsize * sizeof(*q));
+				if (!q)
+				{
+					ret = -ENOMEM;
+					free(inode);
+					break;
+				}
+				*queue = q;
+			}
+			(*queue)[*tail].block = block;
+			(*queue)[*tail].depth = qd->depth + 1;
+			(*tail)++;
+			gs.dirs++;
+		}
+		omfs_write_inode(&info, inode);
+		free(inode);
+		made++;
+		if (ret)
+			break;
+	}
+	omfs_write_inode(&info, dir);
+	free(dir);
+	return ret;
+}
+
+static int generate(void)
+{
+	struct queued_dir *queue = NULL, qd;
+	u64 head = 0, tail = 0, qsize = 0;
+	int ret = 0;
+
+	qd.block = swap_be64(info.root->r_root_dir);
+	qd.depth = 0;
+
+	for (;;)
+	{
+		if ((ret = fill_dir(&qd, &queue, &tail, &qsize)))
+			break;
+		if (made == cfg.inodes)
+			break;
+		if (head == tail)
+		{
+			fprintf(stderr, "genfs: this shape only holds %" PRIu64
+				" entries; raise -f, -d or -D\n", made);
+			break;
+		}
+		qd = queue[head++];
+	}
+	free(queue);
+	return ret;
+}
+
+/*
+ *  Every inode takes two blocks and a file's data its size plus a
+ *  gap for each fragment.  Double that; the image is sparse, so
+ *  spare blocks only cost bitmap.
+ */
+static u64 estimate_blocks(void)
+{
+	u64 data = (mean_size() + cfg.block_size - 1) / cfg.block_size;
+	u64 per_inode = 3 + data + data * cfg.frag_pct * 5 / 100;
+
+	return 2 * (1024 + cfg.inodes * per_inode);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: genfs [options] <image>\n"
+"  -n N      entries to create (default 100000)\n"
+"  -f N      entries per directory (default 100)\n"
+"  -d N      maximum directory depth (default 8)\n"
+"  -D PCT    percentage of entries that are directories (default 10)\n"
+"  -H PCT    percentage of names forced into one hash bucket (default 0)\n"
+"  -s DIST   file sizes: fixed:SIZE, uniform:MIN:MAX or exp:MEAN\n"
+"            (default exp:16k)\n"
+"  -x PCT    chance that each data block starts a new extent (default 0)\n"
+"  -a PCT    chance that a new extent starts right after the last, as\n"
+"            appends leave them (default 0)\n"
+"  -b SIZE   block size (default 2048)\n"
+"  -B N      blocks in the image (default: estimated)\n"
+"  -S SEED   random seed (default 1)\n"
+"  -v        print I/O statistics\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	fs_config_t fs_config = { .cluster_size = 8 };
+	omfs_super_t super;
+	omfs_root_t root;
+	omfs_dev_t *dev;
+	unsigned int seed = 1;
+	char *path;
+	u64 i;
+	int c, fd, ret;
+
+	while ((c = getopt(argc, argv, "n:f:d:D:H:s:x:a:b:B:S:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				cfg.inodes = strtoull(optarg, NULL, 0);
+				break;
+			case 'f':
+				cfg.fanout = atoi(optarg);
+				break;
+			case 'd':
+				cfg.depth = atoi(optarg);
+				break;
+			case 'D':
+				cfg.dir_pct = atoi(optarg);
+				break;
+			case 'H':
+				cfg.collide_pct = atoi(optarg);
+				break;
+			case 's':
+				if (!parse_dist(optarg))
+				{
+					fprintf(stderr, "genfs: bad size "
+						"distribution %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'x':
+				cfg.frag_pct = atoi(optarg);
+				break;
+			case 'a':
+				cfg.adjacent_pct = atoi(optarg);
+				break;
+			case 'b':
+				cfg.block_size = atoi(optarg);
+				break;
+			case 'B':
+				cfg.num_blocks = strtoull(optarg, NULL, 0);
+				break;
+			case 'S':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				cfg.verbose = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 1 || cfg.fanout < 1 ||
+	    cfg.block_size < 2048 || !is_power_of_two(cfg.block_size))
+		usage();
+
+	path = argv[optind];
+	srandom(seed);
+
+	if (!cfg.num_blocks)
+		cfg.num_blocks = estimate_blocks();
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, cfg.num_blocks * cfg.block_size))
+	{
+		perror(path);
+		exit(2);
+	}
+	close(fd);
+
+	dev = omfs_dev_open(path, 1, NULL);
+	if (!dev)
+	{
+		perror(path);
+		exit(2);
+	}
+
+	fs_config.block_size = cfg.block_size;
+	if (!create_fs(dev, cfg.num_blocks * cfg.block_size / 512,
+		&fs_config))
+		exit(3);
+
+	info.dev = dev;
+	info.super = &super;
+	info.root = &root;
+	if (omfs_read_super(&info) || omfs_read_root_block(&info) ||
+	    omfs_load_bitmap(&info))
+	{
+		fprintf(stderr, "genfs: couldn't read back the new fs\n");
+		exit(3);
+	}
+
+	for (i = 0; test_bit(info.bitmap->bmap, i); i++)
+		;
+	next_blk = i;
+
+	ret = generate();
+	if (ret)
+		fprintf(stderr, "genfs: %s after %" PRIu64 " entries%s\n",
+			strerror(-ret), made,
+			ret == -ENOSPC ? "; raise -B" : "");
+
+	omfs_mark_bitmap_dirty(&info);
+	omfs_flush_bitmap(&info);
+	omfs_sync(&info);
+
+	printf("%" PRIu64 " entries (%" PRIu64 " dirs, %" PRIu64 " files), "
+		"%" PRIu64 " extents, %" PRIu64 " continuations\n",
+		made, gs.dirs, gs.files, gs.extents, gs.conts);
+	printf("%" PRIu64 " of %" PRIu64 " blocks used, %" PRIu64
+		" of them data\n", cfg.num_blocks - omfs_count_free(&info),
+		cfg.num_blocks, gs.data_blocks);
+
+	if (cfg.verbose)
+	{
+		struct omfs_stats stats;
+
+		omfs_get_stats(&info, &stats);
+		omfs_print_stats(stdout, &stats);
+	}
+	omfs_dev_close(dev);
+	return ret ? 3 : 0;
+}
@@ -0,0 +1,389 @@
+/*
+ *  inject.c - plant many reproducible faults in an OMFS image.
+ *
+ *  Inode faults go into files only, one per file, and sibling loops
+ *  only into the last file of a hash chain, so no fault hides another
+ *  from omfsck.  Every fault is listed in a manifest, one per line:
+ *
+ *	kind <tab> block <tab> expected finding
+ *
+ *  where the finding is the name omfsck --report=json uses, or "-"
+ *  for faults omfsck has no specific check for.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include "omfs.h"
+#include "bits.h"
+#include "dirscan.h"
+
+enum {
+	F_XOR,
+	F_CRC,
+	F_HASH,
+	F_PARENT,
+	F_SELF,
+	F_LOOP,
+	F_BITMAP,
+	F_CROSSLINK,
+	NUM_KINDS
+};
+
+static struct {
+	char *name;
+	char *finding;
+} kinds[NUM_KINDS] = {
+	{ "xor", "header_xor" },
+	{ "crc", "header_crc" },
+	{ "hash", "hash_wrong" },
+	{ "parent", "parent_ptr" },
+	{ "self", "self_ptr" },
+	{ "loop", "loop" },
+	{ "bitmap", "bitmap" },
+	{ "crosslink", "-" },
+};
+
+struct file
+{
+	u64 block;
+	u64 parent;
+	u64 extent;		/* first data block, or ~0 */
+	u64 extent_blocks;
+	int tail;		/* last in its hash chain */
+	int used;
+};
+
+struct file_list
+{
+	struct file *f;
+	u64 count;
+	u64 size;
+};
+
+static omfs_info_t info;
+static FILE *manifest;
+
+static u64 rand64(void)
+{
+	return ((u64) random() << 31) ^ random();
+}
+
+static int collect(dirscan_t *d, dirscan_entry_t *de, void *user)
+{
+	struct file_list *list = user;
+	omfs_inode_t *inode = de->inode;
+	struct omfs_extent *oe;
+	struct file *f;
+
+	if (inode->i_type != OMFS_FILE)
+		return 0;
+
+	if (list->count == list->size)
+	{
+		list->size = list->size ? list->size * 2 : 1024;
+		f = realloc(list->f, list->size * sizeof(*f));
+		if (!f)
+			return -ENOMEM;
+		list->f = f;
+	}
+	f = &list->f[list->count++];
+	f->block = de->block;
+	f->parent = de->parent;
+	f->tail = swap_be64(inode->i_sibling) == ~0ULL;
+	f->used = 0;
+
+	oe = (struct omfs_extent *) ((u8 *) inode + OMFS_EXTENT_START);
+	f->extent = ~0ULL;
+	f->extent_blocks = 0;
+	if (swap_be32(oe->e_extent_count) > 1)
+	{
+		f->extent = swap_be64(oe->e_entry.e_cluster);
+		f->extent_blocks = swap_be64(oe->e_entry.e_blocks);
+	}
+	return 0;
+}
+
+static void fix_checksums(u8 *buf)
+{
+	omfs_header_t *header = (omfs_header_t *) buf;
+	int i, xor;
+
+	header->h_crc = swap_be16(crc_ccitt_msb(0, buf + sizeof(*header),
+		swap_be32(header->h_body_size)));
+
+	xor = buf[0];
+	for (i = 1; i < OMFS_XOR_COUNT; i++)
+		xor ^= buf[i];
+	header->h_check_xor = xor;
+}
+
+/* write one copy, as bit rot would, or all of them */
+static int put_block(u64 block, u8 *buf, int all)
+{
+	int i, mirrors = all ? swap_be32(info.super->s_mirrors) : 1;
+
+	for (i = 0; i < mirrors; i++)
+		if (omfs_write_block(&info, block + i, buf))
+			return -EIO;
+	return 0;
+}
+
+static void record(int kind, u64 block)
+{
+	fprintf(manifest, "%s\t%" PRIu64 "\t%s\n", kinds[kind].name, block,
+		kinds[kind].finding);
+}
+
+/*
+ *  Pick an unused file, starting from a random one; want_tail and
+ *  want_data narrow it down.  Returns NULL when none is left.
+ */
+static struct file *pick(struct file_list *list, int want_tail,
+	int want_data)
+{
+	u64 i, start = rand64() % list->count;
+	struct file *f;
+
+	for (i = 0; i < list->count; i++)
+	{
+		f = &list->f[(start + i) % list->count];
+		if (f->used || (want_tail && !f->tail) ||
+		    (want_data && f->extent == ~0ULL))
+			continue;
+		f->used = 1;
+		return f;
+	}
+	return NULL;
+}
+
+static int inject_inode(int kind, struct file_list *list)
+{
+	struct file *f, *other = NULL;
+	omfs_inode_t *inode;
+	struct omfs_extent *oe;
+	u64 block;
+	int hash, ret;
+
+	f = pick(list, kind == F_LOOP, kind == F_CROSSLINK);
+	if (!f)
+		return -ENOENT;
+	if (kind == F_CROSSLINK && !(other = pick(list, 0, 1)))
+		return -ENOENT;
+
+	inode = omfs_get_inode(&info, f->block);
+	if (!inode)
+		return -EIO;
+
+	switch (kind)
+	{
+		case F_XOR:
+			inode->i_head.h_check_xor ^= 1 << (random() % 8);
+			break;
+		case F_CRC:
+			inode->i_fill3[random() % sizeof(inode->i_fill3)] ^=
+				1 << (random() % 8);
+			break;
+		case F_HASH:
+			/* rename it into another bucket */
+			hash = omfs_compute_hash(&info, inode->i_name);
+			do {
+				sprintf(inode->i_name, "moved%" PRIu64 "_%ld",
+					f->block, random() % 1000);
+			} while (omfs_compute_hash(&info, inode->i_name) ==
+				hash);
+			break;
+		case F_PARENT:
+			do {
+				block = rand64() %
+					swap_be64(info.super->s_num_blocks);
+			} while (block == f->parent);
+			inode->i_parent = swap_be64(block);
+			break;
+		case F_SELF:
+			inode->i_head.h_self = swap_be64(f->block +
+				2 * (1 + random() % 16));
+			break;
+		case F_LOOP:
+			inode->i_sibling = swap_be64(f->block);
+			break;
+		case F_CROSSLINK:
+			/* share the other file's first extent */
+			oe = (struct omfs_extent *) ((u8 *) inode +
+				OMFS_EXTENT_START);
+			oe->e_entry.e_cluster = swap_be64(other->extent);
+			if (other->extent_blocks < f->extent_blocks)
+				oe->e_entry.e_blocks =
+					swap_be64(other->extent_blocks);
+			break;
+	}
+
+	if (kind != F_XOR && kind != F_CRC)
+		fix_checksums((u8 *) inode);
+	ret = put_block(f->block, (u8 *) inode, kind != F_XOR &&
+		kind != F_CRC);
+	free(inode);
+	if (!ret)
+		record(kind, f->block);
+	return ret;
+}
+
+/* bitmap drift: flip a bit, allocated or not, past the reserved area */
+static int inject_bitmap(void)
+{
+	u64 num_blocks = swap_be64(info.super->s_num_blocks);
+	u64 first = swap_be64(info.root->r_bitmap) + 1;
+	u64 block = first + rand64() % (num_blocks - first);
+	int blocksize = swap_be32(info.super->s_blocksize);
+
+	if (test_bit(info.bitmap->bmap, block))
+		clear_bit(info.bitmap->bmap, block);
+	else
+		set_bit(info.bitmap->bmap, block);
+	set_bit(info.bitmap->dirty, (block >> 3) / blocksize);
+	record(F_BITMAP, block);
+	return 0;
+}
+
+static int parse_kinds(char *s, int *enabled)
+{
+	char *tok;
+	int i;
+
+	memset(enabled, 0, NUM_KINDS * sizeof(int));
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ","))
+	{
+		for (i = 0; i < NUM_KINDS; i++)
+			if (!strcmp(tok, kinds[i].name))
+				break;
+		if (i == NUM_KINDS)
+			return 0;
+		enabled[i] = 1;
+	}
+	return 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: inject [options] <image>\n"
+"  -n N      faults to plant (default 1000)\n"
+"  -k KINDS  comma separated, from xor,crc,hash,parent,self,loop,\n"
+"            bitmap,crosslink (default all)\n"
+"  -o FILE   manifest (default stdout)\n"
+"  -S SEED   random seed (default 1)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int enabled[NUM_KINDS];
+	struct file_list list = { NULL, 0, 0 };
+	omfs_super_t super;
+	omfs_root_t root;
+	u64 count = 1000, made = 0, i;
+	unsigned int seed = 1;
+	int c, kind, ret = 0, skipped = 0;
+
+	for (i = 0; i < NUM_KINDS; i++)
+		enabled[i] = 1;
+	manifest = stdout;
+
+	while ((c = getopt(argc, argv, "n:k:o:S:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				count = strtoull(optarg, NULL, 0);
+				break;
+			case 'k':
+				if (!parse_kinds(optarg, enabled))
+					usage();
+				break;
+			case 'o':
+				manifest = fopen(optarg, "w");
+				if (!manifest)
+				{
+					perror(optarg);
+					exit(2);
+				}
+				break;
+			case 'S':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+	srandom(seed);
+
+	info.dev = omfs_dev_open(argv[optind], 1, NULL);
+	if (!info.dev)
+	{
+		perror(argv[optind]);
+		exit(2);
+	}
+	info.super = &super;
+	info.root = &root;
+	if (omfs_read_super(&info) || omfs_read_root_block(&info) ||
+	    omfs_load_bitmap(&info))
+	{
+		fprintf(stderr, "inject: %s is not an OMFS image\n",
+			argv[optind]);
+		exit(2);
+	}
+
+	if (dirscan_begin(&info, collect, &list) != 1 || !list.count)
+	{
+		fprintf(stderr, "inject: no files to put faults in\n");
+		exit(2);
+	}
+
+	fprintf(manifest, "# kind\tblock\tfinding (seed %u)\n", seed);
+
+	/* kinds in turn, so any count gets an even mix */
+	for (kind = 0; made < count && skipped < NUM_KINDS;
+	     kind = (kind + 1) % NUM_KINDS)
+	{
+		if (!enabled[kind])
+		{
+			skipped++;
+			continue;
+		}
+		if (kind == F_BITMAP)
+			ret = inject_bitmap();
+		else
+			ret = inject_inode(kind, &list);
+
+		if (ret == -ENOENT)
+		{
+			/* out of suitable files for this kind */
+			enabled[kind] = 0;
+			skipped = 0;
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			break;
+		made++;
+		skipped = 0;
+	}
+
+	if (!ret)
+		ret = omfs_flush_bitmap(&info);
+	omfs_sync(&info);
+	omfs_dev_close(info.dev);
+	if (manifest != stdout)
+		fclose(manifest);
+
+	fprintf(stderr, "inject: planted %" PRIu64 " faults in %" PRIu64
+		" files\n", made, list.count);
+	if (made < count)
+		fprintf(stderr, "inject: ran out of files for the rest\n");
+	return ret ? 3 : 0;
+}
@@ -0,0 +1,39 @@
+#! /bin/bash
+#
+# Plant sibling loops with inject and check that the tools which
+# scan the tree give up on them instead of going round for ever.
+#
+# Usage: loops.sh [entries]
+#
+OMFSPROGS=..
+ENTRIES=${1:-1000}
+IMG=loops.img
+TIMEOUT=10
+
+./genfs -n $ENTRIES $IMG > /dev/null &&
+./inject -n 3 -k loop -o loops.manifest $IMG 2> /dev/null || exit 1
+
+result=0
+for tool in "omfsdump" "omfsdump --hash-stats" "omfsdump --frag-summary" \
+    "omfsreorder -n" "omfsreorder -n -r" "omfsdefrag -n" "omfsck -n"; do
+    timeout $TIMEOUT $OMFSPROGS/$tool $IMG > /dev/null 2>&1
+    rc=$?
+    if [[ $rc -eq 124 ]]; then
+        echo "$tool: still running after ${TIMEOUT}s"
+        result=1
+    elif [[ $rc -eq 0 ]]; then
+        echo "$tool: exit 0 on a looped tree"
+        result=1
+    else
+        echo "$tool: exit $rc"
+    fi
+done
+
+# and omfsck cuts them
+cp --sparse=always $IMG loops-fixed.img
+$OMFSPROGS/omfsck -y loops-fixed.img > /dev/null
+$OMFSPROGS/omfsck -n loops-fixed.img > /dev/null
+rc=$?
+echo "recheck: exit $rc"
+[[ $rc -ne 0 ]] && result=1
+exit $result
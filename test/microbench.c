@@ -0,0 +1,360 @@
+/*
+ *  microbench.c - time the inner loops of libomfs.
+ *
+ *  Each kernel is run for a number of samples, every sample long
+ *  enough for the clock to be meaningful, and the per-op times are
+ *  reported as percentiles.  Cycle counts come from the TSC where
+ *  there is one, which ticks at the nominal clock rate.
+ *
+ *  Baselines only mean anything on the machine that wrote them, so
+ *  none is kept in the tree; "make microbench" writes one on its first
+ *  run and compares against it after that.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include "omfs.h"
+#include "bits.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define NUM_NAMES 1000
+#define MAP_BLOCKS (1 << 20)
+#define MAX_RESULTS 64
+
+struct result
+{
+	char name[32];
+	double p50, p90, p99;		/* ns per op */
+	double cycles_per_byte;		/* 0 without a TSC */
+};
+
+static struct result results[MAX_RESULTS];
+static int num_results;
+static int samples = 101;
+static char *only;
+
+static omfs_info_t info;
+static omfs_super_t super;
+static omfs_bitmap_t bitmap;
+static u8 buf[8192];
+static char *names[NUM_NAMES];
+static u64 name_bytes;
+static u8 *map;
+static int scan_size;
+static volatile u64 sink;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *) a, y = *(double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ *  Time fn, which does ops operations over bytes bytes per call.
+ */
+static void run(char *name, void (*fn)(void), u64 ops, u64 bytes)
+{
+	struct result *r;
+	double *ns, *cpb;
+	u64 reps, i, j, t0, t1, c0, c1;
+
+	if ((only && !strstr(name, only)) || num_results == MAX_RESULTS)
+		return;
+
+	/* enough reps for a sample to take 200us */
+	fn();
+	for (reps = 1; ; reps *= 2)
+	{
+		t0 = now_ns();
+		for (j = 0; j < reps; j++)
+			fn();
+		if (now_ns() - t0 > 200000)
+			break;
+	}
+
+	ns = malloc(samples * sizeof(double));
+	cpb = malloc(samples * sizeof(double));
+	for (i = 0; i < samples; i++)
+	{
+		t0 = now_ns();
+		c0 = cycles();
+		for (j = 0; j < reps; j++)
+			fn();
+		c1 = cycles();
+		t1 = now_ns();
+		ns[i] = (double) (t1 - t0) / (reps * ops);
+		cpb[i] = bytes ? (double) (c1 - c0) / (reps * bytes) : 0;
+	}
+	qsort(ns, samples, sizeof(double), cmp_double);
+	qsort(cpb, samples, sizeof(double), cmp_double);
+
+	r = &results[num_results++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->p50 = ns[samples / 2];
+	r->p90 = ns[samples * 9 / 10];
+	r->p99 = ns[samples * 99 / 100];
+	r->cycles_per_byte = cpb[samples / 2];
+
+	printf("%-20s %10.1f %10.1f %10.1f %12.0f %8.2f\n", r->name,
+		r->p50, r->p90, r->p99, 1e9 / r->p50, r->cycles_per_byte);
+	free(ns);
+	free(cpb);
+}
+
+static void crc_2k(void)
+{
+	sink += crc_ccitt_msb(0, buf, 2048);
+}
+
+static void crc_8k(void)
+{
+	sink += crc_ccitt_msb(0, buf, 8192);
+}
+
+static void hash_names(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_NAMES; i++)
+		sink += omfs_compute_hash(&info, names[i]);
+}
+
+static void swap_2k(void)
+{
+	omfs_swap_buffer(buf, 2048);
+}
+
+static void count_free(void)
+{
+	sink += omfs_count_free(&info);
+}
+
+/* find a free run, then give it back so every call sees the same map */
+static void scan_map(void)
+{
+	u64 i, bsize = MAP_BLOCKS / 8;
+	int b = omfs_scan_bitmap(map, bsize, scan_size);
+
+	for (i = b; i < b + scan_size && i < bsize * 8; i++)
+		clear_bit(map, i);
+	sink += b;
+}
+
+static void bit_loop(void)
+{
+	u64 i, n = 0;
+
+	for (i = 0; i < MAP_BLOCKS; i++)
+		set_bit(buf, i & 0xffff);
+	for (i = 0; i < MAP_BLOCKS; i++)
+		n += test_bit(buf, i & 0xffff) != 0;
+	sink += n;
+}
+
+/* a mix of the names cameras, music players and people make */
+static void make_names(void)
+{
+	static char *words[] = { "Holiday", "notes", "Draft", "backup",
+		"Final", "scan", "Meeting", "budget", "Photos", "misc" };
+	char name[128];
+	int i;
+
+	for (i = 0; i < NUM_NAMES; i++)
+	{
+		switch (i % 6)
+		{
+			case 0:
+				sprintf(name, "IMG_%04d.JPG", i);
+				break;
+			case 1:
+				sprintf(name, "DSC%05ld.NEF", random() % 100000);
+				break;
+			case 2:
+				sprintf(name, "%02d - %s %s.mp3", i % 20 + 1,
+					words[random() % 10],
+					words[random() % 10]);
+				break;
+			case 3:
+				sprintf(name, "report-%04d-%02d-%02d.pdf",
+					2000 + i % 25, i % 12 + 1, i % 28 + 1);
+				break;
+			case 4:
+				sprintf(name, "%s", words[i % 10]);
+				break;
+			default:
+				sprintf(name, "%s %s copy %d of the %s "
+					"folder.txt", words[random() % 10],
+					words[random() % 10], i,
+					words[random() % 10]);
+		}
+		names[i] = strdup(name);
+		name_bytes += strlen(name);
+	}
+}
+
+static void fill_map(int pct)
+{
+	u64 i;
+
+	memset(map, 0, MAP_BLOCKS / 8);
+	for (i = 0; i < MAP_BLOCKS; i++)
+		if (random() % 1000 < pct * 10)
+			set_bit(map, i);
+}
+
+static void write_baseline(char *path)
+{
+	FILE *fp = fopen(path, "w");
+	int i;
+
+	if (!fp)
+	{
+		perror(path);
+		exit(2);
+	}
+	fprintf(fp, "# microbench baseline, name and median ns/op; "
+		"regenerate with microbench -w on the machine compared\n");
+	for (i = 0; i < num_results; i++)
+		fprintf(fp, "%s %.2f\n", results[i].name, results[i].p50);
+	fclose(fp);
+}
+
+/*
+ *  Compare with a saved baseline; a kernel whose median is more than
+ *  tolerance percent slower counts as a regression.
+ */
+static int compare_baseline(char *path, int tolerance)
+{
+	FILE *fp = fopen(path, "r");
+	char line[128], name[64];
+	double base, ratio;
+	int i, bad = 0;
+
+	if (!fp)
+	{
+		perror(path);
+		exit(2);
+	}
+	printf("\n%-20s %10s %10s %8s\n", "vs baseline", "base", "now",
+		"ratio");
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#' || sscanf(line, "%63s %lf", name, &base) != 2)
+			continue;
+		for (i = 0; i < num_results; i++)
+		{
+			if (strcmp(results[i].name, name))
+				continue;
+			ratio = results[i].p50 / base;
+			printf("%-20s %10.1f %10.1f %8.2f%s\n", name, base,
+				results[i].p50, ratio,
+				ratio > 1 + tolerance / 100.0 ? "  SLOWER" : "");
+			if (ratio > 1 + tolerance / 100.0)
+				bad++;
+		}
+	}
+	fclose(fp);
+	return bad;
+}
+
+int main(int argc, char *argv[])
+{
+	static int fills[] = { 0, 50, 90, 99 };
+	char *baseline = NULL, *write = NULL;
+	int tolerance = 20;
+	char name[32];
+	int c, i;
+
+	while ((c = getopt(argc, argv, "b:w:t:n:")) != -1)
+	{
+		switch (c)
+		{
+			case 'b':
+				baseline = optarg;
+				break;
+			case 'w':
+				write = optarg;
+				break;
+			case 't':
+				tolerance = atoi(optarg);
+				break;
+			case 'n':
+				samples = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-b baseline] "
+					"[-w baseline] [-t pct] [-n samples] "
+					"[name]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind < argc)
+		only = argv[optind];
+	if (samples < 1)
+		samples = 1;
+
+	srandom(1);
+	super.s_sys_blocksize = swap_be32(2048);
+	super.s_blocksize = swap_be32(2048);
+	super.s_num_blocks = swap_be64(MAP_BLOCKS);
+	info.super = &super;
+	info.bitmap = &bitmap;
+	map = malloc(MAP_BLOCKS / 8);
+	bitmap.bmap = map;
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = random();
+	make_names();
+
+	printf("%-20s %10s %10s %10s %12s %8s\n", "kernel", "p50 ns",
+		"p90 ns", "p99 ns", "ops/s", "cyc/B");
+
+	run("crc_2k", crc_2k, 1, 2048);
+	run("crc_8k", crc_8k, 1, 8192);
+	run("hash_names", hash_names, NUM_NAMES, name_bytes);
+	run("swap_2k", swap_2k, 1, 2048);
+
+	fill_map(50);
+	run("count_free_1m", count_free, 1, MAP_BLOCKS / 8);
+
+	for (i = 0; i < sizeof(fills) / sizeof(fills[0]); i++)
+	{
+		fill_map(fills[i]);
+		for (scan_size = 1; scan_size <= 8; scan_size *= 2)
+		{
+			if (scan_size == 4)
+				continue;
+			sprintf(name, "scan%d_fill%d", scan_size, fills[i]);
+			run(name, scan_map, 1, 0);
+		}
+	}
+	run("set_test_bit_1m", bit_loop, 2 * MAP_BLOCKS, MAP_BLOCKS / 4);
+
+	if (write)
+		write_baseline(write);
+	if (baseline && compare_baseline(baseline, tolerance))
+		return 1;
+	return 0;
+}
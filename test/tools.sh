@@ -0,0 +1,58 @@
+#! /bin/bash
+#
+# Run omfsreorder and omfsdefrag over a generated image with known
+# data in every file.  After each, check that omfsck finds nothing,
+# that every file reads back the same, and that omfsundo puts the
+# image back as it was.  A tool with nothing to do writes no undo
+# file, and mustn't have touched the image either.
+#
+# Usage: tools.sh [entries]
+#
+OMFSPROGS=..
+ENTRIES=${1:-2000}
+BASE=tools-base-$ENTRIES.img
+IMG=tools.img
+OUT=tools-out
+
+if [[ ! -e $BASE ]]; then
+    ./genfs -n $ENTRIES -x 20 -a 30 $BASE > /dev/null &&
+    ./datasum -f $BASE || { rm -f $BASE; exit 1; }
+fi
+./datasum $BASE | sort > $OUT.sums || exit 1
+
+result=0
+
+function check
+{
+    local name=$1
+    shift
+
+    cp --sparse=always $BASE $IMG
+    rm -f $OUT.undo
+    if ! "$@" -u $OUT.undo $IMG > $OUT.log 2>&1; then
+        echo "$name: failed, see $OUT.log"
+        result=1
+        return
+    fi
+
+    $OMFSPROGS/omfsck -n $IMG > $OUT.fsck
+    local rc=$?
+    ./datasum $IMG | sort | cmp -s - $OUT.sums
+    local data=$?
+    if [[ -e $OUT.undo ]]; then
+        $OMFSPROGS/omfsundo $OUT.undo $IMG > /dev/null
+    fi
+    cmp -s $IMG $BASE
+    local undo=$?
+
+    echo "$name: omfsck exit $rc, data `[[ $data -eq 0 ]] && echo same ||
+        echo DIFFERS`, undo `[[ $undo -eq 0 ]] && echo restored ||
+        echo FAILED`"
+    [[ $rc -ne 0 || $data -ne 0 || $undo -ne 0 ]] && result=1
+}
+
+check "omfsreorder -r" $OMFSPROGS/omfsreorder -r
+check "omfsreorder -L" $OMFSPROGS/omfsreorder -L
+check "omfsdefrag" $OMFSPROGS/omfsdefrag
+check "omfsdefrag -c" $OMFSPROGS/omfsdefrag -c
+exit $result